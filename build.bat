@@ -1 +1,4 @@
-cl /EHsc /O2 kernel32.lib user32.lib gdi32.lib shell32.lib source\main.cpp source\software_renderer.cpp source\asset_loading.cpp source\logging.cpp
+cl /EHsc /O2 kernel32.lib user32.lib gdi32.lib shell32.lib source\main.cpp source\software_renderer.cpp source\asset_loading.cpp source\logging.cpp source\texture.cpp source\job_system.cpp source\memory.cpp source\mesh_cache.cpp source\mesh_processing.cpp source\scene.cpp source\picking.cpp
+cl /EHsc /O2 source\main_headless.cpp source\software_renderer.cpp source\asset_loading.cpp source\logging.cpp source\texture.cpp source\job_system.cpp source\memory.cpp source\mesh_cache.cpp source\mesh_processing.cpp source\scene.cpp source\picking.cpp
+cl /EHsc /O2 source\mesh_converter.cpp source\mesh_cache.cpp source\mesh_processing.cpp source\asset_loading.cpp source\texture.cpp source\job_system.cpp source\memory.cpp
+cl /EHsc /O2 source\math_check.cpp
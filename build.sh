@@ -0,0 +1,6 @@
+#!/bin/sh
+FILES="source/software_renderer.cpp source/asset_loading.cpp source/logging.cpp source/texture.cpp source/job_system.cpp source/memory.cpp source/mesh_cache.cpp source/mesh_processing.cpp source/scene.cpp source/picking.cpp"
+g++ -std=c++11 -O2 source/main_x11.cpp $FILES -o main_x11 -lX11 -lXext -lpthread
+g++ -std=c++11 -O2 source/main_headless.cpp $FILES -o main_headless -lpthread
+g++ -std=c++11 -O2 source/mesh_converter.cpp source/mesh_cache.cpp source/mesh_processing.cpp source/asset_loading.cpp source/texture.cpp source/job_system.cpp source/memory.cpp -o mesh_converter -lpthread
+g++ -std=c++11 -O2 -ffp-contract=off source/math_check.cpp -o math_check
@@ -12,9 +12,91 @@ Creation date: 5/31/2019
 End Header --------------------------------------------------------*/
 
 #include "asset_loading.h"
+#include "texture.h"
+#include "memory.h"
+#include "job_system.h"
+#include "mesh_processing.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unordered_map>
+
+// A corner of a face refers to a position, texture coordinate and normal separately
+// Indices start at 1 and 0 means the index is missing
+struct ObjFaceVertex
+{
+  s32 position;
+  s32 texture_coord;
+  s32 normal;
+
+  bool operator==(const ObjFaceVertex &other) const
+  {
+    return position == other.position && texture_coord == other.texture_coord && normal == other.normal;
+  }
+};
+
+struct ObjFaceVertexHash
+{
+  size_t operator()(const ObjFaceVertex &vertex) const
+  {
+    u32 hash = (u32)vertex.position * 0x9E3779B1u;
+    hash ^= (u32)vertex.texture_coord * 0x85EBCA77u + (hash << 6) + (hash >> 2);
+    hash ^= (u32)vertex.normal * 0xC2B2AE3Du + (hash << 6) + (hash >> 2);
+    return hash;
+  }
+};
+
+// Bits of ObjChunk::relative for negative indices that count back from the end of the chunk's
+// elements instead of being 1 based indices into the whole file
+#define OBJ_RELATIVE_POSITION      1
+#define OBJ_RELATIVE_TEXTURE_COORD 2
+#define OBJ_RELATIVE_NORMAL        4
+
+// A g or o line, starting at a face of the chunk it is in
+struct ObjChunkGroup
+{
+  std::string name;
+  u32 first_face;
+};
+
+// Everything read from one line aligned piece of the file
+struct ObjChunk
+{
+  const char *start;
+  const char *end;
+
+  std::vector<v3> positions;
+  std::vector<v2> texture_coords;
+  std::vector<v3> normals;
+
+  // The corners of every face one after another, with the number of corners of each face
+  std::vector<ObjFaceVertex> face_vertices;
+  std::vector<u8> relative;
+  std::vector<u32> face_sizes;
+
+  std::vector<ObjChunkGroup> groups;
+};
+
+// Chunks are at least this big so small files are not split for nothing
+#define OBJ_MIN_CHUNK_SIZE (1024 * 1024)
+
+static bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_spaces(const char *c, const char *end)
+{
+  while(c < end && is_space(*c)) c++;
+  return c;
+}
+
+static const char *skip_line(const char *c, const char *end)
+{
+  while(c < end && *c != '\n') c++;
+  return c < end ? c + 1 : end;
+}
 
 static bool is_digit(char c)
 {
@@ -22,143 +104,813 @@ static bool is_digit(char c)
   return false;
 }
 
-void load_obj(const char *path_to_obj, std::vector<v3> *vertices, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<unsigned> *indices)
+// Reads a signed integer. Returns false if there are no digits.
+static bool parse_int(const char **c, const char *end, s32 *result)
+{
+  const char *p = *c;
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+'))
+  {
+    negative = (*p == '-');
+    p++;
+  }
+
+  if(p == end || !is_digit(*p)) return false;
+
+  s32 value = 0;
+  while(p < end && is_digit(*p))
+  {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+
+  *result = negative ? -value : value;
+  *c = p;
+  return true;
+}
+
+// Reads a float like 1, -0.5, .25 or 1.5e-3 without going through atof and the locale
+// Up to 19 significant digits are kept, which is more than a float can hold
+static bool parse_float(const char **c, const char *end, f32 *result)
+{
+  static const f64 powers_of_10[] =
+  {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  const char *p = *c;
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+'))
+  {
+    negative = (*p == '-');
+    p++;
+  }
+
+  u64 mantissa = 0;
+  s32 exponent = 0;
+  u32 digits = 0;
+  bool any_digits = false;
+
+  while(p < end && is_digit(*p))
+  {
+    if(digits < 19)
+    {
+      mantissa = mantissa * 10 + (*p - '0');
+      if(mantissa) digits++;
+    }
+    else
+    {
+      exponent++;
+    }
+    any_digits = true;
+    p++;
+  }
+
+  if(p < end && *p == '.')
+  {
+    p++;
+    while(p < end && is_digit(*p))
+    {
+      if(digits < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        if(mantissa) digits++;
+        exponent--;
+      }
+      any_digits = true;
+      p++;
+    }
+  }
+
+  if(!any_digits) return false;
+
+  if(p < end && (*p == 'e' || *p == 'E'))
+  {
+    const char *exponent_start = p + 1;
+    s32 written_exponent;
+    if(parse_int(&exponent_start, end, &written_exponent))
+    {
+      exponent += written_exponent;
+      p = exponent_start;
+    }
+  }
+
+  f64 value = (f64)mantissa;
+  if(exponent < 0)
+  {
+    while(exponent < -22)
+    {
+      value /= 1e22;
+      exponent += 22;
+    }
+    value /= powers_of_10[-exponent];
+  }
+  else
+  {
+    while(exponent > 22)
+    {
+      value *= 1e22;
+      exponent -= 22;
+    }
+    value *= powers_of_10[exponent];
+  }
+
+  *result = (f32)(negative ? -value : value);
+  *c = p;
+  return true;
+}
+
+// Reads up to count floats, the ones that are missing stay as they are
+static const char *parse_floats(const char *c, const char *end, f32 *values, u32 count)
+{
+  for(u32 i = 0; i < count; i++)
+  {
+    c = skip_spaces(c, end);
+    if(!parse_float(&c, end, &values[i])) break;
+  }
+  return c;
+}
+
+// Reads one index of a face vertex. Negative indices count back from the
+// elements read so far and are stored relative to the end of the chunk's elements.
+static void parse_face_index(const char **c, const char *end, u32 chunk_count, u8 relative_bit, s32 *index, u8 *relative)
+{
+  s32 value;
+  if(!parse_int(c, end, &value)) return;
+
+  if(value < 0)
+  {
+    *index = (s32)chunk_count + value;
+    *relative |= relative_bit;
+  }
+  else
+  {
+    *index = value;
+  }
+}
+
+// Reads a face vertex with the format v, v/vt, v//vn or v/vt/vn
+static bool parse_face_vertex(const char **c, const char *end, ObjChunk *chunk)
+{
+  ObjFaceVertex vertex = {};
+  u8 relative = 0;
+
+  const char *start = *c;
+  parse_face_index(c, end, chunk->positions.size(), OBJ_RELATIVE_POSITION, &vertex.position, &relative);
+  if(*c == start) return false;
+
+  if(*c < end && **c == '/')
+  {
+    (*c)++;
+    parse_face_index(c, end, chunk->texture_coords.size(), OBJ_RELATIVE_TEXTURE_COORD, &vertex.texture_coord, &relative);
+
+    if(*c < end && **c == '/')
+    {
+      (*c)++;
+      parse_face_index(c, end, chunk->normals.size(), OBJ_RELATIVE_NORMAL, &vertex.normal, &relative);
+    }
+  }
+
+  chunk->face_vertices.push_back(vertex);
+  chunk->relative.push_back(relative);
+  return true;
+}
+
+// Job that parses the lines of one chunk
+static void parse_obj_chunk(void *data, u32 index)
+{
+  ObjChunk *chunk = (ObjChunk *)data + index;
+  const char *c = chunk->start;
+  const char *end = chunk->end;
+
+  while(c < end)
+  {
+    c = skip_spaces(c, end);
+    if(c == end) break;
+
+    if(c[0] == 'v' && c + 1 < end && is_space(c[1]))
+    {
+      // Vertices have format v 0.0 1.0 2.0, anything after z is ignored
+      v3 position;
+      c = parse_floats(c + 1, end, &position.x, 3);
+      chunk->positions.push_back(position);
+    }
+    else if(c[0] == 'v' && c + 2 < end && c[1] == 't' && is_space(c[2]))
+    {
+      // Texture coordinates have format vt 0.0 1.0
+      v2 texture_coord;
+      c = parse_floats(c + 2, end, &texture_coord.x, 2);
+      chunk->texture_coords.push_back(texture_coord);
+    }
+    else if(c[0] == 'v' && c + 2 < end && c[1] == 'n' && is_space(c[2]))
+    {
+      // Normals have format vn 0.0 1.0 2.0
+      v3 normal;
+      c = parse_floats(c + 2, end, &normal.x, 3);
+      chunk->normals.push_back(normal);
+    }
+    else if(c[0] == 'f' && c + 1 < end && is_space(c[1]))
+    {
+      // Faces have format f 1 2 3 ... or f 1/1/1 2/2/2 3/3/3 ...
+      c++;
+      u32 face_size = 0;
+      for(;;)
+      {
+        c = skip_spaces(c, end);
+        if(!parse_face_vertex(&c, end, chunk)) break;
+        face_size++;
+      }
+
+      if(face_size >= 3)
+      {
+        chunk->face_sizes.push_back(face_size);
+      }
+      else
+      {
+        // Not a polygon
+        chunk->face_vertices.resize(chunk->face_vertices.size() - face_size);
+        chunk->relative.resize(chunk->relative.size() - face_size);
+      }
+    }
+    else if((c[0] == 'g' || c[0] == 'o') && c + 1 < end && is_space(c[1]))
+    {
+      // Groups and objects have format g name
+      const char *name_start = skip_spaces(c + 1, end);
+      const char *name_end = name_start;
+      while(name_end < end && *name_end != '\n' && *name_end != '\r') name_end++;
+      while(name_end > name_start && is_space(name_end[-1])) name_end--;
+
+      ObjChunkGroup group;
+      group.name = std::string(name_start, name_end);
+      group.first_face = chunk->face_sizes.size();
+      chunk->groups.push_back(group);
+    }
+
+    // Comments, materials, smoothing groups and anything else are skipped
+    c = skip_line(c, end);
+  }
+}
+
+// Turns an index from a chunk into a 0 based index into the whole file, or -1 if it is missing or out of range
+static s32 resolve_index(s32 index, bool relative, u32 chunk_base, u32 total)
+{
+  if(relative)
+  {
+    index += chunk_base;
+  }
+  else
+  {
+    if(index == 0) return -1;
+    index -= 1;
+  }
+
+  return (index >= 0 && (u32)index < total) ? index : -1;
+}
+
+// Everything read from the file and the vertices made from it so far
+struct ObjData
 {
-  FILE *file = fopen(path_to_obj, "rb");
-  if(!file)
+  std::vector<v3> positions;
+  std::vector<v2> texture_coords;
+  std::vector<v3> normals;
+
+  // Each different combination of position, texture coordinate and normal becomes one vertex
+  bool split_vertices;
+  std::unordered_map<ObjFaceVertex, unsigned, ObjFaceVertexHash> vertex_map;
+
+  std::vector<v3> *out_vertices;
+  std::vector<v2> *out_texture_coords;
+  std::vector<v3> *out_normals;
+};
+
+// Returns the index of the vertex for a face vertex with 0 based indices, adding the vertex if it is new
+static unsigned add_face_vertex(ObjData *obj, ObjFaceVertex face_vertex)
+{
+  if(!obj->split_vertices) return face_vertex.position;
+
+  std::unordered_map<ObjFaceVertex, unsigned, ObjFaceVertexHash>::iterator it = obj->vertex_map.find(face_vertex);
+  if(it != obj->vertex_map.end()) return it->second;
+
+  unsigned index = obj->out_vertices->size();
+  obj->vertex_map[face_vertex] = index;
+
+  obj->out_vertices->push_back(obj->positions[face_vertex.position]);
+  if(obj->out_texture_coords)
+  {
+    v2 texture_coord = face_vertex.texture_coord >= 0 ? obj->texture_coords[face_vertex.texture_coord] : v2();
+    obj->out_texture_coords->push_back(texture_coord);
+  }
+  if(obj->out_normals)
+  {
+    v3 normal = face_vertex.normal >= 0 ? obj->normals[face_vertex.normal] : v3();
+    obj->out_normals->push_back(normal);
+  }
+
+  return index;
+}
+
+// Ends the current group at the current number of indices, leaving out empty groups
+static void end_group(std::vector<ObjGroup> *groups, u32 num_indices)
+{
+  if(!groups || groups->size() == 0) return;
+
+  ObjGroup &group = groups->back();
+  group.num_indices = num_indices - group.first_index;
+  if(group.num_indices == 0) groups->pop_back();
+}
+
+static void begin_group(std::vector<ObjGroup> *groups, const std::string &name, u32 num_indices)
+{
+  if(!groups) return;
+
+  end_group(groups, num_indices);
+
+  ObjGroup group;
+  group.name = name;
+  group.first_index = num_indices;
+  group.num_indices = 0;
+  groups->push_back(group);
+}
+
+// Whether p is inside or on the edges of the triangle a b c, with sign the winding of the polygon
+static bool point_in_triangle(v2 p, v2 a, v2 b, v2 c, f32 sign)
+{
+  f32 ab = sign * ((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x));
+  f32 bc = sign * ((c.x - b.x) * (p.y - b.y) - (c.y - b.y) * (p.x - b.x));
+  f32 ca = sign * ((a.x - c.x) * (p.y - c.y) - (a.y - c.y) * (p.x - c.x));
+  return ab >= 0.0f && bc >= 0.0f && ca >= 0.0f;
+}
+
+// Splits a polygon into triangles by ear clipping and appends the corners of
+// each triangle to triangles. The polygon is flattened onto the axis plane it
+// faces most, from its normal by Newell's method. Ears are looked for from the
+// second remaining corner, so a convex polygon becomes the same fan around the
+// first corner as before. A polygon that crosses itself has no ear at some
+// point, then the corner is clipped anyway so every corner is still used.
+static void triangulate_polygon(const std::vector<v3> &positions, std::vector<v2> *points, std::vector<u32> *remaining, std::vector<u32> *triangles)
+{
+  u32 count = positions.size();
+
+  v3 normal = v3();
+  for(u32 i = 0; i < count; i++)
+  {
+    v3 a = positions[i];
+    v3 b = positions[(i + 1) % count];
+    normal.x += (a.y - b.y) * (a.z + b.z);
+    normal.y += (a.z - b.z) * (a.x + b.x);
+    normal.z += (a.x - b.x) * (a.y + b.y);
+  }
+
+  // Drop the largest axis of the normal, the winding follows its sign
+  u32 axis_x = 1;
+  u32 axis_y = 2;
+  f32 sign = normal.x;
+  if(absf(normal.y) > absf(normal.x) && absf(normal.y) >= absf(normal.z))
+  {
+    axis_x = 2;
+    axis_y = 0;
+    sign = normal.y;
+  }
+  else if(absf(normal.z) > absf(normal.x) && absf(normal.z) > absf(normal.y))
+  {
+    axis_x = 0;
+    axis_y = 1;
+    sign = normal.z;
+  }
+  sign = sign < 0.0f ? -1.0f : 1.0f;
+
+  points->resize(count);
+  remaining->resize(count);
+  for(u32 i = 0; i < count; i++)
+  {
+    (*points)[i] = v2((&positions[i].x)[axis_x], (&positions[i].x)[axis_y]);
+    (*remaining)[i] = i;
+  }
+
+  while(remaining->size() > 3)
+  {
+    u32 size = remaining->size();
+    u32 ear = 1;
+    for(u32 k = 1; k <= size; k++)
+    {
+      u32 corner = k % size;
+      v2 a = (*points)[(*remaining)[(corner + size - 1) % size]];
+      v2 b = (*points)[(*remaining)[corner]];
+      v2 c = (*points)[(*remaining)[(corner + 1) % size]];
+
+      // The corner has to turn the way the polygon winds
+      if(sign * ((b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x)) <= 0.0f) continue;
+
+      // and no other corner can be inside the triangle it cuts off
+      bool empty = true;
+      for(u32 j = 0; j < size && empty; j++)
+      {
+        if(j == corner || j == (corner + 1) % size || j == (corner + size - 1) % size) continue;
+        empty = !point_in_triangle((*points)[(*remaining)[j]], a, b, c, sign);
+      }
+      if(empty)
+      {
+        ear = corner;
+        break;
+      }
+    }
+
+    triangles->push_back((*remaining)[(ear + size - 1) % size]);
+    triangles->push_back((*remaining)[ear]);
+    triangles->push_back((*remaining)[(ear + 1) % size]);
+    remaining->erase(remaining->begin() + ear);
+  }
+
+  triangles->push_back((*remaining)[0]);
+  triangles->push_back((*remaining)[1]);
+  triangles->push_back((*remaining)[2]);
+}
+
+void load_obj(const char *path_to_obj, std::vector<v3> *vertices, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<unsigned> *indices, std::vector<ObjGroup> *groups)
+{
+  u64 file_size;
+  const char *data = map_file(path_to_obj, &file_size);
+  if(!data)
   {
-    vertices = 0;
-    texture_coords = 0;
-    normals = 0;
-    indices = 0;
     printf("Could not find obj file %s\n", path_to_obj);
     return;
   }
 
-  unsigned file_size;
-  fseek(file, 0, SEEK_END);
-  file_size = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  // Split the file into pieces that end at the end of a line, a few for each thread
+  u64 chunk_size = file_size / (num_job_threads() * 4) + 1;
+  if(chunk_size < OBJ_MIN_CHUNK_SIZE) chunk_size = OBJ_MIN_CHUNK_SIZE;
 
-  // + 1 for null termination
-  char *data = new char[file_size + 1];
-  fread(data, file_size, 1, file);
-  data[file_size] = 0;
+  std::vector<ObjChunk> chunks;
+  const char *file_end = data + file_size;
+  const char *start = data;
+  while(start < file_end)
+  {
+    const char *end = (u64)(file_end - start) > chunk_size ? skip_line(start + chunk_size, file_end) : file_end;
+
+    chunks.push_back(ObjChunk());
+    chunks.back().start = start;
+    chunks.back().end = end;
+    start = end;
+  }
 
-  const char * delims = " \t\n\r";
+  run_jobs(parse_obj_chunk, chunks.data(), chunks.size());
 
-  // Tokenize the file
-  char *tokens = strtok(data, delims);
+  ObjData obj;
+  obj.split_vertices = (texture_coords != 0 || normals != 0);
+  obj.out_vertices = obj.split_vertices ? vertices : &obj.positions;
+  obj.out_texture_coords = texture_coords;
+  obj.out_normals = normals;
 
-  unsigned lines = 0;
-  while(tokens != 0)
+  // Put the elements of all the chunks together
+  for(u32 i = 0; i < chunks.size(); i++)
   {
-    lines++;
-    bool read_next_token = true;
-    if(strcmp(tokens, "v") == 0)
+    ObjChunk &chunk = chunks[i];
+    obj.positions.insert(obj.positions.end(), chunk.positions.begin(), chunk.positions.end());
+    obj.texture_coords.insert(obj.texture_coords.end(), chunk.texture_coords.begin(), chunk.texture_coords.end());
+    obj.normals.insert(obj.normals.end(), chunk.normals.begin(), chunk.normals.end());
+  }
+
+  u32 total_positions = obj.positions.size();
+  u32 total_texture_coords = obj.texture_coords.size();
+  u32 total_normals = obj.normals.size();
+
+  if(obj.split_vertices)
+  {
+    obj.vertex_map.reserve(total_positions * 2);
+  }
+
+  if(groups)
+  {
+    groups->clear();
+    begin_group(groups, "default", indices->size());
+  }
+
+  u32 position_base = 0;
+  u32 texture_coord_base = 0;
+  u32 normal_base = 0;
+  u32 invalid_faces = 0;
+
+  // Reused for every face, polygons can have any number of corners
+  std::vector<ObjFaceVertex> resolved;
+  std::vector<unsigned> face_indices;
+  std::vector<v3> face_positions;
+  std::vector<v2> face_points;
+  std::vector<u32> face_remaining;
+  std::vector<u32> face_triangles;
+
+  for(u32 i = 0; i < chunks.size(); i++)
+  {
+    ObjChunk &chunk = chunks[i];
+    u32 next_group = 0;
+    u32 corner = 0;
+
+    for(u32 face = 0; face < chunk.face_sizes.size(); face++)
     {
-      // Vertices have format v 0.0 1.0 2.0
-      v3 vertex;
+      while(next_group < chunk.groups.size() && chunk.groups[next_group].first_face == face)
+      {
+        begin_group(groups, chunk.groups[next_group].name, indices->size());
+        next_group++;
+      }
+
+      u32 face_size = chunk.face_sizes[face];
+      const ObjFaceVertex *face_vertices = &chunk.face_vertices[corner];
+      const u8 *relative = &chunk.relative[corner];
+      corner += face_size;
+
+      // Resolve the indices of the whole face first so a bad index drops the face and not half of it
+      resolved.resize(face_size);
+      bool valid = true;
+      for(u32 j = 0; j < face_size; j++)
+      {
+        resolved[j].position = resolve_index(face_vertices[j].position, relative[j] & OBJ_RELATIVE_POSITION, position_base, total_positions);
+        resolved[j].texture_coord = resolve_index(face_vertices[j].texture_coord, relative[j] & OBJ_RELATIVE_TEXTURE_COORD, texture_coord_base, total_texture_coords);
+        resolved[j].normal = resolve_index(face_vertices[j].normal, relative[j] & OBJ_RELATIVE_NORMAL, normal_base, total_normals);
+        if(resolved[j].position < 0) valid = false;
+      }
 
-      tokens = strtok(NULL, delims);
-      vertex.x = (float)atof(tokens);
-      tokens = strtok(NULL, delims);
-      vertex.y = (float)atof(tokens);
-      tokens = strtok(NULL, delims);
-      vertex.z = (float)atof(tokens);
+      if(!valid)
+      {
+        invalid_faces++;
+        continue;
+      }
+
+      // The vertices are added in the order of the corners
+      face_indices.resize(face_size);
+      for(u32 j = 0; j < face_size; j++)
+      {
+        face_indices[j] = add_face_vertex(&obj, resolved[j]);
+      }
 
-      vertices->push_back(vertex);
+      if(face_size == 3)
+      {
+        indices->push_back(face_indices[0]);
+        indices->push_back(face_indices[1]);
+        indices->push_back(face_indices[2]);
+        continue;
+      }
+
+      face_positions.resize(face_size);
+      for(u32 j = 0; j < face_size; j++)
+      {
+        face_positions[j] = obj.positions[resolved[j].position];
+      }
+      face_triangles.clear();
+      triangulate_polygon(face_positions, &face_points, &face_remaining, &face_triangles);
+      for(u32 j = 0; j < face_triangles.size(); j++)
+      {
+        indices->push_back(face_indices[face_triangles[j]]);
+      }
     }
-    else if(strcmp(tokens, "f") == 0)
+
+    // Groups after the last face of the chunk
+    for(; next_group < chunk.groups.size(); next_group++)
     {
-      // Faces have format f 1 2 3 ...
-      unsigned index0;
-      unsigned index1;
-      unsigned index2;
+      begin_group(groups, chunk.groups[next_group].name, indices->size());
+    }
 
-      tokens = strtok(NULL, delims);
-      index0 = atoi(tokens); 
-      tokens = strtok(NULL, delims);
-      index1 = atoi(tokens);
-      tokens = strtok(NULL, delims);
-      index2 = atoi(tokens);
+    position_base += chunk.positions.size();
+    texture_coord_base += chunk.texture_coords.size();
+    normal_base += chunk.normals.size();
+  }
 
-      indices->push_back(index0 - 1); // - 1 for OBJ files reading indices starting at 1 (not 0)
-      indices->push_back(index1 - 1);
-      indices->push_back(index2 - 1);
+  end_group(groups, indices->size());
 
-      read_next_token = false;
-      tokens = strtok(NULL, delims);
+  if(invalid_faces)
+  {
+    printf("Skipped %u faces with missing vertices in %s\n", invalid_faces, path_to_obj);
+  }
 
-      while(tokens != 0 && is_digit(tokens[0]))
-      {
-        /*
-        index0 = index1;
-        index1 = index2;
-        index2 = atoi(tokens);
-        */
+  if(!obj.split_vertices)
+  {
+    vertices->insert(vertices->end(), obj.positions.begin(), obj.positions.end());
+  }
+
+  // Leave out attributes the file does not have so the caller can tell they are missing
+  if(texture_coords && obj.texture_coords.size() == 0) texture_coords->clear();
+  if(normals && obj.normals.size() == 0) normals->clear();
+
+  unmap_file(data, file_size);
+}
+
+u32 *load_tga(const char *path, u32 *width, u32 *height)
+{
+  // A missing file is not an error, textures are optional
+  FILE *file = fopen(path, "rb");
+  if(!file) return 0;
+
+  u8 header[18];
+  if(fread(header, sizeof(header), 1, file) != 1)
+  {
+    printf("Unexpected end of tga file %s\n", path);
+    fclose(file);
+    return 0;
+  }
+
+  u8 id_length = header[0];
+  u8 color_map_type = header[1];
+  u8 image_type = header[2];
+  u32 image_width = header[12] | (header[13] << 8);
+  u32 image_height = header[14] | (header[15] << 8);
+  u8 bits_per_pixel = header[16];
+  bool top_to_bottom = (header[17] & 0x20) != 0;
+
+  // Only true color images, either uncompressed (2) or run length encoded (10)
+  if(color_map_type != 0 || (image_type != 2 && image_type != 10) || (bits_per_pixel != 24 && bits_per_pixel != 32))
+  {
+    printf("Unsupported tga file %s\n", path);
+    fclose(file);
+    return 0;
+  }
+
+  fseek(file, id_length, SEEK_CUR);
 
-        index0 = index0;
-        index1 = index2;
-        index2 = atoi(tokens);;
+  u32 num_pixels = image_width * image_height;
+  u32 bytes_per_pixel = bits_per_pixel / 8;
+  u32 *pixels = new u32[num_pixels];
 
-        indices->push_back(index0 - 1);
-        indices->push_back(index1 - 1);
-        indices->push_back(index2 - 1);
-        
-        tokens = strtok(NULL, delims);
+  // Pixels are stored as BGR(A) which is the same order as the frame buffer
+  u32 pixel = 0;
+  while(pixel < num_pixels)
+  {
+    u32 run_length = 1;
+    bool repeat = false;
+    if(image_type == 10)
+    {
+      u8 packet = (u8)fgetc(file);
+      run_length = (packet & 0x7F) + 1;
+      repeat = (packet & 0x80) != 0;
+    }
+
+    u8 bgra[4] = { 0, 0, 0, 255 };
+    for(u32 i = 0; i < run_length && pixel < num_pixels; i++)
+    {
+      if(i == 0 || !repeat)
+      {
+        if(fread(bgra, bytes_per_pixel, 1, file) != 1)
+        {
+          printf("Unexpected end of tga file %s\n", path);
+          delete [] pixels;
+          fclose(file);
+          return 0;
+        }
       }
+
+      pixels[pixel++] = bgra[0] | (bgra[1] << 8) | (bgra[2] << 16) | ((u32)bgra[3] << 24);
     }
+  }
 
-    if(read_next_token)
+  fclose(file);
+
+  // Flip so rows start at the bottom like texture coordinates
+  if(top_to_bottom)
+  {
+    for(u32 y = 0; y < image_height / 2; y++)
     {
-      tokens = strtok(NULL, delims);
+      u32 *top = pixels + y * image_width;
+      u32 *bottom = pixels + (image_height - 1 - y) * image_width;
+      for(u32 x = 0; x < image_width; x++)
+      {
+        u32 temp = top[x];
+        top[x] = bottom[x];
+        bottom[x] = temp;
+      }
     }
   }
 
-  delete [] data;
+  *width = image_width;
+  *height = image_height;
+  return pixels;
 }
 
-void normalize_mesh(std::vector<v3> *in_vertices)
+// Reverses the order of the first num_rows rows of texels inside a block
+static void flip_block(TextureFormat format, u8 *block, u32 num_rows)
 {
-  std::vector<v3> &vertices = *in_vertices;
-  // Get the min and max values for each axis
-  float min_x = INFINITY;
-  float max_x = -INFINITY;
-  float min_y = INFINITY;
-  float max_y = -INFINITY;
-  float min_z = INFINITY;
-  float max_z = -INFINITY;
-  v3 sum_points = {0.0f, 0.0f, 0.0f};
-  for(unsigned i = 0; i < vertices.size(); i++)
+  u8 *color = (format == TEXTURE_FORMAT_BC1) ? block : block + 8;
+
+  // Color indices are one byte per row
+  for(u32 row = 0; row < num_rows / 2; row++)
   {
-    min_x = min(min_x, vertices[i].x);
-    max_x = max(max_x, vertices[i].x);
-    min_y = min(min_y, vertices[i].y);
-    max_y = max(max_y, vertices[i].y);
-    min_z = min(min_z, vertices[i].z);
-    max_z = max(max_z, vertices[i].z);
+    u8 temp = color[4 + row];
+    color[4 + row] = color[4 + num_rows - 1 - row];
+    color[4 + num_rows - 1 - row] = temp;
+  }
+
+  // BC3 alpha indices are 12 bits per row
+  if(format == TEXTURE_FORMAT_BC3)
+  {
+    u64 bits = 0;
+    for(u32 i = 0; i < 6; i++) bits |= (u64)block[2 + i] << (i * 8);
 
-    sum_points += vertices[i];
+    u64 flipped = bits;
+    for(u32 row = 0; row < num_rows; row++)
+    {
+      u64 row_bits = (bits >> (row * 12)) & 0xFFF;
+      u32 flipped_row = num_rows - 1 - row;
+      flipped &= ~((u64)0xFFF << (flipped_row * 12));
+      flipped |= row_bits << (flipped_row * 12);
+    }
+
+    for(u32 i = 0; i < 6; i++) block[2 + i] = (u8)(flipped >> (i * 8));
   }
+}
 
-  // Find center of model
-  sum_points /= (float)vertices.size();
+Texture *load_dds(const char *path)
+{
+  // A missing file is not an error, textures are optional
+  FILE *file = fopen(path, "rb");
+  if(!file) return 0;
 
-  // Get the max difference in an axis
-  float diff_x = max_x - min_x;
-  float diff_y = max_y - min_y;
-  float diff_z = max_z - min_z;
+  unsigned file_size;
+  fseek(file, 0, SEEK_END);
+  file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
 
-  float max_diff = max(diff_x, max(diff_x, diff_y));
+  u8 *data = new u8[file_size];
+  fread(data, file_size, 1, file);
+  fclose(file);
 
-  // Move vertices to center and scale down
-  for(unsigned i = 0; i < vertices.size(); i++)
+  // The magic number is followed by a 124 byte header
+  const u32 header_size = 128;
+  if(file_size < header_size || memcmp(data, "DDS ", 4) != 0)
   {
-    // Move centroid to origin
-    vertices[i] -= sum_points;
+    printf("Not a dds file %s\n", path);
+    delete [] data;
+    return 0;
+  }
 
-    // Scale down to between -1 and 1
-    vertices[i] = (vertices[i] / max_diff) * 2.0f;
+  u32 height = *(u32 *)(data + 12);
+  u32 width = *(u32 *)(data + 16);
+  u32 num_levels = *(u32 *)(data + 28);
+  const u8 *four_cc = data + 84;
+  if(num_levels == 0) num_levels = 1;
+
+  TextureFormat format;
+  if(memcmp(four_cc, "DXT1", 4) == 0)
+  {
+    format = TEXTURE_FORMAT_BC1;
   }
+  else if(memcmp(four_cc, "DXT5", 4) == 0)
+  {
+    format = TEXTURE_FORMAT_BC3;
+  }
+  else
+  {
+    printf("Unsupported dds format in %s\n", path);
+    delete [] data;
+    return 0;
+  }
+
+  // DDS rows start at the top, so flip the rows of blocks and the rows inside
+  // each block. This is exact when the height of every level is a multiple of
+  // 4 or smaller than a block, which is true for power of two textures.
+  u32 block_size = (format == TEXTURE_FORMAT_BC1) ? 8 : 16;
+  u8 *level_data = data + header_size;
+  u32 level_width = width;
+  u32 level_height = height;
+  u32 loaded_levels = 0;
+  for(; loaded_levels < num_levels; loaded_levels++)
+  {
+    u32 size = compressed_level_size(format, level_width, level_height);
+    if(level_data + size > data + file_size) break;
+
+    u32 blocks_x = (level_width + 3) / 4;
+    u32 blocks_y = (level_height + 3) / 4;
+    u32 row_bytes = blocks_x * block_size;
+    for(u32 y = 0; y < blocks_y / 2; y++)
+    {
+      u8 *top = level_data + y * row_bytes;
+      u8 *bottom = level_data + (blocks_y - 1 - y) * row_bytes;
+      for(u32 i = 0; i < row_bytes; i++)
+      {
+        u8 temp = top[i];
+        top[i] = bottom[i];
+        bottom[i] = temp;
+      }
+    }
+
+    u32 rows_per_block = (level_height < 4) ? level_height : 4;
+    for(u32 i = 0; i < blocks_x * blocks_y; i++)
+    {
+      flip_block(format, level_data + i * block_size, rows_per_block);
+    }
+
+    level_data += size;
+    level_width = max((s32)level_width / 2, 1);
+    level_height = max((s32)level_height / 2, 1);
+  }
+
+  Texture *texture = 0;
+  if(loaded_levels)
+  {
+    texture = create_compressed_texture(data + header_size, width, height, loaded_levels, format);
+  }
+
+  delete [] data;
+  return texture;
+}
+
+void normalize_mesh(std::vector<v3> *in_vertices)
+{
+  normalize_positions(in_vertices);
 }
@@ -15,8 +15,39 @@ End Header --------------------------------------------------------*/
 
 #include "my_math.h"
 
+#include <string>
 #include <vector>
 
-void load_obj(const char *path_to_obj, std::vector<v3> *vertices, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<unsigned> *indices);
+struct Texture;
 
+// A named range of triangles from the g and o lines of an OBJ file
+// Triangles before the first g or o line are in a group named default
+struct ObjGroup
+{
+  std::string name;
+  u32 first_index;
+  u32 num_indices;
+};
+
+// Loads the triangles of an OBJ file. Texture coordinates, normals and groups are optional.
+// When texture coordinates or normals are requested, each different combination of
+// position, texture coordinate and normal used by a face becomes its own vertex.
+// Attributes the file does not have are left empty. Polygons with any number of
+// corners are split into triangles by ear clipping, so concave ones work too. Polygons
+// that are not flat are split in the plane they face most, and ones that cross
+// themselves get a triangle for every corner but may overlap. Negative indices count
+// back from the last element read.
+// The file is memory mapped and split into pieces that are parsed on the job threads.
+void load_obj(const char *path_to_obj, std::vector<v3> *vertices, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<unsigned> *indices, std::vector<ObjGroup> *groups = 0);
+
+// Loads an uncompressed or run length encoded 24 or 32 bit TGA image
+// Returns BGRA8 pixels in rows starting at the bottom, or 0 if there is no file or it could not be loaded
+// Only files that exist and can not be loaded are reported
+u32 *load_tga(const char *path, u32 *width, u32 *height);
+
+// Loads a DXT1 (BC1) or DXT5 (BC3) DDS file with its mip levels without decompressing it
+// Returns 0 if there is no file or it could not be loaded, only files that exist are reported
+Texture *load_dds(const char *path);
+
+// Moves the centroid to the origin and scales the mesh to about -1 to 1
 void normalize_mesh(std::vector<v3> *in_vertices);
@@ -0,0 +1,191 @@
+#include "job_system.h"
+
+#include <assert.h> // assert
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct JobBatch
+{
+  JobFunction function;
+  void *data;
+  u32 count;
+
+  // Next index to hand out and number of indices finished
+  std::atomic<u32> next;
+  std::atomic<u32> finished;
+
+  // Worker threads still using the batch. Only changed with the mutex locked.
+  u32 active_workers;
+};
+
+struct JobSystem
+{
+  std::vector<std::thread> threads;
+
+  // Batches that still have indices to hand out
+  std::vector<JobBatch *> batches;
+
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable batch_finished;
+  bool quitting;
+};
+
+static JobSystem job_system;
+
+// Runs indices of a batch until there are none left to hand out
+static void run_batch(JobBatch *batch)
+{
+  for(;;)
+  {
+    u32 index = batch->next.fetch_add(1);
+    if(index >= batch->count) return;
+
+    batch->function(batch->data, index);
+    batch->finished.fetch_add(1);
+  }
+}
+
+// Takes a batch off the list so no more threads pick it up. The mutex must be locked.
+static void remove_batch(JobBatch *batch)
+{
+  std::vector<JobBatch *> &batches = job_system.batches;
+  for(u32 i = 0; i < batches.size(); i++)
+  {
+    if(batches[i] == batch)
+    {
+      batches.erase(batches.begin() + i);
+      break;
+    }
+  }
+}
+
+static void worker_thread()
+{
+  for(;;)
+  {
+    JobBatch *batch;
+    {
+      std::unique_lock<std::mutex> lock(job_system.mutex);
+      job_system.work_available.wait(lock, []{ return job_system.quitting || job_system.batches.size(); });
+      if(job_system.quitting) return;
+
+      batch = job_system.batches[0];
+      batch->active_workers++;
+    }
+
+    // The batch lives on the stack of the thread that started it, which waits
+    // for every active worker before returning
+    run_batch(batch);
+
+    {
+      std::lock_guard<std::mutex> lock(job_system.mutex);
+      remove_batch(batch);
+      batch->active_workers--;
+    }
+    job_system.batch_finished.notify_all();
+  }
+}
+
+void init_job_system(u32 num_threads)
+{
+  if(num_threads == 0)
+  {
+    num_threads = std::thread::hardware_concurrency();
+    if(num_threads == 0) num_threads = 1;
+  }
+
+  job_system.quitting = false;
+
+  // The thread calling run_jobs also works, so start one less
+  for(u32 i = 1; i < num_threads; i++)
+  {
+    job_system.threads.push_back(std::thread(worker_thread));
+  }
+}
+
+void exit_job_system()
+{
+  {
+    std::lock_guard<std::mutex> lock(job_system.mutex);
+    job_system.quitting = true;
+  }
+  job_system.work_available.notify_all();
+
+  for(u32 i = 0; i < job_system.threads.size(); i++)
+  {
+    job_system.threads[i].join();
+  }
+  job_system.threads.clear();
+}
+
+void run_jobs(JobFunction function, void *data, u32 count)
+{
+  if(count == 0) return;
+
+  // Not worth waking the workers for a single job
+  if(count == 1 || job_system.threads.size() == 0)
+  {
+    for(u32 i = 0; i < count; i++) function(data, i);
+    return;
+  }
+
+  JobBatch batch;
+  batch.function = function;
+  batch.data = data;
+  batch.count = count;
+  batch.next = 0;
+  batch.finished = 0;
+  batch.active_workers = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(job_system.mutex);
+    job_system.batches.push_back(&batch);
+  }
+  job_system.work_available.notify_all();
+
+  run_batch(&batch);
+
+  // Every index has been handed out. Wait for the workers still running one.
+  std::unique_lock<std::mutex> lock(job_system.mutex);
+  remove_batch(&batch);
+  job_system.batch_finished.wait(lock, [&batch]{ return batch.active_workers == 0; });
+  assert(batch.finished.load() == batch.count);
+}
+
+struct RangeJobs
+{
+  RangeJobFunction function;
+  void *data;
+  u32 count;
+  u32 range_size;
+};
+
+static void run_range_job(void *data, u32 index)
+{
+  RangeJobs *ranges = (RangeJobs *)data;
+  u32 begin = index * ranges->range_size;
+  u32 end = begin + ranges->range_size;
+  if(end > ranges->count) end = ranges->count;
+
+  ranges->function(ranges->data, begin, end);
+}
+
+void run_range_jobs(RangeJobFunction function, void *data, u32 count, u32 range_size)
+{
+  RangeJobs ranges;
+  ranges.function = function;
+  ranges.data = data;
+  ranges.count = count;
+  ranges.range_size = range_size;
+
+  run_jobs(run_range_job, &ranges, (count + range_size - 1) / range_size);
+}
+
+u32 num_job_threads()
+{
+  return job_system.threads.size() + 1;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "types.h"
+
+// Called once for each index of a batch of jobs
+typedef void (*JobFunction)(void *data, u32 index);
+
+// Starts the worker threads. Zero uses one thread per hardware thread.
+void init_job_system(u32 num_threads);
+
+// Stops and joins the worker threads
+void exit_job_system();
+
+// Runs the function for every index from 0 to count - 1 on the worker threads
+// and returns once all of them are done. The calling thread helps with the
+// jobs while it waits. Batches from different threads can run at the same time.
+void run_jobs(JobFunction function, void *data, u32 count);
+
+// Called with a range of indices from begin up to but not including end
+typedef void (*RangeJobFunction)(void *data, u32 begin, u32 end);
+
+// Splits 0 to count - 1 into ranges of range_size indices and runs each range
+// as a job. The range a job gets is always the same for the same arguments,
+// so a job can keep results per range at begin / range_size.
+void run_range_jobs(RangeJobFunction function, void *data, u32 count, u32 range_size);
+
+// Number of threads that can be running jobs, including the calling thread
+u32 num_job_threads();
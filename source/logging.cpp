@@ -4,7 +4,9 @@
 #include <stdarg.h>
 #include <string.h>
 
+#ifdef _WIN32
 #include <Windows.h> // OutputDebugString
+#endif
 
 //------------------------------------------------------------------------------
 // Private Variables:
@@ -52,7 +54,9 @@ void log_file_fn(const char *message, ...)
 
   fprintf(logging_file, buffer);
 
+#ifdef _WIN32
   OutputDebugStringA(buffer);
+#endif
 
 
   fclose(logging_file);
@@ -9,13 +9,19 @@
 
 #include <stdio.h> // file io for printing time
 
+#define TRANSPARENT_WINDOWx
+
+// Images the renderer draws into while another one is on screen
+#define NUM_SWAP_CHAIN_IMAGES 3
+
 static HWND window_handle = 0;
-static HDC DIB_handle;
-static HBITMAP DIB_bitmap;
+static HDC DIB_handles[NUM_SWAP_CHAIN_IMAGES];
+static HBITMAP DIB_bitmaps[NUM_SWAP_CHAIN_IMAGES];
 static int DIB_width;
 static int DIB_height;
 static int DIB_row_byte_width;
-static u32 *frame_buffer;
+static u32 *frame_buffers[NUM_SWAP_CHAIN_IMAGES];
+static POINT window_origin; // Of the layered window on the monitor
 static bool running;
 
 #define MAX_BUTTONS 165
@@ -120,6 +126,30 @@ LRESULT CALLBACK WindowProc(HWND window, UINT message, WPARAM wParam, LPARAM lPa
   return result;
 }
 
+// Runs on the renderer's present thread
+static void present(const u32 *image, u32 image_index, void *data)
+{
+  HDC hdc = GetDC(window_handle);
+
+#ifdef TRANSPARENT_WINDOW
+  SIZE sizeSplash = { DIB_width, DIB_height };
+
+  POINT ptZero = { 0 };
+
+  BLENDFUNCTION blend = { 0 };
+  blend.BlendOp = AC_SRC_OVER;
+  blend.SourceConstantAlpha = 255;
+  blend.AlphaFormat = AC_SRC_ALPHA;
+
+  bool result = UpdateLayeredWindow(window_handle, hdc, &window_origin, &sizeSplash,
+                                    DIB_handles[image_index], &ptZero, RGB(0, 0, 0), &blend, ULW_ALPHA);
+#else
+  BitBlt(hdc, 0, 0, DIB_width, DIB_height, DIB_handles[image_index], 0, 0, SRCCOPY);
+#endif
+
+  ReleaseDC(window_handle, hdc);
+}
+
 
 int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
@@ -141,8 +171,6 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
   u32 monitor_width = GetSystemMetrics(SM_CXSCREEN);
   u32 monitor_height = GetSystemMetrics(SM_CYSCREEN);
 
-#define TRANSPARENT_WINDOWx
-
   // Create the window
 #ifdef TRANSPARENT_WINDOW
   window_handle = CreateWindowEx(WS_EX_LAYERED | WS_EX_TOPMOST,    // Extended style
@@ -176,7 +204,7 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
     return 1;
   }
 
-  // Create DIB
+  // Create a DIB for each swap chain image
   HDC hdc = GetDC(window_handle);
   RECT client_rect;
   GetClientRect(window_handle, &client_rect);
@@ -195,14 +223,26 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
   mybmi.bmiHeader.biSizeImage = totalBytes;
   mybmi.bmiHeader.biXPelsPerMeter = 0;
   mybmi.bmiHeader.biYPelsPerMeter = 0;
-  DIB_handle = CreateCompatibleDC(hdc);
-  DIB_bitmap = CreateDIBSection(hdc, &mybmi, DIB_RGB_COLORS, (VOID **)&frame_buffer, NULL, 0);
-  (HBITMAP)SelectObject(DIB_handle, DIB_bitmap);
+  for(u32 i = 0; i < NUM_SWAP_CHAIN_IMAGES; i++)
+  {
+    DIB_handles[i] = CreateCompatibleDC(hdc);
+    DIB_bitmaps[i] = CreateDIBSection(hdc, &mybmi, DIB_RGB_COLORS, (VOID **)&frame_buffers[i], NULL, 0);
+    (HBITMAP)SelectObject(DIB_handles[i], DIB_bitmaps[i]);
+  }
 
   ReleaseDC(window_handle, hdc);
   running = true;
 
-  init_renderer(frame_buffer, DIB_width, DIB_height);
+  window_origin.x = (monitor_width / 2) - (client_rect.right / 2);
+  window_origin.y = (monitor_height / 2) - (client_rect.bottom / 2);
+
+  init_renderer(frame_buffers[0], DIB_width, DIB_height);
+
+  // Rasterize one frame while the next is put together
+  set_frame_latency(1);
+
+  // Present one frame while the next is rendered
+  create_swap_chain(NUM_SWAP_CHAIN_IMAGES, frame_buffers, false, PRESENT_MODE_FIFO, present, 0);
 
   init_logging();
 
@@ -229,37 +269,24 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLi
       running = false;
     }
 
+    update_stuff();
+
     clear_frame_buffer();
     render();
-    
-    HDC hdc = GetDC(window_handle);
-
-#ifdef TRANSPARENT_WINDOW
-    SIZE sizeSplash = { DIB_width, DIB_height };
+    swap_buffers();
 
-    POINT ptZero = { 0 };
-    POINT ptOrigin;
-    ptOrigin.x = (monitor_width / 2) - (client_rect.right / 2);
-    ptOrigin.y = (monitor_height / 2) - (client_rect.bottom / 2);
-
-    BLENDFUNCTION blend = { 0 };
-    blend.BlendOp = AC_SRC_OVER;
-    blend.SourceConstantAlpha = 255;
-    blend.AlphaFormat = AC_SRC_ALPHA;
-
-    bool result = UpdateLayeredWindow(window_handle, hdc, &ptOrigin, &sizeSplash,
-                                      DIB_handle, &ptZero, RGB(0, 0, 0), &blend, ULW_ALPHA);
-#else
-    BitBlt(hdc, 0, 0, DIB_width, DIB_height, DIB_handle, 0, 0, SRCCOPY);
-#endif
-
-
-    ReleaseDC(window_handle, hdc);
+    // Nothing changes until there is input
+    if(renderer_idle())
+    {
+      WaitMessage();
+    }
 
     //end_time_block();
   }
 
   //dump_profile_info();
 
+  exit_renderer();
+
   return 0;
 }
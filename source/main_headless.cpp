@@ -0,0 +1,129 @@
+// Runs the renderer without a window, for benchmarks and checking output
+//
+// main_headless [frames] [fifo|mailbox] [heads] [lights]
+//
+// Frames go through the swap chain like in a window, the present function
+// only checksums them. Prints the frame time, the swap chain statistics and
+// the present latency.
+//
+// heads adds a 64x64 field of small heads behind the model, most of them
+// outside the view, for timing the culling of many instances.
+// lights adds a 16x16 grid of point lights in front of the model, for timing
+// the shading of many lights.
+
+#include "software_renderer.h"
+#include "types.h"
+#include "my_math.h" // v2
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // strcmp
+#include <chrono>
+
+#define SCREEN_WIDTH 1280
+#define SCREEN_HEIGHT 720
+
+#define NUM_SWAP_CHAIN_IMAGES 3
+
+static u32 frame_buffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+
+// Sum of the colors of the last presented frame
+static u64 checksum;
+
+bool key_state(u32)
+{
+  return false;
+}
+
+bool mouse_state(u32)
+{
+  return false;
+}
+
+v2 mouse_window_position()
+{
+  return v2();
+}
+
+static void add_head_field()
+{
+  u32 head = load_model("meshes/head");
+  f32 head_rotation = deg_to_rad(90.0f);
+  for(u32 y = 0; y < 64; y++)
+  {
+    for(u32 x = 0; x < 64; x++)
+    {
+      add_instance(head, v3(-32.0f + x, -32.0f + y, -3.0f), v3(0.4f, 0.4f, 0.4f), head_rotation);
+    }
+  }
+}
+
+static void add_light_grid()
+{
+  for(u32 y = 0; y < 16; y++)
+  {
+    for(u32 x = 0; x < 16; x++)
+    {
+      v3 position = v3(-4.0f + x * (8.0f / 15.0f), -3.0f + y * (6.0f / 15.0f), 1.5f);
+      v3 color = v3((x % 3) == 0 ? 1.0f : 0.2f, (x % 3) == 1 ? 1.0f : 0.2f, (y % 2) == 0 ? 1.0f : 0.2f);
+      add_point_light(position, color, 2.0f);
+    }
+  }
+}
+
+static void present(const u32 *image, u32, void *)
+{
+  u64 sum = 0;
+  for(u32 i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+  {
+    sum += image[i] & 0xFFFFFF;
+  }
+  checksum = sum;
+}
+
+int main(int argc, char **argv)
+{
+  u32 num_frames = argc > 1 ? atoi(argv[1]) : 100;
+  PresentMode mode = PRESENT_MODE_FIFO;
+  bool head_field = false;
+  bool light_grid = false;
+  for(s32 i = 2; i < argc; i++)
+  {
+    if(strcmp(argv[i], "mailbox") == 0) mode = PRESENT_MODE_MAILBOX;
+    if(strcmp(argv[i], "heads") == 0) head_field = true;
+    if(strcmp(argv[i], "lights") == 0) light_grid = true;
+  }
+
+  init_renderer(frame_buffer, SCREEN_WIDTH, SCREEN_HEIGHT);
+  if(head_field) add_head_field();
+  if(light_grid) add_light_grid();
+  set_frame_latency(1);
+
+  // Every frame is rendered in full, the scene does not change without input
+  set_incremental_rendering(false);
+
+  create_swap_chain(NUM_SWAP_CHAIN_IMAGES, 0, false, mode, present, 0);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for(u32 i = 0; i < num_frames; i++)
+  {
+    update_stuff();
+    clear_frame_buffer();
+    render();
+    swap_buffers();
+  }
+  wait_for_present();
+  std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+
+  SwapChainStats stats = swap_chain_stats();
+  printf("%u frames, %.2f ms per frame\n", num_frames, time.count() / num_frames);
+  printf("presented %u, dropped %u, checksum %llu\n", stats.presented_frames, stats.dropped_frames, (unsigned long long)checksum);
+  if(stats.presented_frames)
+  {
+    printf("present latency %.2f ms average, %.2f ms max\n", stats.total_latency_ms / stats.presented_frames, stats.max_latency_ms);
+  }
+
+  exit_renderer();
+
+  return 0;
+}
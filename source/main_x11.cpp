@@ -0,0 +1,394 @@
+// X11 platform layer for Linux
+//
+// The swap chain images are MIT-SHM segments shared with the X server, so a
+// frame is presented with XShmPutImage without copying it. Displays without
+// the extension (remote ones) get the images through XPutImage instead.
+//
+// Runs without a screen under Xvfb:
+//   Xvfb :99 -screen 0 1280x720x24 &
+//   DISPLAY=:99 ./main_x11 300
+//
+// main_x11 [frames] [fifo|mailbox]
+//
+// With a frame count it renders every frame in full and quits after that many
+// frames. The frame time and present latency are printed when it quits.
+
+#include "software_renderer.h"
+#include "types.h"
+#include "my_math.h" // v2
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <stdio.h>
+#include <stdlib.h> // atoi, malloc
+#include <string.h> // strcmp
+#include <chrono>
+
+#define WINDOW_WIDTH 1280
+#define WINDOW_HEIGHT 720
+
+// Images the renderer draws into while another one is on screen
+#define NUM_SWAP_CHAIN_IMAGES 3
+
+// Key code of escape, the same as VK_ESCAPE so key_state works like on Windows
+#define KEY_ESCAPE 0x1B
+
+// Xlib connections are not shared between threads, the window events are
+// read on the main thread and the present thread has its own connection
+static Display *display;
+static Display *present_display;
+static Window window;
+static GC present_gc;
+static Atom delete_window_atom;
+
+static bool use_shm;
+static int shm_completion_event;
+static XImage *images[NUM_SWAP_CHAIN_IMAGES];
+static XShmSegmentInfo shm_segments[NUM_SWAP_CHAIN_IMAGES];
+static u32 *frame_buffers[NUM_SWAP_CHAIN_IMAGES];
+
+static bool x_error; // Set by the error handler while setting up the shared memory
+static bool running;
+
+#define MAX_BUTTONS 256
+static bool key_states[MAX_BUTTONS] = {};
+static bool mouse_states[8] = {};
+
+
+bool key_state(u32 button)
+{
+  if(button >= MAX_BUTTONS) return false;
+
+  return key_states[button];
+}
+
+bool mouse_state(u32 button)
+{
+  if(button >= 8) return false;
+
+  return mouse_states[button];
+}
+
+v2 mouse_window_position()
+{
+  Window root;
+  Window child;
+  int root_x, root_y;
+  int x, y;
+  unsigned int mask;
+  if(XQueryPointer(display, window, &root, &child, &root_x, &root_y, &x, &y, &mask))
+  {
+    return v2((float)x, (float)y);
+  }
+
+  return v2();
+}
+
+// Letters are upper case and the rest of Latin-1 is as is, the same as the Windows key codes for them
+static u32 key_from_keysym(KeySym keysym)
+{
+  if(keysym == XK_Escape) return KEY_ESCAPE;
+  if(keysym >= XK_a && keysym <= XK_z) return keysym - XK_a + 'A';
+  if(keysym < MAX_BUTTONS) return keysym;
+
+  return 0;
+}
+
+static int handle_x_error(Display *, XErrorEvent *)
+{
+  x_error = true;
+  return 0;
+}
+
+// The images have to be 32 bit BGRA rows without padding to be rendered into
+static bool image_fits_renderer(const XImage *image)
+{
+  return image->bits_per_pixel == 32 && image->bytes_per_line == image->width * 4 &&
+         image->byte_order == LSBFirst && image->red_mask == 0xFF0000 &&
+         image->green_mask == 0xFF00 && image->blue_mask == 0xFF;
+}
+
+static void destroy_images()
+{
+  for(u32 i = 0; i < NUM_SWAP_CHAIN_IMAGES; i++)
+  {
+    if(!images[i]) continue;
+
+    if(use_shm)
+    {
+      XShmDetach(present_display, &shm_segments[i]);
+      XDestroyImage(images[i]); // Does not free the shared memory
+      shmdt(shm_segments[i].shmaddr);
+    }
+    else
+    {
+      XDestroyImage(images[i]); // Frees the pixels too
+    }
+    images[i] = 0;
+    frame_buffers[i] = 0;
+  }
+}
+
+static bool create_shm_images(Visual *visual, int depth)
+{
+  if(!XShmQueryExtension(present_display)) return false;
+
+  use_shm = true;
+  XErrorHandler old_handler = XSetErrorHandler(handle_x_error);
+  x_error = false;
+
+  bool created = true;
+  for(u32 i = 0; i < NUM_SWAP_CHAIN_IMAGES && created; i++)
+  {
+    XShmSegmentInfo *segment = &shm_segments[i];
+    XImage *image = XShmCreateImage(present_display, visual, depth, ZPixmap, 0, segment, WINDOW_WIDTH, WINDOW_HEIGHT);
+    if(!image)
+    {
+      created = false;
+      break;
+    }
+
+    segment->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if(segment->shmid < 0)
+    {
+      XDestroyImage(image);
+      created = false;
+      break;
+    }
+
+    segment->shmaddr = (char *)shmat(segment->shmid, 0, 0);
+    if(segment->shmaddr == (char *)-1)
+    {
+      shmctl(segment->shmid, IPC_RMID, 0);
+      XDestroyImage(image);
+      created = false;
+      break;
+    }
+    segment->readOnly = True; // The server only reads the frames
+
+    image->data = segment->shmaddr;
+    images[i] = image;
+    frame_buffers[i] = (u32 *)image->data;
+
+    // Fails on a server on another machine even though it has the extension
+    XShmAttach(present_display, segment);
+    XSync(present_display, False);
+
+    // Removed once the server and this process detach, so it does not outlive a crash
+    shmctl(segment->shmid, IPC_RMID, 0);
+
+    created = !x_error && image_fits_renderer(image);
+  }
+
+  if(!created)
+  {
+    // Detaching a segment that failed to attach is an error too
+    destroy_images();
+    XSync(present_display, False);
+    use_shm = false;
+  }
+  XSetErrorHandler(old_handler);
+
+  if(!created) return false;
+
+  shm_completion_event = XShmGetEventBase(present_display) + ShmCompletion;
+  return true;
+}
+
+static bool create_images(Visual *visual, int depth)
+{
+  use_shm = false;
+  for(u32 i = 0; i < NUM_SWAP_CHAIN_IMAGES; i++)
+  {
+    char *pixels = (char *)malloc(WINDOW_WIDTH * WINDOW_HEIGHT * sizeof(u32));
+    images[i] = XCreateImage(present_display, visual, depth, ZPixmap, 0, pixels, WINDOW_WIDTH, WINDOW_HEIGHT, 32, 0);
+    if(!images[i])
+    {
+      free(pixels);
+      destroy_images();
+      return false;
+    }
+    frame_buffers[i] = (u32 *)pixels;
+
+    if(!image_fits_renderer(images[i]))
+    {
+      destroy_images();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static Bool is_shm_completion(Display *, XEvent *event, XPointer)
+{
+  return event->type == shm_completion_event;
+}
+
+// Runs on the renderer's present thread
+static void present(const u32 *, u32 image_index, void *)
+{
+  if(use_shm)
+  {
+    // The server reads the segment after the request is sent, so the image
+    // goes back to the renderer only once the server says it is done with it
+    XShmPutImage(present_display, window, present_gc, images[image_index], 0, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, True);
+    XEvent event;
+    XIfEvent(present_display, &event, is_shm_completion, 0);
+  }
+  else
+  {
+    // Copied into the request, the sync is only to count the time the server takes
+    XPutImage(present_display, window, present_gc, images[image_index], 0, 0, 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+    XSync(present_display, False);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  u32 num_frames = argc > 1 ? atoi(argv[1]) : 0;
+  PresentMode mode = (argc > 2 && strcmp(argv[2], "mailbox") == 0) ? PRESENT_MODE_MAILBOX : PRESENT_MODE_FIFO;
+
+  display = XOpenDisplay(0);
+  present_display = XOpenDisplay(0);
+  if(!display || !present_display)
+  {
+    printf("Could not open the X display\n");
+    return 1;
+  }
+
+  int screen = DefaultScreen(display);
+  Visual *visual = DefaultVisual(display, screen);
+  int depth = DefaultDepth(display, screen);
+
+  // Create the window
+  window = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT,
+                               0, BlackPixel(display, screen), BlackPixel(display, screen));
+  XStoreName(display, window, "Software Renderer");
+  XSelectInput(display, window, KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | StructureNotifyMask);
+
+  // Closing the window sends a message instead of killing the connection
+  delete_window_atom = XInternAtom(display, "WM_DELETE_WINDOW", False);
+  XSetWMProtocols(display, window, &delete_window_atom, 1);
+
+  // The window size is fixed like the frame buffer
+  XSizeHints size_hints = {};
+  size_hints.flags = PMinSize | PMaxSize;
+  size_hints.min_width = size_hints.max_width = WINDOW_WIDTH;
+  size_hints.min_height = size_hints.max_height = WINDOW_HEIGHT;
+  XSetWMNormalHints(display, window, &size_hints);
+
+  XMapWindow(display, window);
+
+  // The present connection can only use the window once the server has it
+  XSync(display, False);
+  present_gc = XCreateGC(present_display, window, 0, 0);
+
+  if(!create_shm_images(visual, depth) && !create_images(visual, depth))
+  {
+    printf("The display needs 32 bit BGRA pixels\n");
+    return 1;
+  }
+  printf("Presenting with %s\n", use_shm ? "MIT-SHM" : "XPutImage");
+
+  running = true;
+
+  init_renderer(frame_buffers[0], WINDOW_WIDTH, WINDOW_HEIGHT);
+
+  // Rasterize one frame while the next is put together
+  set_frame_latency(1);
+
+  // Runs with a frame count are for timing, so every frame is rendered in full
+  if(num_frames) set_incremental_rendering(false);
+
+  // Present one frame while the next is rendered, X images have the top row first
+  create_swap_chain(NUM_SWAP_CHAIN_IMAGES, frame_buffers, true, mode, present, 0);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  u32 frame = 0;
+
+  // Main loop
+  while(running)
+  {
+    while(XPending(display))
+    {
+      XEvent event;
+      XNextEvent(display, &event);
+      switch(event.type)
+      {
+        case KeyPress:
+        case KeyRelease:
+        {
+          u32 key = key_from_keysym(XLookupKeysym(&event.xkey, 0));
+          if(key) key_states[key] = event.type == KeyPress;
+        }
+        break;
+
+        case ButtonPress:
+        case ButtonRelease:
+        {
+          // Button 1 is the left button, mouse state 0 like on Windows
+          if(event.xbutton.button >= 1 && event.xbutton.button <= 8)
+          {
+            mouse_states[event.xbutton.button - 1] = event.type == ButtonPress;
+          }
+        }
+        break;
+
+        case ClientMessage:
+        {
+          if((Atom)event.xclient.data.l[0] == delete_window_atom) running = false;
+        }
+        break;
+      }
+    }
+
+    if(key_states[KEY_ESCAPE])
+    {
+      running = false;
+    }
+
+    update_stuff();
+
+    clear_frame_buffer();
+    render();
+    swap_buffers();
+
+    // Nothing changes until there is input
+    if(renderer_idle())
+    {
+      XEvent event;
+      XPeekEvent(display, &event);
+    }
+
+    frame++;
+    if(frame == num_frames) running = false;
+  }
+
+  wait_for_present();
+  std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+
+  SwapChainStats stats = swap_chain_stats();
+  printf("%u frames, %.2f ms per frame\n", frame, time.count() / frame);
+  printf("presented %u, dropped %u\n", stats.presented_frames, stats.dropped_frames);
+  if(stats.presented_frames)
+  {
+    printf("present latency %.2f ms average, %.2f ms max\n", stats.total_latency_ms / stats.presented_frames, stats.max_latency_ms);
+  }
+
+  exit_renderer();
+
+  destroy_images();
+  XFreeGC(present_display, present_gc);
+  XDestroyWindow(display, window);
+  XCloseDisplay(present_display);
+  XCloseDisplay(display);
+
+  return 0;
+}
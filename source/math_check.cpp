@@ -0,0 +1,96 @@
+// Checks the SSE math in my_math.h against the scalar versions
+//
+// math_check [tests]
+//
+// Runs the products on random matrices and vectors and prints the ones that
+// differ. The SSE products add in the same order as the scalar ones, so they
+// match to the bit only if the compiler does not fuse the scalar multiplies
+// and adds into FMA instructions. Build it with -ffp-contract=off with g++
+// and clang. MSVC does not contract with its default /fp:precise.
+// The fast reciprocals have to be within about 22 bits.
+//
+// Returns 1 if anything differs.
+
+#include "types.h"
+#include "my_math.h"
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+
+static u32 seed = 12345;
+
+// Uniform in -4 to 4
+static f32 random_value()
+{
+  seed = seed * 1664525 + 1013904223;
+  return (f32)(seed >> 8) / (f32)(1 << 24) * 8.0f - 4.0f;
+}
+
+static bool equal(v4 a, v4 b)
+{
+  return a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w;
+}
+
+static u32 failures;
+
+static void check(bool passed, const char *name, u32 test)
+{
+  if(passed) return;
+
+  if(failures < 20) printf("%s differs in test %u\n", name, test);
+  failures++;
+}
+
+int main(int argc, char **argv)
+{
+  u32 num_tests = argc > 1 ? atoi(argv[1]) : 10000;
+
+  for(u32 test = 0; test < num_tests; test++)
+  {
+    mat4 a;
+    mat4 b;
+    for(u32 i = 0; i < 16; i++)
+    {
+      a[i / 4][i % 4] = random_value();
+      b[i / 4][i % 4] = random_value();
+    }
+    v4 v = v4(random_value(), random_value(), random_value(), random_value());
+    f32 scalar = random_value();
+
+    v4 product = a * v;
+    check(equal(product, mul_scalar(a, v)), "mat4 * v4", test);
+
+    mat4 matrix_product = a * b;
+    mat4 scalar_matrix_product = mul_scalar(a, b);
+    bool matrices_equal = true;
+    for(u32 i = 0; i < 16; i++)
+    {
+      matrices_equal = matrices_equal && matrix_product[i / 4][i % 4] == scalar_matrix_product[i / 4][i % 4];
+    }
+    check(matrices_equal, "mat4 * mat4", test);
+
+    v3 point = v3(v.x, v.y, v.z);
+    v4 transformed;
+    transform_points(a, &point, &transformed, 1);
+    check(equal(transformed, mul_scalar(a, v4(point, 1.0f))), "transform_points", test);
+    transform_directions(a, &point, &transformed, 1);
+    check(equal(transformed, mul_scalar(a, v4(point, 0.0f))), "transform_directions", test);
+
+    v4 sum = v + product;
+    v4 difference = v - product;
+    v4 scaled = v * scalar;
+    v4 scaled_in_place = v;
+    scaled_in_place *= scalar;
+    check(equal(sum, v4(v.x + product.x, v.y + product.y, v.z + product.z, v.w + product.w)), "v4 + v4", test);
+    check(equal(difference, v4(v.x - product.x, v.y - product.y, v.z - product.z, v.w - product.w)), "v4 - v4", test);
+    check(equal(scaled, v4(v.x * scalar, v.y * scalar, v.z * scalar, v.w * scalar)), "v4 * f32", test);
+    check(equal(scaled_in_place, scaled), "v4 *= f32", test);
+
+    f32 positive = absf(scalar) + 0.001f;
+    check(absf(rcp_fast(positive) * positive - 1.0f) < 1e-6f, "rcp_fast", test);
+    check(absf(rsqrt_fast(positive) * (f32)sqrt(positive) - 1.0f) < 1e-6f, "rsqrt_fast", test);
+  }
+
+  printf("%u tests, %u failed checks\n", num_tests, failures);
+  return failures ? 1 : 0;
+}
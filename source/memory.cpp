@@ -0,0 +1,117 @@
+#include "memory.h"
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+void *allocate_pages(u64 size)
+{
+  // Large pages need the lock pages in memory privilege, without it normal pages are used
+  u64 large_page_size = GetLargePageMinimum();
+  if(large_page_size)
+  {
+    u64 large_size = (size + large_page_size - 1) & ~(large_page_size - 1);
+    void *memory = VirtualAlloc(0, large_size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if(memory) return memory;
+  }
+
+  return VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+void free_pages(void *memory, u64 size)
+{
+  VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+const char *map_file(const char *path, u64 *size)
+{
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  if(file == INVALID_HANDLE_VALUE) return 0;
+
+  LARGE_INTEGER file_size;
+  if(!GetFileSizeEx(file, &file_size))
+  {
+    CloseHandle(file);
+    return 0;
+  }
+
+  *size = file_size.QuadPart;
+  if(*size == 0)
+  {
+    CloseHandle(file);
+    return "";
+  }
+
+  // The view keeps the mapping and the file open until it is unmapped
+  HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  CloseHandle(file);
+  if(!mapping) return 0;
+
+  const char *data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  return data;
+}
+
+void unmap_file(const char *data, u64 size)
+{
+  if(size) UnmapViewOfFile(data);
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h> // open
+#include <unistd.h> // close
+
+void *allocate_pages(u64 size)
+{
+  void *memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(memory == MAP_FAILED) return 0;
+
+#ifdef MADV_HUGEPAGE
+  // Transparent huge pages, ignored if the kernel does not support them
+  madvise(memory, size, MADV_HUGEPAGE);
+#endif
+
+  return memory;
+}
+
+void free_pages(void *memory, u64 size)
+{
+  munmap(memory, size);
+}
+
+const char *map_file(const char *path, u64 *size)
+{
+  int file = open(path, O_RDONLY);
+  if(file < 0) return 0;
+
+  struct stat file_stat;
+  if(fstat(file, &file_stat) != 0)
+  {
+    close(file);
+    return 0;
+  }
+
+  *size = file_stat.st_size;
+  if(*size == 0)
+  {
+    close(file);
+    return "";
+  }
+
+  void *data = mmap(0, *size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if(data == MAP_FAILED) return 0;
+
+  madvise(data, *size, MADV_SEQUENTIAL);
+  return (const char *)data;
+}
+
+void unmap_file(const char *data, u64 size)
+{
+  if(size) munmap((void *)data, size);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "types.h"
+
+// Allocates zeroed memory straight from the OS, aligned to at least a page
+// Large (huge) pages are used when the OS allows it, so big buffers that are
+// touched every frame need fewer TLB entries
+void *allocate_pages(u64 size);
+
+void free_pages(void *memory, u64 size);
+
+// Maps a whole file read only into memory. Returns 0 if the file could not be opened.
+// Empty files are mapped as a valid pointer to zero bytes.
+const char *map_file(const char *path, u64 *size);
+
+void unmap_file(const char *data, u64 size);
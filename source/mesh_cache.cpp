@@ -0,0 +1,395 @@
+#include "mesh_cache.h"
+#include "asset_loading.h"
+#include "mesh_processing.h"
+#include "memory.h"
+
+#include <math.h> // fabsf
+#include <stdio.h>
+#include <string.h> // memcpy
+#include <vector>
+
+// Arrays in the file start on a cache line
+#define MESH_CACHE_ALIGNMENT 64
+
+static u64 align_offset(u64 offset)
+{
+  return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(u64)(MESH_CACHE_ALIGNMENT - 1);
+}
+
+// Largest value of a 16 bit quantized coordinate
+#define QUANTIZED_MAX 65535.0f
+
+static u16 quantize(f32 value)
+{
+  return (u16)(clamp(value, 0.0f, 1.0f) * QUANTIZED_MAX + 0.5f);
+}
+
+// Folds the unit sphere onto an octahedron and flattens it to a square. The
+// bottom half is folded over the diagonals onto the corners of the square.
+static u32 encode_octahedral(v3 normal)
+{
+  f32 sum = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+  if(sum == 0.0f) return encode_octahedral(v3(0.0f, 0.0f, 1.0f));
+
+  f32 x = normal.x / sum;
+  f32 y = normal.y / sum;
+  if(normal.z < 0.0f)
+  {
+    f32 folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    f32 folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+
+  return quantize(x * 0.5f + 0.5f) | ((u32)quantize(y * 0.5f + 0.5f) << 16);
+}
+
+static v3 decode_octahedral(u32 encoded)
+{
+  f32 x = (encoded & 0xFFFF) * (2.0f / QUANTIZED_MAX) - 1.0f;
+  f32 y = (encoded >> 16) * (2.0f / QUANTIZED_MAX) - 1.0f;
+  f32 z = 1.0f - fabsf(x) - fabsf(y);
+
+  // Unfold the bottom half
+  f32 t = max(-z, 0.0f);
+  x += (x >= 0.0f) ? -t : t;
+  y += (y >= 0.0f) ? -t : t;
+  return unit(v3(x, y, z));
+}
+
+v3 mesh_position(const MeshArrays *mesh, u32 index)
+{
+  if(mesh->vertex_format == MESH_VERTEX_FORMAT_FLOAT) return mesh->positions[index];
+
+  const u16 *quantized = &mesh->quantized_positions[index * 4];
+  return v3(mesh->bounds_min.x + quantized[0] * mesh->position_scale.x,
+            mesh->bounds_min.y + quantized[1] * mesh->position_scale.y,
+            mesh->bounds_min.z + quantized[2] * mesh->position_scale.z);
+}
+
+v3 mesh_normal(const MeshArrays *mesh, u32 index)
+{
+  if(mesh->vertex_format == MESH_VERTEX_FORMAT_FLOAT) return mesh->normals[index];
+
+  return decode_octahedral(mesh->octahedral_normals[index]);
+}
+
+// Hashes 8 bytes at a time so hashing a large source file is limited by reading it
+static u64 hash_memory(const char *data, u64 size)
+{
+  const u64 multiplier = 0x9E3779B97F4A7C15ull;
+  u64 hash = 0xCBF29CE484222325ull ^ (size * multiplier);
+
+  u64 i = 0;
+  for(; i + 8 <= size; i += 8)
+  {
+    u64 word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 32;
+  }
+
+  u64 tail = 0;
+  for(u64 j = 0; i + j < size; j++) tail |= (u64)(u8)data[i + j] << (j * 8);
+  hash = (hash ^ tail) * multiplier;
+  hash ^= hash >> 29;
+
+  // Zero means the file could not be read
+  return hash ? hash : 1;
+}
+
+u64 hash_file(const char *path)
+{
+  u64 size;
+  const char *data = map_file(path, &size);
+  if(!data) return 0;
+
+  u64 hash = hash_memory(data, size);
+  unmap_file(data, size);
+  return hash;
+}
+
+// Splits the triangles into runs of MESHLET_MAX_TRIANGLES in index order
+static void build_meshlets(const std::vector<v3> &positions, const std::vector<u32> &indices, std::vector<Meshlet> *meshlets)
+{
+  for(u32 first = 0; first < indices.size(); first += MESHLET_MAX_TRIANGLES * 3)
+  {
+    Meshlet meshlet;
+    meshlet.first_index = first;
+    meshlet.num_indices = (u32)min((s32)indices.size() - (s32)first, MESHLET_MAX_TRIANGLES * 3);
+
+    v3 bounds_min = positions[indices[first]];
+    v3 bounds_max = bounds_min;
+    for(u32 i = first; i < first + meshlet.num_indices; i++)
+    {
+      v3 p = positions[indices[i]];
+      bounds_min = v3(min(bounds_min.x, p.x), min(bounds_min.y, p.y), min(bounds_min.z, p.z));
+      bounds_max = v3(max(bounds_max.x, p.x), max(bounds_max.y, p.y), max(bounds_max.z, p.z));
+    }
+
+    meshlet.center = (bounds_min + bounds_max) * 0.5f;
+    meshlet.radius = 0.0f;
+    for(u32 i = first; i < first + meshlet.num_indices; i++)
+    {
+      meshlet.radius = max(meshlet.radius, length(positions[indices[i]] - meshlet.center));
+    }
+
+    meshlets->push_back(meshlet);
+  }
+}
+
+// Adds an array to the end of the file image and returns its offset
+static u64 append_array(std::vector<char> *image, const void *data, u64 size)
+{
+  if(size == 0) return 0;
+
+  u64 offset = align_offset(image->size());
+  image->resize(offset + size);
+  memcpy(&(*image)[offset], data, size);
+  return offset;
+}
+
+// Loads an OBJ file and lays it out as a cache file in memory
+static bool build_mesh_image(const char *obj_path, u64 source_hash, MeshVertexFormat vertex_format, std::vector<char> *image)
+{
+  std::vector<v3> positions;
+  std::vector<v2> texture_coords;
+  std::vector<v3> normals;
+  std::vector<u32> indices;
+  load_obj(obj_path, &positions, &texture_coords, &normals, &indices);
+  if(positions.size() == 0 || indices.size() == 0) return false;
+
+  weld_vertices(&positions, &texture_coords, &normals, &indices);
+  normalize_positions(&positions);
+
+  // Computed normals are smooth across the vertices split for texture coordinates, but prefer normals from the file
+  if(normals.size() == 0)
+  {
+    compute_normals(&positions, &indices, &normals);
+  }
+  else
+  {
+    normalize_vectors(&normals);
+  }
+
+  std::vector<Meshlet> meshlets;
+  build_meshlets(positions, indices, &meshlets);
+
+  // LOD 0 is the full mesh, each LOD is simplified from it so errors do not add up
+  std::vector<u32> lod_indices = indices;
+  std::vector<MeshLod> lods;
+  MeshLod full_lod = { 0, (u32)indices.size(), 0.0f, 0 };
+  lods.push_back(full_lod);
+  while(lods.size() < MESH_MAX_LODS)
+  {
+    u32 previous_indices = lods.back().num_indices;
+    u32 target_indices = (previous_indices / 2) / 3 * 3;
+    if(target_indices < MESH_LOD_MIN_TRIANGLES * 3) break;
+
+    std::vector<u32> simplified;
+    f32 error = simplify_mesh(&positions, &indices, target_indices, &simplified);
+
+    // Simplification stalls when most of what is left is borders and seams
+    if(simplified.size() > previous_indices * 9 / 10) break;
+
+    MeshLod lod = { (u32)lod_indices.size(), (u32)simplified.size(), max(error, lods.back().error), 0 };
+    lod_indices.insert(lod_indices.end(), simplified.begin(), simplified.end());
+    lods.push_back(lod);
+  }
+
+  MeshCacheHeader header = {};
+  header.magic = MESH_CACHE_MAGIC;
+  header.version = MESH_CACHE_VERSION;
+  header.source_hash = source_hash;
+  header.num_vertices = positions.size();
+  header.num_indices = lod_indices.size();
+  header.num_meshlets = meshlets.size();
+  header.num_lods = lods.size();
+  header.vertex_format = vertex_format;
+
+  MeshBounds bounds = compute_bounds(&positions);
+  header.bounds_min = bounds.min;
+  header.bounds_max = bounds.max;
+
+  image->clear();
+  image->resize(sizeof(header));
+  if(vertex_format == MESH_VERTEX_FORMAT_FLOAT)
+  {
+    header.positions_offset = append_array(image, positions.data(), positions.size() * sizeof(v3));
+    header.normals_offset = append_array(image, normals.data(), normals.size() * sizeof(v3));
+  }
+  else
+  {
+    v3 extent = header.bounds_max - header.bounds_min;
+    v3 inv_extent = v3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                       extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                       extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+    std::vector<u16> quantized_positions(positions.size() * 4);
+    std::vector<u32> octahedral_normals(normals.size());
+    for(u32 i = 0; i < positions.size(); i++)
+    {
+      v3 p = positions[i] - header.bounds_min;
+      quantized_positions[i * 4 + 0] = quantize(p.x * inv_extent.x);
+      quantized_positions[i * 4 + 1] = quantize(p.y * inv_extent.y);
+      quantized_positions[i * 4 + 2] = quantize(p.z * inv_extent.z);
+      quantized_positions[i * 4 + 3] = 0;
+      octahedral_normals[i] = encode_octahedral(normals[i]);
+    }
+
+    header.quantized_positions_offset = append_array(image, quantized_positions.data(), quantized_positions.size() * sizeof(u16));
+    header.octahedral_normals_offset = append_array(image, octahedral_normals.data(), octahedral_normals.size() * sizeof(u32));
+  }
+  header.texture_coords_offset = append_array(image, texture_coords.data(), texture_coords.size() * sizeof(v2));
+  header.indices_offset = append_array(image, lod_indices.data(), lod_indices.size() * sizeof(u32));
+  header.meshlets_offset = append_array(image, meshlets.data(), meshlets.size() * sizeof(Meshlet));
+  header.lods_offset = append_array(image, lods.data(), lods.size() * sizeof(MeshLod));
+  header.file_size = image->size();
+
+  memcpy(image->data(), &header, sizeof(header));
+  return true;
+}
+
+static bool write_file(const char *path, const std::vector<char> &image)
+{
+  FILE *file = fopen(path, "wb");
+  if(!file) return false;
+
+  bool written = fwrite(image.data(), image.size(), 1, file) == 1;
+  written = (fclose(file) == 0) && written;
+  if(!written) remove(path);
+  return written;
+}
+
+// Checks that an array of the file is inside it
+static bool array_in_file(u64 offset, u64 size, u64 file_size, bool required)
+{
+  if(offset == 0) return !required;
+  return (offset % MESH_CACHE_ALIGNMENT) == 0 && offset <= file_size && size <= file_size - offset;
+}
+
+// Points the arrays into a cache file after checking the header
+// A source hash of 0 accepts a cache built from any source in any vertex format
+static bool read_mesh_image(const char *data, u64 size, u64 source_hash, MeshVertexFormat vertex_format, MeshArrays *arrays)
+{
+  if(size < sizeof(MeshCacheHeader)) return false;
+
+  const MeshCacheHeader *header = (const MeshCacheHeader *)data;
+  if(header->magic != MESH_CACHE_MAGIC || header->version != MESH_CACHE_VERSION) return false;
+  if(header->file_size != size) return false;
+  if(source_hash && header->source_hash != source_hash) return false;
+  if(source_hash && header->vertex_format != vertex_format) return false;
+
+  u64 num_vertices = header->num_vertices;
+  bool quantized = (header->vertex_format == MESH_VERTEX_FORMAT_QUANTIZED);
+  if(header->vertex_format != MESH_VERTEX_FORMAT_FLOAT && !quantized) return false;
+
+  if(!array_in_file(header->positions_offset, num_vertices * sizeof(v3), size, !quantized) ||
+     !array_in_file(header->normals_offset, num_vertices * sizeof(v3), size, !quantized) ||
+     !array_in_file(header->quantized_positions_offset, num_vertices * 4 * sizeof(u16), size, quantized) ||
+     !array_in_file(header->octahedral_normals_offset, num_vertices * sizeof(u32), size, quantized) ||
+     !array_in_file(header->texture_coords_offset, num_vertices * sizeof(v2), size, false) ||
+     !array_in_file(header->indices_offset, (u64)header->num_indices * sizeof(u32), size, true) ||
+     !array_in_file(header->meshlets_offset, (u64)header->num_meshlets * sizeof(Meshlet), size, false) ||
+     !array_in_file(header->lods_offset, (u64)header->num_lods * sizeof(MeshLod), size, false))
+  {
+    return false;
+  }
+
+  arrays->num_vertices = header->num_vertices;
+  arrays->num_indices = header->num_indices;
+  arrays->num_lods = header->lods_offset ? header->num_lods : 0;
+  arrays->lods = header->lods_offset ? (const MeshLod *)(data + header->lods_offset) : 0;
+  arrays->num_meshlets = header->meshlets_offset ? header->num_meshlets : 0;
+  arrays->vertex_format = (MeshVertexFormat)header->vertex_format;
+  arrays->positions = quantized ? 0 : (const v3 *)(data + header->positions_offset);
+  arrays->normals = quantized ? 0 : (const v3 *)(data + header->normals_offset);
+  arrays->quantized_positions = quantized ? (const u16 *)(data + header->quantized_positions_offset) : 0;
+  arrays->octahedral_normals = quantized ? (const u32 *)(data + header->octahedral_normals_offset) : 0;
+  arrays->position_scale = (header->bounds_max - header->bounds_min) / QUANTIZED_MAX;
+  arrays->texture_coords = header->texture_coords_offset ? (const v2 *)(data + header->texture_coords_offset) : 0;
+  arrays->indices = (const u32 *)(data + header->indices_offset);
+  arrays->meshlets = header->meshlets_offset ? (const Meshlet *)(data + header->meshlets_offset) : 0;
+  arrays->bounds_min = header->bounds_min;
+  arrays->bounds_max = header->bounds_max;
+
+  // Indices past the vertices would read outside the file when drawing
+  for(u32 i = 0; i < arrays->num_indices; i++)
+  {
+    if(arrays->indices[i] >= arrays->num_vertices) return false;
+  }
+
+  for(u32 i = 0; i < arrays->num_lods; i++)
+  {
+    const MeshLod *lod = &arrays->lods[i];
+    if(lod->first_index > arrays->num_indices || lod->num_indices > arrays->num_indices - lod->first_index) return false;
+  }
+  if(arrays->num_lods) arrays->num_indices = arrays->lods[0].num_indices;
+
+  return true;
+}
+
+bool build_mesh_cache(const char *obj_path, const char *cache_path, MeshVertexFormat vertex_format)
+{
+  u64 source_hash = hash_file(obj_path);
+  if(!source_hash) return false;
+
+  std::vector<char> image;
+  if(!build_mesh_image(obj_path, source_hash, vertex_format, &image)) return false;
+
+  return write_file(cache_path, image);
+}
+
+MeshCache *load_mesh_cache(const char *obj_path, const char *cache_path, MeshVertexFormat vertex_format)
+{
+  u64 source_hash = hash_file(obj_path);
+
+  MeshCache *cache = new MeshCache;
+  cache->data = map_file(cache_path, &cache->size);
+  cache->mapped = true;
+  if(cache->data)
+  {
+    if(read_mesh_image(cache->data, cache->size, source_hash, vertex_format, &cache->arrays)) return cache;
+    unmap_file(cache->data, cache->size);
+  }
+
+  std::vector<char> image;
+  if(!source_hash || !build_mesh_image(obj_path, source_hash, vertex_format, &image))
+  {
+    printf("Could not load mesh %s\n", obj_path);
+    delete cache;
+    return 0;
+  }
+
+  // Map the new file so its pages are shared and can be dropped like any other cache
+  if(write_file(cache_path, image))
+  {
+    cache->data = map_file(cache_path, &cache->size);
+    if(cache->data && read_mesh_image(cache->data, cache->size, source_hash, vertex_format, &cache->arrays)) return cache;
+    if(cache->data) unmap_file(cache->data, cache->size);
+  }
+
+  // The cache could not be written, keep it in memory instead
+  printf("Could not write mesh cache %s\n", cache_path);
+  char *data = new char[image.size()];
+  memcpy(data, image.data(), image.size());
+  cache->data = data;
+  cache->size = image.size();
+  cache->mapped = false;
+  read_mesh_image(cache->data, cache->size, source_hash, vertex_format, &cache->arrays);
+  return cache;
+}
+
+void close_mesh_cache(MeshCache *cache)
+{
+  if(cache->mapped)
+  {
+    unmap_file(cache->data, cache->size);
+  }
+  else
+  {
+    delete [] cache->data;
+  }
+
+  delete cache;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "types.h"
+#include "my_math.h"
+
+// Binary mesh cache
+//
+// A cache file holds the arrays of a mesh exactly the way the renderer draws
+// them, so it is memory mapped and used in place without parsing. The header
+// records the hash of the source file it was built from. A cache built from
+// an older source or with a different version is rebuilt.
+//
+// Layout: MeshCacheHeader, then each array starting at a multiple of 64 bytes
+//
+// The indices of every LOD are one after another in the index array and all
+// LODs use the same vertices
+
+#define MESH_CACHE_MAGIC 0x4853454D // "MESH"
+#define MESH_CACHE_VERSION 4
+
+// How positions and normals are stored
+enum MeshVertexFormat
+{
+  // 12 byte positions and 12 byte normals
+  MESH_VERTEX_FORMAT_FLOAT,
+
+  // Positions are 16 bits per axis across the bounds with one u16 of padding,
+  // so a vertex is one 8 byte load. Normals are octahedral, 16 bits for each of
+  // the two coordinates. 12 bytes per vertex instead of 24.
+  MESH_VERTEX_FORMAT_QUANTIZED
+};
+
+#define MESH_MAX_LODS 8
+
+// LODs stop before they get below this many triangles
+#define MESH_LOD_MIN_TRIANGLES 64
+
+// A simplified version of the mesh
+struct MeshLod
+{
+  u32 first_index;
+  u32 num_indices;
+
+  // About how far the surface is from the full mesh, in model units
+  f32 error;
+  u32 padding;
+};
+
+// Most triangles in a meshlet
+#define MESHLET_MAX_TRIANGLES 64
+
+// A run of triangles in the index array with a sphere around them for culling
+struct Meshlet
+{
+  u32 first_index;
+  u32 num_indices;
+  v3 center;
+  f32 radius;
+};
+
+struct MeshCacheHeader
+{
+  u32 magic;
+  u32 version;
+  u64 source_hash;
+  u64 file_size;
+
+  u32 num_vertices;
+  u32 num_indices; // Of every LOD
+  u32 num_meshlets;
+  u32 vertex_format; // MeshVertexFormat
+  u32 num_lods;
+  u32 padding;
+
+  v3 bounds_min;
+  v3 bounds_max;
+
+  // Byte offsets from the start of the file, 0 if the array is missing
+  u64 positions_offset;
+  u64 normals_offset;
+  u64 texture_coords_offset;
+  u64 indices_offset;
+  u64 meshlets_offset;
+  u64 quantized_positions_offset;
+  u64 octahedral_normals_offset;
+  u64 lods_offset;
+};
+
+// Arrays of a mesh that is ready to draw
+// They either point into a cache or at arrays owned by someone else
+struct MeshArrays
+{
+  u32 num_vertices;
+  u32 num_indices; // Of the full mesh
+  u32 num_meshlets;
+  u32 num_lods;    // 0 if the mesh has no LODs, otherwise LOD 0 is the full mesh
+
+  MeshVertexFormat vertex_format;
+
+  // MESH_VERTEX_FORMAT_FLOAT
+  const v3 *positions;
+  const v3 *normals;
+
+  // MESH_VERTEX_FORMAT_QUANTIZED, a position is bounds_min + quantized * position_scale
+  const u16 *quantized_positions; // 4 for each vertex
+  const u32 *octahedral_normals;
+  v3 position_scale;
+
+  const v2 *texture_coords; // 0 if the mesh has none
+  const u32 *indices;
+  const Meshlet *meshlets;  // 0 if the mesh has none, always for the full mesh
+  const MeshLod *lods;      // From the most to the least detailed
+
+  v3 bounds_min;
+  v3 bounds_max;
+};
+
+struct MeshCache
+{
+  // The whole file, mapped or in memory if it could not be written
+  const char *data;
+  u64 size;
+  bool mapped;
+
+  MeshArrays arrays;
+};
+
+// Decodes one vertex of either format
+v3 mesh_position(const MeshArrays *mesh, u32 index);
+v3 mesh_normal(const MeshArrays *mesh, u32 index);
+
+// Hash of the contents of a file, 0 if it could not be read
+u64 hash_file(const char *path);
+
+// Loads an OBJ file, welds duplicate vertices, normalizes it to -1 to 1, adds
+// normals if the file has none, simplifies it into a chain of LODs that each
+// have about half the triangles of the one before and writes it as a cache. Returns false if the OBJ could not be loaded.
+bool build_mesh_cache(const char *obj_path, const char *cache_path, MeshVertexFormat vertex_format);
+
+// Maps the cache of an OBJ file, building it first if it is missing, out of
+// date or in a different vertex format
+// If the OBJ file is missing any valid cache is used
+// Returns 0 if there is neither
+MeshCache *load_mesh_cache(const char *obj_path, const char *cache_path, MeshVertexFormat vertex_format);
+
+void close_mesh_cache(MeshCache *cache);
@@ -0,0 +1,54 @@
+// Builds the binary mesh cache of an OBJ file ahead of time, so the renderer
+// never has to parse it
+//
+// usage: mesh_converter [-q] input.obj [output.mesh]
+// The output defaults to the input with the extension changed to .mesh, which
+// is where the renderer looks for it
+// -q stores quantized positions and octahedral normals, like the renderer loads them
+
+#include "mesh_cache.h"
+#include "job_system.h"
+
+#include <stdio.h>
+#include <string>
+
+int main(int argc, char **argv)
+{
+  MeshVertexFormat vertex_format = MESH_VERTEX_FORMAT_FLOAT;
+  if(argc > 1 && std::string(argv[1]) == "-q")
+  {
+    vertex_format = MESH_VERTEX_FORMAT_QUANTIZED;
+    argc--;
+    argv++;
+  }
+
+  if(argc < 2 || argc > 3)
+  {
+    printf("usage: mesh_converter [-q] input.obj [output.mesh]\n");
+    return 1;
+  }
+
+  std::string input = argv[1];
+  std::string output;
+  if(argc == 3)
+  {
+    output = argv[2];
+  }
+  else
+  {
+    size_t dot = input.find_last_of('.');
+    size_t slash = input.find_last_of("/\\");
+    if(dot != std::string::npos && (slash == std::string::npos || dot > slash)) output = input.substr(0, dot);
+    else output = input;
+    output += ".mesh";
+  }
+
+  init_job_system(0);
+
+  bool built = build_mesh_cache(input.c_str(), output.c_str(), vertex_format);
+  if(built) printf("Wrote %s\n", output.c_str());
+  else printf("Could not convert %s to %s\n", input.c_str(), output.c_str());
+
+  exit_job_system();
+  return built ? 0 : 1;
+}
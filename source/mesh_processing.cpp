@@ -0,0 +1,801 @@
+#include "mesh_processing.h"
+#include "job_system.h"
+
+#include <math.h> // acosf
+#include <algorithm> // std::sort
+#include <unordered_map>
+
+// Vertices, corners or triangles in each job
+#define PROCESSING_RANGE_SIZE 16384
+
+// Marks an empty slot of a vertex table
+#define NO_VERTEX 0xFFFFFFFF
+
+// Adding zero turns -0 into 0 so both hash and compare the same
+static u32 float_bits(f32 value)
+{
+  union { f32 f; u32 u; } bits;
+  bits.f = value + 0.0f;
+  return bits.u;
+}
+
+static u32 hash_floats(u32 hash, const f32 *values, u32 count)
+{
+  for(u32 i = 0; i < count; i++)
+  {
+    hash = (hash ^ float_bits(values[i])) * 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+// The vertex attributes that decide whether two vertices are the same
+struct VertexKeys
+{
+  const v3 *positions;
+  const v2 *texture_coords; // 0 to only compare positions
+  const v3 *normals;        // 0 to only compare positions
+  u32 *hashes;
+};
+
+static bool same_floats(const f32 *a, const f32 *b, u32 count)
+{
+  for(u32 i = 0; i < count; i++)
+  {
+    if(float_bits(a[i]) != float_bits(b[i])) return false;
+  }
+  return true;
+}
+
+static bool same_vertex(const VertexKeys *keys, u32 a, u32 b)
+{
+  if(!same_floats(&keys->positions[a].x, &keys->positions[b].x, 3)) return false;
+  if(keys->texture_coords && !same_floats(&keys->texture_coords[a].x, &keys->texture_coords[b].x, 2)) return false;
+  if(keys->normals && !same_floats(&keys->normals[a].x, &keys->normals[b].x, 3)) return false;
+  return true;
+}
+
+static void hash_vertices_job(void *data, u32 begin, u32 end)
+{
+  VertexKeys *keys = (VertexKeys *)data;
+  for(u32 i = begin; i < end; i++)
+  {
+    u32 hash = hash_floats(2166136261u, &keys->positions[i].x, 3);
+    if(keys->texture_coords) hash = hash_floats(hash, &keys->texture_coords[i].x, 2);
+    if(keys->normals) hash = hash_floats(hash, &keys->normals[i].x, 3);
+    keys->hashes[i] = hash;
+  }
+}
+
+// Finds the first vertex that is the same as each vertex
+// Hashing runs on the job threads, the table is filled in order so the first vertex always wins
+static void find_first_vertices(VertexKeys *keys, u32 num_vertices, std::vector<u32> *first_vertices)
+{
+  std::vector<u32> hashes(num_vertices);
+  keys->hashes = hashes.data();
+  run_range_jobs(hash_vertices_job, keys, num_vertices, PROCESSING_RANGE_SIZE);
+
+  u32 table_size = 16;
+  while(table_size < num_vertices * 2) table_size *= 2;
+  std::vector<u32> table(table_size, NO_VERTEX);
+
+  first_vertices->resize(num_vertices);
+  for(u32 i = 0; i < num_vertices; i++)
+  {
+    u32 slot = hashes[i] & (table_size - 1);
+    for(;;)
+    {
+      u32 vertex = table[slot];
+      if(vertex == NO_VERTEX)
+      {
+        table[slot] = i;
+        (*first_vertices)[i] = i;
+        break;
+      }
+      if(hashes[vertex] == hashes[i] && same_vertex(keys, vertex, i))
+      {
+        (*first_vertices)[i] = vertex;
+        break;
+      }
+      slot = (slot + 1) & (table_size - 1);
+    }
+  }
+}
+
+// For each key, the corners (positions in the index array) that refer to it
+// Built with a count, a prefix sum and a fill so it needs no atomics
+struct CornerLists
+{
+  std::vector<u32> offsets; // Corners of key k are corners[offsets[k]] to corners[offsets[k + 1] - 1]
+  std::vector<u32> corners;
+};
+
+static void build_corner_lists(const std::vector<u32> &corner_keys, u32 num_keys, CornerLists *lists)
+{
+  lists->offsets.assign(num_keys + 1, 0);
+  for(u32 i = 0; i < corner_keys.size(); i++) lists->offsets[corner_keys[i] + 1]++;
+  for(u32 i = 0; i < num_keys; i++) lists->offsets[i + 1] += lists->offsets[i];
+
+  std::vector<u32> next(lists->offsets.begin(), lists->offsets.end() - 1);
+  lists->corners.resize(corner_keys.size());
+  for(u32 i = 0; i < corner_keys.size(); i++) lists->corners[next[corner_keys[i]]++] = i;
+}
+
+struct WeldJob
+{
+  const std::vector<u32> *first_vertices;
+  const std::vector<u32> *new_indices;
+  std::vector<u32> *indices;
+
+  const std::vector<v3> *positions;
+  const std::vector<v2> *texture_coords;
+  const std::vector<v3> *normals;
+  std::vector<v3> *welded_positions;
+  std::vector<v2> *welded_texture_coords;
+  std::vector<v3> *welded_normals;
+};
+
+static void copy_welded_vertices_job(void *data, u32 begin, u32 end)
+{
+  WeldJob *job = (WeldJob *)data;
+  for(u32 i = begin; i < end; i++)
+  {
+    if((*job->first_vertices)[i] != i) continue;
+
+    u32 new_index = (*job->new_indices)[i];
+    (*job->welded_positions)[new_index] = (*job->positions)[i];
+    if(job->welded_texture_coords) (*job->welded_texture_coords)[new_index] = (*job->texture_coords)[i];
+    if(job->welded_normals) (*job->welded_normals)[new_index] = (*job->normals)[i];
+  }
+}
+
+static void remap_indices_job(void *data, u32 begin, u32 end)
+{
+  WeldJob *job = (WeldJob *)data;
+  std::vector<u32> &indices = *job->indices;
+  for(u32 i = begin; i < end; i++)
+  {
+    indices[i] = (*job->new_indices)[indices[i]];
+  }
+}
+
+void weld_vertices(std::vector<v3> *positions, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<u32> *indices)
+{
+  u32 num_vertices = positions->size();
+  bool has_texture_coords = texture_coords && texture_coords->size() == num_vertices;
+  bool has_normals = normals && normals->size() == num_vertices;
+
+  VertexKeys keys;
+  keys.positions = positions->data();
+  keys.texture_coords = has_texture_coords ? texture_coords->data() : 0;
+  keys.normals = has_normals ? normals->data() : 0;
+
+  std::vector<u32> first_vertices;
+  find_first_vertices(&keys, num_vertices, &first_vertices);
+
+  // Welded vertices keep the order of the vertex they were first seen at
+  std::vector<u32> new_indices(num_vertices);
+  u32 num_welded = 0;
+  for(u32 i = 0; i < num_vertices; i++)
+  {
+    new_indices[i] = (first_vertices[i] == i) ? num_welded++ : new_indices[first_vertices[i]];
+  }
+
+  if(num_welded == num_vertices) return;
+
+  std::vector<v3> welded_positions(num_welded);
+  std::vector<v2> welded_texture_coords(has_texture_coords ? num_welded : 0);
+  std::vector<v3> welded_normals(has_normals ? num_welded : 0);
+
+  WeldJob job;
+  job.first_vertices = &first_vertices;
+  job.new_indices = &new_indices;
+  job.indices = indices;
+  job.positions = positions;
+  job.texture_coords = texture_coords;
+  job.normals = normals;
+  job.welded_positions = &welded_positions;
+  job.welded_texture_coords = has_texture_coords ? &welded_texture_coords : 0;
+  job.welded_normals = has_normals ? &welded_normals : 0;
+
+  run_range_jobs(copy_welded_vertices_job, &job, num_vertices, PROCESSING_RANGE_SIZE);
+  run_range_jobs(remap_indices_job, &job, indices->size(), PROCESSING_RANGE_SIZE);
+
+  positions->swap(welded_positions);
+  if(has_texture_coords) texture_coords->swap(welded_texture_coords);
+  if(has_normals) normals->swap(welded_normals);
+}
+
+// Angle of a triangle at p0
+static f32 corner_angle(v3 p0, v3 p1, v3 p2)
+{
+  v3 a = p1 - p0;
+  v3 b = p2 - p0;
+  f32 lengths = length(a) * length(b);
+  if(lengths == 0.0f) return 0.0f;
+
+  return acosf(clamp(dot(a, b) / lengths, -1.0f, 1.0f));
+}
+
+struct NormalJob
+{
+  const std::vector<v3> *positions;
+  const std::vector<u32> *indices;
+  const std::vector<u32> *first_vertices;
+  const CornerLists *lists;
+  std::vector<v3> *corner_normals;
+  std::vector<v3> *normals;
+};
+
+// The normal each corner adds to its vertex
+// The length of the cross product is twice the area of the triangle
+static void corner_normals_job(void *data, u32 begin, u32 end)
+{
+  NormalJob *job = (NormalJob *)data;
+  const std::vector<v3> &positions = *job->positions;
+  const std::vector<u32> &indices = *job->indices;
+  std::vector<v3> &corner_normals = *job->corner_normals;
+
+  for(u32 triangle = begin; triangle < end; triangle++)
+  {
+    u32 corner = triangle * 3;
+    v3 p0 = positions[indices[corner + 0]];
+    v3 p1 = positions[indices[corner + 1]];
+    v3 p2 = positions[indices[corner + 2]];
+
+    v3 area_normal = cross(p1 - p0, p2 - p0);
+    corner_normals[corner + 0] = area_normal * corner_angle(p0, p1, p2);
+    corner_normals[corner + 1] = area_normal * corner_angle(p1, p2, p0);
+    corner_normals[corner + 2] = area_normal * corner_angle(p2, p0, p1);
+  }
+}
+
+static void gather_normals_job(void *data, u32 begin, u32 end)
+{
+  NormalJob *job = (NormalJob *)data;
+  const CornerLists &lists = *job->lists;
+
+  for(u32 i = begin; i < end; i++)
+  {
+    u32 key = (*job->first_vertices)[i];
+
+    v3 sum = v3();
+    for(u32 j = lists.offsets[key]; j < lists.offsets[key + 1]; j++)
+    {
+      sum += (*job->corner_normals)[lists.corners[j]];
+    }
+
+    f32 sum_length = length(sum);
+    (*job->normals)[i] = (sum_length > 0.0f) ? sum / sum_length : v3(0.0f, 0.0f, 1.0f);
+  }
+}
+
+void compute_normals(const std::vector<v3> *positions, const std::vector<u32> *indices, std::vector<v3> *normals)
+{
+  u32 num_vertices = positions->size();
+  normals->resize(num_vertices);
+  if(num_vertices == 0) return;
+
+  // Vertices are split where texture coordinates differ, so gather by position
+  VertexKeys keys = {};
+  keys.positions = positions->data();
+  std::vector<u32> first_vertices;
+  find_first_vertices(&keys, num_vertices, &first_vertices);
+
+  std::vector<u32> corner_keys(indices->size());
+  for(u32 i = 0; i < indices->size(); i++) corner_keys[i] = first_vertices[(*indices)[i]];
+
+  CornerLists lists;
+  build_corner_lists(corner_keys, num_vertices, &lists);
+
+  std::vector<v3> corner_normals(indices->size());
+
+  NormalJob job;
+  job.positions = positions;
+  job.indices = indices;
+  job.first_vertices = &first_vertices;
+  job.lists = &lists;
+  job.corner_normals = &corner_normals;
+  job.normals = normals;
+
+  run_range_jobs(corner_normals_job, &job, indices->size() / 3, PROCESSING_RANGE_SIZE);
+  run_range_jobs(gather_normals_job, &job, num_vertices, PROCESSING_RANGE_SIZE);
+}
+
+struct TangentJob
+{
+  const std::vector<v3> *positions;
+  const std::vector<v3> *normals;
+  const std::vector<v2> *texture_coords;
+  const std::vector<u32> *indices;
+  const CornerLists *lists;
+  std::vector<v3> *corner_tangents;
+  std::vector<v3> *corner_bitangents;
+  std::vector<v4> *tangents;
+};
+
+// Directions of u and v across each triangle, the same for its three corners
+static void corner_tangents_job(void *data, u32 begin, u32 end)
+{
+  TangentJob *job = (TangentJob *)data;
+  const std::vector<v3> &positions = *job->positions;
+  const std::vector<v2> &texture_coords = *job->texture_coords;
+  const std::vector<u32> &indices = *job->indices;
+
+  for(u32 triangle = begin; triangle < end; triangle++)
+  {
+    u32 corner = triangle * 3;
+    u32 i0 = indices[corner + 0];
+    u32 i1 = indices[corner + 1];
+    u32 i2 = indices[corner + 2];
+
+    v3 edge1 = positions[i1] - positions[i0];
+    v3 edge2 = positions[i2] - positions[i0];
+    v2 delta1 = texture_coords[i1] - texture_coords[i0];
+    v2 delta2 = texture_coords[i2] - texture_coords[i0];
+
+    // Larger triangles in texture space count for less, the same as area weighting in model space
+    f32 determinant = delta1.x * delta2.y - delta2.x * delta1.y;
+    v3 tangent = v3();
+    v3 bitangent = v3();
+    if(determinant != 0.0f)
+    {
+      f32 r = 1.0f / determinant;
+      tangent = (edge1 * delta2.y - edge2 * delta1.y) * r;
+      bitangent = (edge2 * delta1.x - edge1 * delta2.x) * r;
+    }
+
+    for(u32 j = 0; j < 3; j++)
+    {
+      (*job->corner_tangents)[corner + j] = tangent;
+      (*job->corner_bitangents)[corner + j] = bitangent;
+    }
+  }
+}
+
+static void gather_tangents_job(void *data, u32 begin, u32 end)
+{
+  TangentJob *job = (TangentJob *)data;
+  const CornerLists &lists = *job->lists;
+
+  for(u32 i = begin; i < end; i++)
+  {
+    v3 tangent = v3();
+    v3 bitangent = v3();
+    for(u32 j = lists.offsets[i]; j < lists.offsets[i + 1]; j++)
+    {
+      tangent += (*job->corner_tangents)[lists.corners[j]];
+      bitangent += (*job->corner_bitangents)[lists.corners[j]];
+    }
+
+    // Gram-Schmidt against the normal
+    v3 normal = (*job->normals)[i];
+    tangent = tangent - normal * dot(normal, tangent);
+    f32 tangent_length = length(tangent);
+    if(tangent_length > 0.0f)
+    {
+      tangent = tangent / tangent_length;
+    }
+    else
+    {
+      // No texture stretch to follow, any direction along the surface works
+      v3 axis = (fabsf(normal.x) < 0.9f) ? v3(1.0f, 0.0f, 0.0f) : v3(0.0f, 1.0f, 0.0f);
+      tangent = unit(cross(normal, cross(axis, normal)));
+    }
+
+    f32 handedness = (dot(cross(normal, tangent), bitangent) < 0.0f) ? -1.0f : 1.0f;
+    (*job->tangents)[i] = v4(tangent, handedness);
+  }
+}
+
+void compute_tangents(const std::vector<v3> *positions, const std::vector<v3> *normals, const std::vector<v2> *texture_coords, const std::vector<u32> *indices, std::vector<v4> *tangents)
+{
+  u32 num_vertices = positions->size();
+  tangents->resize(num_vertices);
+  if(num_vertices == 0 || texture_coords->size() != num_vertices || normals->size() != num_vertices) return;
+
+  CornerLists lists;
+  build_corner_lists(*indices, num_vertices, &lists);
+
+  std::vector<v3> corner_tangents(indices->size());
+  std::vector<v3> corner_bitangents(indices->size());
+
+  TangentJob job;
+  job.positions = positions;
+  job.normals = normals;
+  job.texture_coords = texture_coords;
+  job.indices = indices;
+  job.lists = &lists;
+  job.corner_tangents = &corner_tangents;
+  job.corner_bitangents = &corner_bitangents;
+  job.tangents = tangents;
+
+  run_range_jobs(corner_tangents_job, &job, indices->size() / 3, PROCESSING_RANGE_SIZE);
+  run_range_jobs(gather_tangents_job, &job, num_vertices, PROCESSING_RANGE_SIZE);
+}
+
+static void normalize_vectors_job(void *data, u32 begin, u32 end)
+{
+  std::vector<v3> &vectors = *(std::vector<v3> *)data;
+  for(u32 i = begin; i < end; i++)
+  {
+    f32 vector_length = length(vectors[i]);
+    vectors[i] = (vector_length > 0.0f) ? vectors[i] / vector_length : v3(0.0f, 0.0f, 1.0f);
+  }
+}
+
+void normalize_vectors(std::vector<v3> *vectors)
+{
+  run_range_jobs(normalize_vectors_job, vectors, vectors->size(), PROCESSING_RANGE_SIZE);
+}
+
+// Bounds of one range of vertices, summed in doubles so large meshes do not lose the centroid
+struct RangeBounds
+{
+  v3 min;
+  v3 max;
+  f64 sum[3];
+  f32 radius;
+};
+
+struct BoundsJob
+{
+  const std::vector<v3> *positions;
+  std::vector<RangeBounds> *ranges;
+  v3 centroid;
+};
+
+static void range_bounds_job(void *data, u32 begin, u32 end)
+{
+  BoundsJob *job = (BoundsJob *)data;
+  const std::vector<v3> &positions = *job->positions;
+
+  RangeBounds bounds;
+  bounds.min = positions[begin];
+  bounds.max = positions[begin];
+  bounds.sum[0] = bounds.sum[1] = bounds.sum[2] = 0.0;
+  bounds.radius = 0.0f;
+  for(u32 i = begin; i < end; i++)
+  {
+    v3 p = positions[i];
+    bounds.min = v3(min(bounds.min.x, p.x), min(bounds.min.y, p.y), min(bounds.min.z, p.z));
+    bounds.max = v3(max(bounds.max.x, p.x), max(bounds.max.y, p.y), max(bounds.max.z, p.z));
+    bounds.sum[0] += p.x;
+    bounds.sum[1] += p.y;
+    bounds.sum[2] += p.z;
+  }
+
+  (*job->ranges)[begin / PROCESSING_RANGE_SIZE] = bounds;
+}
+
+static void range_radius_job(void *data, u32 begin, u32 end)
+{
+  BoundsJob *job = (BoundsJob *)data;
+
+  f32 radius_squared = 0.0f;
+  for(u32 i = begin; i < end; i++)
+  {
+    radius_squared = max(radius_squared, length_squared((*job->positions)[i] - job->centroid));
+  }
+
+  (*job->ranges)[begin / PROCESSING_RANGE_SIZE].radius = sqrtf(radius_squared);
+}
+
+MeshBounds compute_bounds(const std::vector<v3> *positions)
+{
+  MeshBounds result = {};
+  u32 num_vertices = positions->size();
+  if(num_vertices == 0) return result;
+
+  std::vector<RangeBounds> ranges((num_vertices + PROCESSING_RANGE_SIZE - 1) / PROCESSING_RANGE_SIZE);
+
+  BoundsJob job;
+  job.positions = positions;
+  job.ranges = &ranges;
+  run_range_jobs(range_bounds_job, &job, num_vertices, PROCESSING_RANGE_SIZE);
+
+  f64 sum[3] = {};
+  result.min = ranges[0].min;
+  result.max = ranges[0].max;
+  for(u32 i = 0; i < ranges.size(); i++)
+  {
+    result.min = v3(min(result.min.x, ranges[i].min.x), min(result.min.y, ranges[i].min.y), min(result.min.z, ranges[i].min.z));
+    result.max = v3(max(result.max.x, ranges[i].max.x), max(result.max.y, ranges[i].max.y), max(result.max.z, ranges[i].max.z));
+    for(u32 j = 0; j < 3; j++) sum[j] += ranges[i].sum[j];
+  }
+  result.centroid = v3((f32)(sum[0] / num_vertices), (f32)(sum[1] / num_vertices), (f32)(sum[2] / num_vertices));
+
+  job.centroid = result.centroid;
+  run_range_jobs(range_radius_job, &job, num_vertices, PROCESSING_RANGE_SIZE);
+  for(u32 i = 0; i < ranges.size(); i++) result.radius = max(result.radius, ranges[i].radius);
+
+  return result;
+}
+
+struct NormalizeJob
+{
+  std::vector<v3> *positions;
+  v3 centroid;
+  f32 scale;
+};
+
+static void normalize_positions_job(void *data, u32 begin, u32 end)
+{
+  NormalizeJob *job = (NormalizeJob *)data;
+  std::vector<v3> &positions = *job->positions;
+  for(u32 i = begin; i < end; i++)
+  {
+    positions[i] = (positions[i] - job->centroid) * job->scale;
+  }
+}
+
+void normalize_positions(std::vector<v3> *positions)
+{
+  if(positions->size() == 0) return;
+
+  MeshBounds bounds = compute_bounds(positions);
+  f32 max_diff = max(bounds.max.x - bounds.min.x, bounds.max.y - bounds.min.y);
+  if(max_diff == 0.0f) return;
+
+  NormalizeJob job;
+  job.positions = positions;
+  job.centroid = bounds.centroid;
+  job.scale = 2.0f / max_diff;
+  run_range_jobs(normalize_positions_job, &job, positions->size(), PROCESSING_RANGE_SIZE);
+}
+
+// Area weighted sum of squared distances to a set of planes, x^T A x + 2 b.x + c
+// Dividing by the total weight gives the mean squared distance, which is in
+// model units no matter how many planes were added
+// Doubles keep the sums of many nearly equal planes from losing precision
+struct Quadric
+{
+  f64 a00, a01, a02, a11, a12, a22;
+  f64 b0, b1, b2;
+  f64 c;
+  f64 weight;
+};
+
+static void add_plane(Quadric *q, v3 normal, f64 d, f64 weight)
+{
+  f64 x = normal.x;
+  f64 y = normal.y;
+  f64 z = normal.z;
+  q->a00 += weight * x * x; q->a01 += weight * x * y; q->a02 += weight * x * z;
+  q->a11 += weight * y * y; q->a12 += weight * y * z;
+  q->a22 += weight * z * z;
+  q->b0 += weight * x * d; q->b1 += weight * y * d; q->b2 += weight * z * d;
+  q->c += weight * d * d;
+  q->weight += weight;
+}
+
+static void add_quadric(Quadric *q, const Quadric *other)
+{
+  q->a00 += other->a00; q->a01 += other->a01; q->a02 += other->a02;
+  q->a11 += other->a11; q->a12 += other->a12;
+  q->a22 += other->a22;
+  q->b0 += other->b0; q->b1 += other->b1; q->b2 += other->b2;
+  q->c += other->c;
+  q->weight += other->weight;
+}
+
+static f64 quadric_error(const Quadric *q, v3 p)
+{
+  f64 x = p.x;
+  f64 y = p.y;
+  f64 z = p.z;
+  f64 error = q->a00 * x * x + q->a11 * y * y + q->a22 * z * z +
+              2.0 * (q->a01 * x * y + q->a02 * x * z + q->a12 * y * z) +
+              2.0 * (q->b0 * x + q->b1 * y + q->b2 * z) + q->c;
+  if(error <= 0.0 || q->weight == 0.0) return 0.0;
+  return error / q->weight;
+}
+
+// Moving vertex from onto vertex to
+struct Collapse
+{
+  u32 from;
+  u32 to;
+  f64 error;
+
+  bool operator<(const Collapse &other) const
+  {
+    return error < other.error;
+  }
+};
+
+// Finds vertices that must not move: ones that share their position with
+// another vertex, and ones on edges that do not have exactly two triangles
+static void find_locked_vertices(const std::vector<v3> *positions, const std::vector<u32> *indices, std::vector<bool> *locked)
+{
+  u32 num_vertices = positions->size();
+
+  VertexKeys keys = {};
+  keys.positions = positions->data();
+  std::vector<u32> first_vertices;
+  find_first_vertices(&keys, num_vertices, &first_vertices);
+
+  std::vector<u32> vertices_at_position(num_vertices, 0);
+  for(u32 i = 0; i < num_vertices; i++) vertices_at_position[first_vertices[i]]++;
+
+  std::unordered_map<u64, u32> edge_triangles;
+  edge_triangles.reserve(indices->size());
+  for(u32 i = 0; i < indices->size(); i += 3)
+  {
+    for(u32 j = 0; j < 3; j++)
+    {
+      u32 a = first_vertices[(*indices)[i + j]];
+      u32 b = first_vertices[(*indices)[i + (j + 1) % 3]];
+      u64 edge = (a < b) ? ((u64)a << 32 | b) : ((u64)b << 32 | a);
+      edge_triangles[edge]++;
+    }
+  }
+
+  std::vector<bool> locked_positions(num_vertices, false);
+  for(u32 i = 0; i < num_vertices; i++)
+  {
+    if(vertices_at_position[i] > 1) locked_positions[i] = true;
+  }
+  for(std::unordered_map<u64, u32>::iterator it = edge_triangles.begin(); it != edge_triangles.end(); ++it)
+  {
+    if(it->second != 2)
+    {
+      locked_positions[it->first >> 32] = true;
+      locked_positions[it->first & 0xFFFFFFFF] = true;
+    }
+  }
+
+  locked->resize(num_vertices);
+  for(u32 i = 0; i < num_vertices; i++) (*locked)[i] = locked_positions[first_vertices[i]];
+}
+
+// Cosine of the most a triangle can turn when a vertex of it moves, about 75 degrees
+#define MAX_COLLAPSE_TURN_COS 0.25f
+
+// Checks that moving a vertex does not flip, flatten or turn too far any triangle around it that stays
+static bool collapse_keeps_orientation(const std::vector<v3> &positions, const std::vector<u32> &indices, const CornerLists &lists, u32 from, u32 to)
+{
+  v3 to_position = positions[to];
+  for(u32 i = lists.offsets[from]; i < lists.offsets[from + 1]; i++)
+  {
+    u32 corner = lists.corners[i];
+    u32 triangle = corner - corner % 3;
+    u32 i0 = indices[triangle + 0];
+    u32 i1 = indices[triangle + 1];
+    u32 i2 = indices[triangle + 2];
+
+    // This triangle collapses away
+    if(i0 == to || i1 == to || i2 == to) continue;
+
+    v3 p0 = positions[i0];
+    v3 p1 = positions[i1];
+    v3 p2 = positions[i2];
+    v3 before = cross(p1 - p0, p2 - p0);
+
+    if(i0 == from) p0 = to_position;
+    if(i1 == from) p1 = to_position;
+    if(i2 == from) p2 = to_position;
+    v3 after = cross(p1 - p0, p2 - p0);
+
+    // Turning a triangle too far also turns it away from its vertex normals
+    if(dot(before, after) <= MAX_COLLAPSE_TURN_COS * length(before) * length(after)) return false;
+  }
+
+  return true;
+}
+
+f32 simplify_mesh(const std::vector<v3> *in_positions, const std::vector<u32> *in_indices, u32 target_indices, std::vector<u32> *simplified_indices)
+{
+  const std::vector<v3> &positions = *in_positions;
+  u32 num_vertices = positions.size();
+
+  std::vector<u32> &indices = *simplified_indices;
+  indices = *in_indices;
+  if(indices.size() <= target_indices) return 0.0f;
+
+  std::vector<bool> locked;
+  find_locked_vertices(in_positions, in_indices, &locked);
+
+  // Each vertex starts with the planes of its triangles
+  std::vector<Quadric> quadrics(num_vertices, Quadric());
+  for(u32 i = 0; i < indices.size(); i += 3)
+  {
+    v3 p0 = positions[indices[i + 0]];
+    v3 p1 = positions[indices[i + 1]];
+    v3 p2 = positions[indices[i + 2]];
+    v3 normal = cross(p1 - p0, p2 - p0);
+    f32 normal_length = length(normal);
+    if(normal_length == 0.0f) continue;
+
+    normal = normal / normal_length;
+    f64 d = -dot(normal, p0);
+    for(u32 j = 0; j < 3; j++) add_plane(&quadrics[indices[i + j]], normal, d, normal_length * 0.5f);
+  }
+
+  f64 max_error = 0.0;
+  std::vector<Collapse> collapses;
+  std::vector<u32> remap(num_vertices);
+  std::vector<bool> touched(num_vertices);
+
+  // Each pass collapses the cheapest edges that do not share vertices, then rebuilds the triangles
+  while(indices.size() > target_indices)
+  {
+    collapses.clear();
+    for(u32 i = 0; i < indices.size(); i += 3)
+    {
+      for(u32 j = 0; j < 3; j++)
+      {
+        u32 a = indices[i + j];
+        u32 b = indices[i + (j + 1) % 3];
+
+        Quadric q = quadrics[a];
+        add_quadric(&q, &quadrics[b]);
+        if(!locked[a])
+        {
+          Collapse collapse = { a, b, quadric_error(&q, positions[b]) };
+          collapses.push_back(collapse);
+        }
+        if(!locked[b])
+        {
+          Collapse collapse = { b, a, quadric_error(&q, positions[a]) };
+          collapses.push_back(collapse);
+        }
+      }
+    }
+    std::sort(collapses.begin(), collapses.end());
+
+    CornerLists lists;
+    build_corner_lists(indices, num_vertices, &lists);
+
+    for(u32 i = 0; i < num_vertices; i++)
+    {
+      remap[i] = i;
+      touched[i] = false;
+    }
+
+    // A collapse removes about two triangles
+    s32 triangles_left = indices.size() / 3;
+    s32 target_triangles = target_indices / 3;
+    u32 num_collapsed = 0;
+
+    for(u32 i = 0; i < collapses.size() && triangles_left > target_triangles; i++)
+    {
+      const Collapse &collapse = collapses[i];
+      if(touched[collapse.from] || touched[collapse.to]) continue;
+      if(!collapse_keeps_orientation(positions, indices, lists, collapse.from, collapse.to)) continue;
+
+      remap[collapse.from] = collapse.to;
+      add_quadric(&quadrics[collapse.to], &quadrics[collapse.from]);
+      if(collapse.error > max_error) max_error = collapse.error;
+      num_collapsed++;
+      triangles_left -= 2;
+
+      // The triangles around the vertex changed, so nothing around it can collapse until the next pass
+      for(u32 j = lists.offsets[collapse.from]; j < lists.offsets[collapse.from + 1]; j++)
+      {
+        u32 triangle = lists.corners[j] - lists.corners[j] % 3;
+        touched[indices[triangle + 0]] = true;
+        touched[indices[triangle + 1]] = true;
+        touched[indices[triangle + 2]] = true;
+      }
+    }
+
+    if(num_collapsed == 0) break;
+
+    // Drop the triangles that collapsed to a line
+    u32 write = 0;
+    for(u32 i = 0; i < indices.size(); i += 3)
+    {
+      u32 i0 = remap[indices[i + 0]];
+      u32 i1 = remap[indices[i + 1]];
+      u32 i2 = remap[indices[i + 2]];
+      if(i0 == i1 || i1 == i2 || i2 == i0) continue;
+
+      indices[write++] = i0;
+      indices[write++] = i1;
+      indices[write++] = i2;
+    }
+    indices.resize(write);
+  }
+
+  return (f32)sqrt(max_error);
+}
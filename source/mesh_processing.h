@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.h"
+#include "my_math.h"
+
+#include <vector>
+
+// Mesh preprocessing on the job threads
+//
+// Every step is split into ranges of vertices or triangles. Steps that add up
+// values from many triangles into one vertex gather them per vertex instead of
+// scattering into shared sums, so no atomics or locks are needed and the
+// results are the same for any number of threads.
+
+struct MeshBounds
+{
+  v3 min;
+  v3 max;
+
+  // Centroid of the vertices and the distance to the farthest one
+  v3 centroid;
+  f32 radius;
+};
+
+// Merges vertices that have the same position, texture coordinate and normal
+// and remaps the indices. Texture coordinates and normals are optional.
+void weld_vertices(std::vector<v3> *positions, std::vector<v2> *texture_coords, std::vector<v3> *normals, std::vector<u32> *indices);
+
+// Unit normals weighted by the area of each triangle and its angle at the vertex
+// Vertices with the same position get the same normal, so there are no seams
+// where vertices were split for different texture coordinates
+void compute_normals(const std::vector<v3> *positions, const std::vector<u32> *indices, std::vector<v3> *normals);
+
+// Unit tangents along the texture u direction, made perpendicular to the normals
+// w is 1 or -1 for the direction of the bitangent, cross(normal, tangent) * w
+void compute_tangents(const std::vector<v3> *positions, const std::vector<v3> *normals, const std::vector<v2> *texture_coords, const std::vector<u32> *indices, std::vector<v4> *tangents);
+
+// Makes every vector unit length, zero vectors become (0, 0, 1)
+void normalize_vectors(std::vector<v3> *vectors);
+
+MeshBounds compute_bounds(const std::vector<v3> *positions);
+
+// Moves the centroid to the origin and scales to about -1 to 1 by the larger
+// of the x and y extents, the same as normalize_mesh always has
+void normalize_positions(std::vector<v3> *positions);
+
+// Collapses edges with the smallest quadric error until there are at most
+// target_indices indices left or nothing more can collapse without flipping
+// or sharply turning a triangle. The simplified triangles use the same vertices, so a chain of
+// LODs can share one vertex array. Vertices on open borders and on seams where
+// vertices were split for texture coordinates or normals stay where they are.
+// Returns about how far, in model units, the surface moved at most, as the
+// largest area weighted RMS distance of a collapsed vertex to its planes.
+f32 simplify_mesh(const std::vector<v3> *positions, const std::vector<u32> *indices, u32 target_indices, std::vector<u32> *simplified_indices);
@@ -3,10 +3,11 @@
 #include "types.h"
 
 #include <math.h> // sqrt, cos, sin, atan2f
+#include <xmmintrin.h> // SSE
 
 #define PI 3.14159265f
-#define squared(a) (a * a)
-#define deg_to_rad(a) (a * (PI / 180.0f));
+#define squared(a) ((a) * (a))
+#define deg_to_rad(a) ((a) * (PI / 180.0f))
 
 ///////////////////////////////////////////////////////////////////////////////
 // vector structs
@@ -72,13 +73,27 @@ struct v4
 // vector operations
 ///////////////////////////////////////////////////////////////////////////////
 
+// v4 is 4 floats in a row, so it goes in and out of an SSE register with an
+// unaligned load and store that compile away when the function is inlined.
+// It is not stored as an __m128 because 32 bit builds can not pass 16 byte
+// aligned types by value, and arrays of them would need aligned allocations.
+static __m128 load_v4(v4 a) { return _mm_loadu_ps(&a.x); }
+static v4 store_v4(__m128 a) { v4 v; _mm_storeu_ps(&v.x, a); return v; }
+
+// Writes the x, y and z lanes without touching the 4 bytes after the v3
+static void store_v3(v3 *out, __m128 a)
+{
+  _mm_storel_pi((__m64 *)&out->x, a);
+  _mm_store_ss(&out->z, _mm_movehl_ps(a, a));
+}
+
 static v2 operator+(v2 a, v2 b) { return v2(a.x + b.x, a.y + b.y); }
 static v3 operator+(v3 a, v3 b) { return v3(a.x + b.x, a.y + b.y, a.z + b.z); }
-static v4 operator+(v4 a, v4 b) { return v4(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w); }
+static v4 operator+(v4 a, v4 b) { return store_v4(_mm_add_ps(load_v4(a), load_v4(b))); }
 
 static v2 operator-(v2 a, v2 b) { return v2(a.x - b.x, a.y - b.y); }
 static v3 operator-(v3 a, v3 b) { return v3(a.x - b.x, a.y - b.y, a.z - b.z); }
-static v4 operator-(v4 a, v4 b) { return v4(a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w); }
+static v4 operator-(v4 a, v4 b) { return store_v4(_mm_sub_ps(load_v4(a), load_v4(b))); }
 
 // Unary negation
 static v2 operator-(v2 a) { return v2(-a.x, -a.y); }
@@ -95,10 +110,10 @@ static f32 dot(v4 a, v4 b) { return a * b; }
 
 static v2 operator*(v2 a, f32 scalar) { return v2(a.x * scalar, a.y * scalar); }
 static v3 operator*(v3 a, f32 scalar) { return v3(a.x * scalar, a.y * scalar, a.z * scalar); }
-static v4 operator*(v4 a, f32 scalar) { return v4(a.x * scalar, a.y * scalar, a.z * scalar, a.w * scalar); }
+static v4 operator*(v4 a, f32 scalar) { return store_v4(_mm_mul_ps(load_v4(a), _mm_set1_ps(scalar))); }
 static v2 operator*(f32 scalar, v2 a) { return v2(a.x * scalar, a.y * scalar); }
 static v3 operator*(f32 scalar, v3 a) { return v3(a.x * scalar, a.y * scalar, a.z * scalar); }
-static v4 operator*(f32 scalar, v4 a) { return v4(a.x * scalar, a.y * scalar, a.z * scalar, a.w * scalar); }
+static v4 operator*(f32 scalar, v4 a) { return a * scalar; }
 
 static v2 operator/(v2 a, f32 scalar) { return v2(a.x / scalar, a.y / scalar); }
 static v3 operator/(v3 a, f32 scalar) { return v3(a.x / scalar, a.y / scalar, a.z / scalar); }
@@ -112,9 +127,9 @@ static v2 &operator-=(v2 &a, v2 b) { a.x -= b.x; a.y -= b.y; return a; }
 static v3 &operator-=(v3 &a, v3 b) { a.x -= b.x; a.y -= b.y; a.z -= b.z; return a; }
 static v4 &operator-=(v4 &a, v4 b) { a.x -= b.x; a.y -= b.y; a.z -= b.z; a.w -= b.w; return a; }
 
-static v2 &operator*=(v2 &a, f32 b) { a.x -= b; a.y -= b; return a; }
-static v3 &operator*=(v3 &a, f32 b) { a.x -= b; a.y -= b; a.z -= b; return a; }
-static v4 &operator*=(v4 &a, f32 b) { a.x -= b; a.y -= b; a.z -= b; a.w -= b; return a; }
+static v2 &operator*=(v2 &a, f32 b) { a.x *= b; a.y *= b; return a; }
+static v3 &operator*=(v3 &a, f32 b) { a.x *= b; a.y *= b; a.z *= b; return a; }
+static v4 &operator*=(v4 &a, f32 b) { a.x *= b; a.y *= b; a.z *= b; a.w *= b; return a; }
 
 static v2 &operator/=(v2 &a, f32 b) { a.x /= b; a.y /= b; return a; }
 static v3 &operator/=(v3 &a, f32 b) { a.x /= b; a.y /= b; a.z /= b; return a; }
@@ -162,6 +177,40 @@ static v4 unit(v4 v)
   return v / length(v);
 }
 
+// Estimates from the SSE approximation instructions with one Newton-Raphson
+// step, about 22 bits instead of 24. They skip the divide or square root for
+// shading and similar math that does not need the last bits. Zero and infinity
+// give NaN, so they are not for values that can be either.
+static f32 rcp_fast(f32 a)
+{
+  __m128 value = _mm_set_ss(a);
+  __m128 estimate = _mm_rcp_ss(value);
+
+  // r * (2 - a * r)
+  estimate = _mm_mul_ss(estimate, _mm_sub_ss(_mm_set_ss(2.0f), _mm_mul_ss(value, estimate)));
+  return _mm_cvtss_f32(estimate);
+}
+static f32 rsqrt_fast(f32 a)
+{
+  __m128 value = _mm_set_ss(a);
+  __m128 estimate = _mm_rsqrt_ss(value);
+
+  // r * (1.5 - 0.5 * a * r * r)
+  __m128 half_value_estimate = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), value), estimate);
+  estimate = _mm_mul_ss(estimate, _mm_sub_ss(_mm_set_ss(1.5f), _mm_mul_ss(half_value_estimate, estimate)));
+  return _mm_cvtss_f32(estimate);
+}
+
+// unit with rsqrt_fast, the vector must not be zero
+static v3 unit_fast(v3 v)
+{
+  return v * rsqrt_fast(length_squared(v));
+}
+static v4 unit_fast(v4 v)
+{
+  return v * rsqrt_fast(length_squared(v));
+}
+
 // Returns this vector clamped by max length
 static v2 clamp_length(v2 v, f32 max_length)
 {
@@ -285,12 +334,13 @@ struct mat4
 // matrix operations
 ///////////////////////////////////////////////////////////////////////////////
 
+// The scalar matrix products, kept to check the SSE ones against in math_check.cpp
 // This funciton was made only for the matrix-vector multiplication
 static f32 dot4v(const f32 *a, v4 b)
 {
   return (a[0] * b.x) + (a[1] * b.y) + (a[2] * b.z) + (a[3] * b.w);
 }
-static v4 operator*(const mat4 &lhs, v4 rhs)
+static v4 mul_scalar(const mat4 &lhs, v4 rhs)
 {
   v4 result;
 
@@ -302,7 +352,7 @@ static v4 operator*(const mat4 &lhs, v4 rhs)
   return result;
 }
 
-static mat4 operator*(const mat4 &lhs, const mat4 &rhs)
+static mat4 mul_scalar(const mat4 &lhs, const mat4 &rhs)
 {
   mat4 product;
 
@@ -325,6 +375,98 @@ static mat4 operator*(const mat4 &lhs, const mat4 &rhs)
   return product;
 }
 
+// The SSE products take the columns of the left matrix times the coordinates
+// of the vector, or the rows of the right matrix times the entries of a left
+// row. They add in the same order as the dot products of the scalar ones, so
+// the results are the same to the bit, as long as the compiler does not fuse
+// the scalar multiplies and adds into FMA instructions (-ffp-contract=off).
+// math_check.cpp compares them.
+
+// The columns of a matrix, for transforming many vectors with it
+struct mat4_columns
+{
+  __m128 c[4];
+};
+
+static mat4_columns matrix_columns(const mat4 &m)
+{
+  mat4_columns result;
+  result.c[0] = _mm_loadu_ps(m[0]);
+  result.c[1] = _mm_loadu_ps(m[1]);
+  result.c[2] = _mm_loadu_ps(m[2]);
+  result.c[3] = _mm_loadu_ps(m[3]);
+  _MM_TRANSPOSE4_PS(result.c[0], result.c[1], result.c[2], result.c[3]);
+  return result;
+}
+
+// m * (x, y, z, 1)
+static __m128 transform_point(const mat4_columns &m, f32 x, f32 y, f32 z)
+{
+  return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m.c[0], _mm_set1_ps(x)), _mm_mul_ps(m.c[1], _mm_set1_ps(y))),
+                               _mm_mul_ps(m.c[2], _mm_set1_ps(z))), m.c[3]);
+}
+
+// m * (x, y, z, 0)
+static __m128 transform_direction(const mat4_columns &m, f32 x, f32 y, f32 z)
+{
+  return _mm_add_ps(_mm_add_ps(_mm_mul_ps(m.c[0], _mm_set1_ps(x)), _mm_mul_ps(m.c[1], _mm_set1_ps(y))),
+                    _mm_mul_ps(m.c[2], _mm_set1_ps(z)));
+}
+
+static __m128 transform_v4(const mat4_columns &m, __m128 v)
+{
+  __m128 x = _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0));
+  __m128 y = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1));
+  __m128 z = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2));
+  __m128 w = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+  return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m.c[0], x), _mm_mul_ps(m.c[1], y)),
+                               _mm_mul_ps(m.c[2], z)), _mm_mul_ps(m.c[3], w));
+}
+
+static v4 operator*(const mat4 &lhs, v4 rhs)
+{
+  return store_v4(transform_v4(matrix_columns(lhs), load_v4(rhs)));
+}
+
+static mat4 operator*(const mat4 &lhs, const mat4 &rhs)
+{
+  __m128 rhs_rows[4];
+  for(u32 i = 0; i < 4; i++)
+  {
+    rhs_rows[i] = _mm_loadu_ps(rhs[i]);
+  }
+
+  mat4 product;
+  for(u32 row = 0; row < 4; row++)
+  {
+    const f32 *lhs_row = lhs[row];
+    __m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(lhs_row[0]), rhs_rows[0]), _mm_mul_ps(_mm_set1_ps(lhs_row[1]), rhs_rows[1])),
+                                       _mm_mul_ps(_mm_set1_ps(lhs_row[2]), rhs_rows[2])), _mm_mul_ps(_mm_set1_ps(lhs_row[3]), rhs_rows[3]));
+    _mm_storeu_ps(product[row], sum);
+  }
+
+  return product;
+}
+
+// Transforms count points (w = 1) or directions (w = 0) with the same matrix
+// The columns are set up once for the whole array
+static void transform_points(const mat4 &m, const v3 *in, v4 *out, u32 count)
+{
+  mat4_columns m_columns = matrix_columns(m);
+  for(u32 i = 0; i < count; i++)
+  {
+    _mm_storeu_ps(&out[i].x, transform_point(m_columns, in[i].x, in[i].y, in[i].z));
+  }
+}
+static void transform_directions(const mat4 &m, const v3 *in, v4 *out, u32 count)
+{
+  mat4_columns m_columns = matrix_columns(m);
+  for(u32 i = 0; i < count; i++)
+  {
+    _mm_storeu_ps(&out[i].x, transform_direction(m_columns, in[i].x, in[i].y, in[i].z));
+  }
+}
+
 static mat4 translation_mat(v3 offset)
 {
   mat4 result = 
@@ -0,0 +1,284 @@
+#include "picking.h"
+
+#include <algorithm> // std::nth_element, std::sort
+
+// Most triangles in a leaf
+#define MESH_BVH_LEAF_SIZE 4
+
+// Deeper than any hierarchy of median splits gets
+#define MAX_BVH_DEPTH 64
+
+// Center of a triangle along an axis for splitting, from its bounds
+struct TriangleCenterLess
+{
+  const v3 *centers;
+  u32 axis;
+
+  bool operator()(u32 a, u32 b) const
+  {
+    return (&centers[a].x)[axis] < (&centers[b].x)[axis];
+  }
+};
+
+struct SceneRayHitLess
+{
+  bool operator()(const SceneRayHit &a, const SceneRayHit &b) const
+  {
+    return a.t < b.t;
+  }
+};
+
+// Slab test, inv_direction is 1 / direction of the ray
+// Returns whether the ray is in the box somewhere from min_t up to max_t and where it enters it
+static bool ray_box(v3 origin, v3 inv_direction, v3 box_min, v3 box_max, f32 min_t, f32 max_t, f32 *t)
+{
+  f32 x0 = (box_min.x - origin.x) * inv_direction.x;
+  f32 x1 = (box_max.x - origin.x) * inv_direction.x;
+  f32 y0 = (box_min.y - origin.y) * inv_direction.y;
+  f32 y1 = (box_max.y - origin.y) * inv_direction.y;
+  f32 z0 = (box_min.z - origin.z) * inv_direction.z;
+  f32 z1 = (box_max.z - origin.z) * inv_direction.z;
+
+  f32 enter = max(min_t, max(min(x0, x1), min(y0, y1), min(z0, z1)));
+  f32 exit = min(max_t, min(max(x0, x1), max(y0, y1), max(z0, z1)));
+  *t = enter;
+  return enter <= exit;
+}
+
+static v3 ray_inv_direction(v3 direction)
+{
+  return v3(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+}
+
+// Moller-Trumbore, the barycentrics are u and v for the second and third vertex
+static bool ray_triangle(v3 origin, v3 direction, const v3 *vertices, bool mirrored, f32 *t, f32 *u, f32 *v)
+{
+  v3 edge1 = vertices[1] - vertices[0];
+  v3 edge2 = vertices[2] - vertices[0];
+  v3 p = cross(direction, edge2);
+
+  // Positive when the triangle is counter clockwise seen from the ray
+  f32 determinant = dot(edge1, p);
+  if(mirrored ? determinant >= 0.0f : determinant <= 0.0f) return false;
+
+  f32 inv_determinant = 1.0f / determinant;
+  v3 s = origin - vertices[0];
+  *u = dot(s, p) * inv_determinant;
+  if(*u < 0.0f || *u > 1.0f) return false;
+
+  v3 q = cross(s, edge1);
+  *v = dot(direction, q) * inv_determinant;
+  if(*v < 0.0f || *u + *v > 1.0f) return false;
+
+  *t = dot(edge2, q) * inv_determinant;
+  return true;
+}
+
+// Splits nodes at the median triangle center along the longest axis of the centers
+// like the scene hierarchy, so every child pair is next to each other
+void build_mesh_bvh(const MeshArrays *mesh, MeshBvh *bvh)
+{
+  u32 num_triangles = mesh->num_indices / 3;
+  bvh->nodes.clear();
+  bvh->triangles.resize(num_triangles);
+  bvh->vertices.resize(num_triangles * 3);
+  if(!num_triangles) return;
+
+  std::vector<v3> positions(mesh->num_vertices);
+  for(u32 i = 0; i < mesh->num_vertices; i++)
+  {
+    positions[i] = mesh_position(mesh, i);
+  }
+
+  // Twice the centers of the triangle bounds
+  std::vector<v3> centers(num_triangles);
+  for(u32 i = 0; i < num_triangles; i++)
+  {
+    v3 p0 = positions[mesh->indices[i * 3 + 0]];
+    v3 p1 = positions[mesh->indices[i * 3 + 1]];
+    v3 p2 = positions[mesh->indices[i * 3 + 2]];
+    v3 triangle_min = v3(min(p0.x, p1.x, p2.x), min(p0.y, p1.y, p2.y), min(p0.z, p1.z, p2.z));
+    v3 triangle_max = v3(max(p0.x, p1.x, p2.x), max(p0.y, p1.y, p2.y), max(p0.z, p1.z, p2.z));
+    centers[i] = triangle_min + triangle_max;
+    bvh->triangles[i] = i;
+  }
+
+  // At most 2n - 1 nodes
+  bvh->nodes.reserve(num_triangles * 2);
+
+  MeshBvhNode root = {};
+  root.num_triangles = num_triangles;
+  bvh->nodes.push_back(root);
+
+  for(u32 node_index = 0; node_index < bvh->nodes.size(); node_index++)
+  {
+    MeshBvhNode node = bvh->nodes[node_index];
+    if(node.num_triangles <= MESH_BVH_LEAF_SIZE) continue;
+
+    u32 *first = &bvh->triangles[node.first];
+    v3 center_min = centers[first[0]];
+    v3 center_max = center_min;
+    for(u32 i = 1; i < node.num_triangles; i++)
+    {
+      v3 center = centers[first[i]];
+      center_min = v3(min(center_min.x, center.x), min(center_min.y, center.y), min(center_min.z, center.z));
+      center_max = v3(max(center_max.x, center.x), max(center_max.y, center.y), max(center_max.z, center.z));
+    }
+    v3 extent = center_max - center_min;
+    u32 axis = 0;
+    if(extent.y > extent.x) axis = 1;
+    if(extent.z > (&extent.x)[axis]) axis = 2;
+
+    u32 half = node.num_triangles / 2;
+    TriangleCenterLess less = {&centers[0], axis};
+    std::nth_element(first, first + half, first + node.num_triangles, less);
+
+    MeshBvhNode left = {};
+    left.first = node.first;
+    left.num_triangles = half;
+    MeshBvhNode right = {};
+    right.first = node.first + half;
+    right.num_triangles = node.num_triangles - half;
+
+    bvh->nodes[node_index].first = bvh->nodes.size();
+    bvh->nodes[node_index].num_triangles = 0;
+    bvh->nodes.push_back(left);
+    bvh->nodes.push_back(right);
+  }
+
+  // The vertices are copied in leaf order, so a leaf reads them in one run
+  for(u32 i = 0; i < num_triangles; i++)
+  {
+    for(u32 j = 0; j < 3; j++)
+    {
+      bvh->vertices[i * 3 + j] = positions[mesh->indices[bvh->triangles[i] * 3 + j]];
+    }
+  }
+
+  // Children come after their parents, so bounds are filled in from the back
+  for(u32 i = bvh->nodes.size(); i > 0; i--)
+  {
+    MeshBvhNode *node = &bvh->nodes[i - 1];
+    v3 node_min;
+    v3 node_max;
+    if(node->num_triangles)
+    {
+      const v3 *vertices = &bvh->vertices[node->first * 3];
+      node_min = vertices[0];
+      node_max = vertices[0];
+      for(u32 j = 1; j < node->num_triangles * 3; j++)
+      {
+        node_min = v3(min(node_min.x, vertices[j].x), min(node_min.y, vertices[j].y), min(node_min.z, vertices[j].z));
+        node_max = v3(max(node_max.x, vertices[j].x), max(node_max.y, vertices[j].y), max(node_max.z, vertices[j].z));
+      }
+    }
+    else
+    {
+      const MeshBvhNode *left = &bvh->nodes[node->first];
+      const MeshBvhNode *right = &bvh->nodes[node->first + 1];
+      node_min = v3(min(left->min.x, right->min.x), min(left->min.y, right->min.y), min(left->min.z, right->min.z));
+      node_max = v3(max(left->max.x, right->max.x), max(left->max.y, right->max.y), max(left->max.z, right->max.z));
+    }
+    node->min = node_min;
+    node->max = node_max;
+  }
+}
+
+// The closer child is visited first, and nodes the ray enters past the closest hit so far are skipped
+bool cast_ray_mesh(const MeshBvh *bvh, v3 origin, v3 direction, f32 min_t, f32 max_t, bool mirrored, MeshRayHit *hit)
+{
+  if(bvh->nodes.empty()) return false;
+
+  v3 inv_direction = ray_inv_direction(direction);
+  bool found = false;
+
+  u32 stack[MAX_BVH_DEPTH];
+  u32 stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while(stack_size)
+  {
+    const MeshBvhNode *node = &bvh->nodes[stack[--stack_size]];
+    f32 enter;
+    if(!ray_box(origin, inv_direction, node->min, node->max, min_t, max_t, &enter)) continue;
+
+    if(node->num_triangles)
+    {
+      for(u32 i = node->first; i < node->first + node->num_triangles; i++)
+      {
+        f32 t;
+        f32 u;
+        f32 v;
+        if(ray_triangle(origin, direction, &bvh->vertices[i * 3], mirrored, &t, &u, &v) && t >= min_t && t < max_t)
+        {
+          max_t = t;
+          hit->triangle = bvh->triangles[i];
+          hit->t = t;
+          hit->barycentrics = v3(1.0f - u - v, u, v);
+          found = true;
+        }
+      }
+      continue;
+    }
+
+    u32 near_child = node->first;
+    u32 far_child = node->first + 1;
+    f32 near_enter;
+    f32 far_enter;
+    bool near_hit = ray_box(origin, inv_direction, bvh->nodes[near_child].min, bvh->nodes[near_child].max, min_t, max_t, &near_enter);
+    bool far_hit = ray_box(origin, inv_direction, bvh->nodes[far_child].min, bvh->nodes[far_child].max, min_t, max_t, &far_enter);
+    if(far_hit && (!near_hit || far_enter < near_enter))
+    {
+      u32 child = near_child;
+      near_child = far_child;
+      far_child = child;
+      bool child_hit = near_hit;
+      near_hit = far_hit;
+      far_hit = child_hit;
+    }
+    if(far_hit) stack[stack_size++] = far_child;
+    if(near_hit) stack[stack_size++] = near_child;
+  }
+
+  return found;
+}
+
+void cast_ray_scene(const Scene *scene, v3 origin, v3 direction, f32 min_t, f32 max_t, std::vector<SceneRayHit> *hits)
+{
+  if(scene->nodes.empty()) return;
+
+  v3 inv_direction = ray_inv_direction(direction);
+  u32 first_hit = hits->size();
+
+  u32 stack[MAX_BVH_DEPTH];
+  u32 stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while(stack_size)
+  {
+    const BvhNode *node = &scene->nodes[stack[--stack_size]];
+    f32 enter;
+    if(!ray_box(origin, inv_direction, node->min, node->max, min_t, max_t, &enter)) continue;
+
+    if(node->first_child)
+    {
+      stack[stack_size++] = node->first_child + 1;
+      stack[stack_size++] = node->first_child;
+      continue;
+    }
+
+    for(u32 i = 0; i < node->num_instances; i++)
+    {
+      u32 instance_index = scene->node_instances[node->first_instance + i];
+      const SceneInstance *instance = &scene->instances[instance_index];
+      SceneRayHit hit;
+      if(ray_box(origin, inv_direction, instance->world_min, instance->world_max, min_t, max_t, &hit.t))
+      {
+        hit.instance = instance_index;
+        hits->push_back(hit);
+      }
+    }
+  }
+
+  std::sort(hits->begin() + first_hit, hits->end(), SceneRayHitLess());
+}
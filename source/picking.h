@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include "my_math.h"
+#include "mesh_cache.h" // MeshArrays
+#include "scene.h"
+
+#include <vector>
+
+// Rays cast against scene instances and the triangles of their meshes
+//
+// Each mesh gets a bounding volume hierarchy of its triangles in model space,
+// built once. Rays are moved into the model space of an instance instead of
+// moving the triangles, so instances that move only refit the scene hierarchy.
+// Nothing here reads what the renderer draws.
+
+struct MeshBvhNode
+{
+  v3 min;
+  v3 max;
+
+  // Leaves have num_triangles triangles from first in the triangle order of
+  // the hierarchy. Inner nodes have no triangles and their two children at
+  // first and first + 1.
+  u32 first;
+  u32 num_triangles;
+};
+
+struct MeshBvh
+{
+  std::vector<MeshBvhNode> nodes;
+
+  // The index of each triangle in the mesh and its three vertices, in the order of the leaves
+  std::vector<u32> triangles;
+  std::vector<v3> vertices;
+};
+
+struct MeshRayHit
+{
+  u32 triangle; // In the indices of the full mesh, from 3 * triangle
+  f32 t;        // Along the ray, in units of its direction
+
+  // The weights of the three vertices of the triangle at the hit
+  v3 barycentrics;
+};
+
+// An instance whose bounds a ray enters at t along it
+struct SceneRayHit
+{
+  u32 instance;
+  f32 t;
+};
+
+// Builds the hierarchy over the triangles of the full mesh
+void build_mesh_bvh(const MeshArrays *mesh, MeshBvh *bvh);
+
+// Finds the closest front facing triangle a ray hits from min_t up to max_t
+// Front faces are counter clockwise seen from the ray, or clockwise if the
+// model is mirrored by its transform. Returns false if there is none.
+bool cast_ray_mesh(const MeshBvh *bvh, v3 origin, v3 direction, f32 min_t, f32 max_t, bool mirrored, MeshRayHit *hit);
+
+// Appends the instances whose world bounds the ray passes through between
+// min_t and max_t, sorted by where it enters them. The hierarchy must be up to date.
+void cast_ray_scene(const Scene *scene, v3 origin, v3 direction, f32 min_t, f32 max_t, std::vector<SceneRayHit> *hits);
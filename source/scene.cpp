@@ -0,0 +1,337 @@
+#include "scene.h"
+
+#include <algorithm> // std::nth_element
+
+// Most instances in a leaf
+#define BVH_LEAF_SIZE 4
+
+// The tree is rebuilt once refitting has grown the node areas this much
+#define BVH_REBUILD_AREA_RATIO 2.0f
+
+// Parent of the root
+#define NO_NODE 0xFFFFFFFF
+
+mat4 instance_world_mat(const SceneInstance *instance)
+{
+  return translation_mat(instance->position) * z_axis_rotation_mat(instance->rotation) * scale_mat(instance->scale);
+}
+
+static f32 surface_area(v3 min, v3 max)
+{
+  v3 size = max - min;
+  return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+void transform_bounds(const mat4 &transform, v3 local_min, v3 local_max, v3 *min_out, v3 *max_out)
+{
+  v3 corners[8];
+  for(u32 i = 0; i < 8; i++)
+  {
+    corners[i] = v3((i & 1) ? local_max.x : local_min.x,
+                    (i & 2) ? local_max.y : local_min.y,
+                    (i & 4) ? local_max.z : local_min.z);
+  }
+  v4 transformed[8];
+  transform_points(transform, corners, transformed, 8);
+
+  v3 box_min;
+  v3 box_max;
+  for(u32 i = 0; i < 8; i++)
+  {
+    v3 p = v3(transformed[i].x, transformed[i].y, transformed[i].z);
+
+    if(i == 0)
+    {
+      box_min = p;
+      box_max = p;
+    }
+    box_min = v3(min(box_min.x, p.x), min(box_min.y, p.y), min(box_min.z, p.z));
+    box_max = v3(max(box_max.x, p.x), max(box_max.y, p.y), max(box_max.z, p.z));
+  }
+  *min_out = box_min;
+  *max_out = box_max;
+}
+
+static void compute_world_bounds(SceneInstance *instance)
+{
+  transform_bounds(instance_world_mat(instance), instance->local_min, instance->local_max, &instance->world_min, &instance->world_max);
+}
+
+u32 add_scene_instance(Scene *scene, u32 model, v3 local_min, v3 local_max, v3 position, v3 scale, f32 rotation)
+{
+  SceneInstance instance;
+  instance.position = position;
+  instance.scale = scale;
+  instance.rotation = rotation;
+  instance.model = model;
+  instance.local_min = local_min;
+  instance.local_max = local_max;
+  instance.leaf = 0;
+  instance.moved = false;
+  compute_world_bounds(&instance);
+
+  scene->instances.push_back(instance);
+  scene->needs_build = true;
+  return scene->instances.size() - 1;
+}
+
+void set_scene_instance_transform(Scene *scene, u32 instance_index, v3 position, v3 scale, f32 rotation)
+{
+  SceneInstance *instance = &scene->instances[instance_index];
+  instance->position = position;
+  instance->scale = scale;
+  instance->rotation = rotation;
+  compute_world_bounds(instance);
+
+  if(!instance->moved)
+  {
+    instance->moved = true;
+    scene->moved_instances.push_back(instance_index);
+  }
+}
+
+// Sets the bounds of a node from its instances or children and returns whether they changed
+static bool compute_node_bounds(Scene *scene, u32 node_index)
+{
+  BvhNode *node = &scene->nodes[node_index];
+  v3 node_min;
+  v3 node_max;
+  if(node->first_child)
+  {
+    const BvhNode *left = &scene->nodes[node->first_child];
+    const BvhNode *right = &scene->nodes[node->first_child + 1];
+    node_min = v3(min(left->min.x, right->min.x), min(left->min.y, right->min.y), min(left->min.z, right->min.z));
+    node_max = v3(max(left->max.x, right->max.x), max(left->max.y, right->max.y), max(left->max.z, right->max.z));
+  }
+  else
+  {
+    for(u32 i = 0; i < node->num_instances; i++)
+    {
+      const SceneInstance *instance = &scene->instances[scene->node_instances[node->first_instance + i]];
+      if(i == 0)
+      {
+        node_min = instance->world_min;
+        node_max = instance->world_max;
+      }
+      node_min = v3(min(node_min.x, instance->world_min.x), min(node_min.y, instance->world_min.y), min(node_min.z, instance->world_min.z));
+      node_max = v3(max(node_max.x, instance->world_max.x), max(node_max.y, instance->world_max.y), max(node_max.z, instance->world_max.z));
+    }
+  }
+
+  bool changed = node_min.x != node->min.x || node_min.y != node->min.y || node_min.z != node->min.z ||
+                 node_max.x != node->max.x || node_max.y != node->max.y || node_max.z != node->max.z;
+  scene->current_area += surface_area(node_min, node_max) - surface_area(node->min, node->max);
+  node->min = node_min;
+  node->max = node_max;
+  return changed;
+}
+
+// Center of an instance along an axis for splitting
+struct CenterLess
+{
+  const SceneInstance *instances;
+  u32 axis;
+
+  bool operator()(u32 a, u32 b) const
+  {
+    const SceneInstance *ia = &instances[a];
+    const SceneInstance *ib = &instances[b];
+    f32 ca = (&ia->world_min.x)[axis] + (&ia->world_max.x)[axis];
+    f32 cb = (&ib->world_min.x)[axis] + (&ib->world_max.x)[axis];
+    return ca < cb;
+  }
+};
+
+// Splits nodes at the median instance center along the longest axis of the centers
+// The nodes are split in order of creation so every child pair is next to each other
+void build_scene_bvh(Scene *scene)
+{
+  u32 num_instances = scene->instances.size();
+  scene->nodes.clear();
+  scene->node_instances.resize(num_instances);
+  for(u32 i = 0; i < num_instances; i++) scene->node_instances[i] = i;
+
+  for(u32 i = 0; i < num_instances; i++) scene->instances[i].moved = false;
+  scene->moved_instances.clear();
+  scene->needs_build = false;
+  scene->built_area = 0.0f;
+  scene->current_area = 0.0f;
+  if(!num_instances) return;
+
+  // At most 2n - 1 nodes
+  scene->nodes.reserve(num_instances * 2);
+
+  BvhNode root = {};
+  root.num_instances = num_instances;
+  root.parent = NO_NODE;
+  scene->nodes.push_back(root);
+
+  for(u32 node_index = 0; node_index < scene->nodes.size(); node_index++)
+  {
+    BvhNode node = scene->nodes[node_index];
+    if(node.num_instances <= BVH_LEAF_SIZE)
+    {
+      for(u32 i = 0; i < node.num_instances; i++)
+      {
+        scene->instances[scene->node_instances[node.first_instance + i]].leaf = node_index;
+      }
+      continue;
+    }
+
+    u32 *first = &scene->node_instances[node.first_instance];
+    v3 center_min = scene->instances[first[0]].world_min + scene->instances[first[0]].world_max;
+    v3 center_max = center_min;
+    for(u32 i = 1; i < node.num_instances; i++)
+    {
+      const SceneInstance *instance = &scene->instances[first[i]];
+      v3 center = instance->world_min + instance->world_max;
+      center_min = v3(min(center_min.x, center.x), min(center_min.y, center.y), min(center_min.z, center.z));
+      center_max = v3(max(center_max.x, center.x), max(center_max.y, center.y), max(center_max.z, center.z));
+    }
+    v3 extent = center_max - center_min;
+    u32 axis = 0;
+    if(extent.y > extent.x) axis = 1;
+    if(extent.z > (&extent.x)[axis]) axis = 2;
+
+    u32 half = node.num_instances / 2;
+    CenterLess less = {&scene->instances[0], axis};
+    std::nth_element(first, first + half, first + node.num_instances, less);
+
+    BvhNode left = {};
+    left.first_instance = node.first_instance;
+    left.num_instances = half;
+    left.parent = node_index;
+    BvhNode right = {};
+    right.first_instance = node.first_instance + half;
+    right.num_instances = node.num_instances - half;
+    right.parent = node_index;
+
+    scene->nodes[node_index].first_child = scene->nodes.size();
+    scene->nodes.push_back(left);
+    scene->nodes.push_back(right);
+  }
+
+  // Children come after their parents, so bounds are filled in from the back
+  for(u32 i = scene->nodes.size(); i > 0; i--)
+  {
+    BvhNode *node = &scene->nodes[i - 1];
+    node->min = v3();
+    node->max = v3();
+    compute_node_bounds(scene, i - 1);
+  }
+  scene->built_area = scene->current_area;
+}
+
+void update_scene_bvh(Scene *scene)
+{
+  if(scene->needs_build)
+  {
+    build_scene_bvh(scene);
+    return;
+  }
+
+  for(u32 i = 0; i < scene->moved_instances.size(); i++)
+  {
+    SceneInstance *instance = &scene->instances[scene->moved_instances[i]];
+    instance->moved = false;
+
+    // Nodes above one that did not change already hold the new bounds
+    u32 node = instance->leaf;
+    while(node != NO_NODE && compute_node_bounds(scene, node))
+    {
+      node = scene->nodes[node].parent;
+    }
+  }
+  scene->moved_instances.clear();
+
+  if(scene->current_area > scene->built_area * BVH_REBUILD_AREA_RATIO)
+  {
+    build_scene_bvh(scene);
+  }
+}
+
+Frustum frustum_from_mat(const mat4 &m)
+{
+  v4 row0 = v4(m[0][0], m[0][1], m[0][2], m[0][3]);
+  v4 row1 = v4(m[1][0], m[1][1], m[1][2], m[1][3]);
+  v4 row2 = v4(m[2][0], m[2][1], m[2][2], m[2][3]);
+  v4 row3 = v4(m[3][0], m[3][1], m[3][2], m[3][3]);
+
+  Frustum frustum;
+  frustum.planes[0] = row3 + row0; // Left
+  frustum.planes[1] = row3 - row0; // Right
+  frustum.planes[2] = row3 + row1; // Bottom
+  frustum.planes[3] = row3 - row1; // Top
+  frustum.planes[4] = row3 + row2; // Near
+  frustum.planes[5] = row3 - row2; // Far
+  return frustum;
+}
+
+bool box_in_frustum(const Frustum *frustum, v3 min, v3 max, u32 *plane_mask)
+{
+  v3 center = (min + max) * 0.5f;
+  v3 extent = (max - min) * 0.5f;
+
+  for(u32 i = 0; i < 6; i++)
+  {
+    if(!(*plane_mask & (1 << i))) continue;
+
+    v4 plane = frustum->planes[i];
+    f32 distance = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w;
+    f32 radius = fabsf(plane.x) * extent.x + fabsf(plane.y) * extent.y + fabsf(plane.z) * extent.z;
+    if(distance + radius < 0.0f) return false;
+    if(distance - radius >= 0.0f) *plane_mask &= ~(1 << i);
+  }
+  return true;
+}
+
+// Nodes completely inside the frustum add all of their instances at once
+// and children only test the planes their parent crosses
+void cull_scene(const Scene *scene, const mat4 &view_projection, std::vector<u32> *visible_instances)
+{
+  if(scene->nodes.empty()) return;
+
+  Frustum frustum = frustum_from_mat(view_projection);
+
+  struct StackEntry
+  {
+    u32 node;
+    u32 plane_mask;
+  };
+  StackEntry stack[64];
+  u32 stack_size = 0;
+  stack[stack_size++] = {0, ALL_FRUSTUM_PLANES};
+
+  while(stack_size)
+  {
+    StackEntry entry = stack[--stack_size];
+    const BvhNode *node = &scene->nodes[entry.node];
+
+    u32 plane_mask = entry.plane_mask;
+    if(!box_in_frustum(&frustum, node->min, node->max, &plane_mask)) continue;
+
+    if(!plane_mask)
+    {
+      const u32 *instances = &scene->node_instances[node->first_instance];
+      visible_instances->insert(visible_instances->end(), instances, instances + node->num_instances);
+    }
+    else if(node->first_child)
+    {
+      stack[stack_size++] = {node->first_child + 1, plane_mask};
+      stack[stack_size++] = {node->first_child, plane_mask};
+    }
+    else
+    {
+      for(u32 i = 0; i < node->num_instances; i++)
+      {
+        u32 instance_index = scene->node_instances[node->first_instance + i];
+        const SceneInstance *instance = &scene->instances[instance_index];
+        u32 instance_mask = plane_mask;
+        if(box_in_frustum(&frustum, instance->world_min, instance->world_max, &instance_mask))
+        {
+          visible_instances->push_back(instance_index);
+        }
+      }
+    }
+  }
+}
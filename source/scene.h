@@ -0,0 +1,103 @@
+#pragma once
+
+#include "types.h"
+#include "my_math.h"
+
+#include <vector>
+
+// Model instances in a bounding volume hierarchy for frustum culling
+//
+// The hierarchy is built top down once and then only refit when instances
+// move: the bounds of a moved instance's leaf and of the nodes above it are
+// recomputed, stopping at the first node that did not change. Refitting keeps
+// the tree shape, so it is rebuilt when the nodes have grown too much since the
+// last build or when instances were added.
+
+struct SceneInstance
+{
+  // World transform is translation * rotation around z * scale, the same as a model
+  v3 position;
+  v3 scale;
+  f32 rotation;
+
+  // Index of the model to draw, the scene does not look at it
+  u32 model;
+
+  // Bounds of the model and of the instance in world space
+  v3 local_min;
+  v3 local_max;
+  v3 world_min;
+  v3 world_max;
+
+  // Leaf node holding the instance
+  u32 leaf;
+  bool moved;
+};
+
+// The instances of every node are a contiguous range of node_instances, so a
+// node that is completely inside the frustum is accepted without visiting its children
+struct BvhNode
+{
+  v3 min;
+  v3 max;
+
+  u32 first_instance;
+  u32 num_instances;
+
+  // Inner nodes have their two children at first_child and first_child + 1
+  // Leaves have no children and first_child is 0, the root can never be a child
+  u32 first_child;
+  u32 parent;
+};
+
+struct Scene
+{
+  std::vector<SceneInstance> instances;
+
+  std::vector<BvhNode> nodes;
+  std::vector<u32> node_instances;
+
+  // Instances moved since the last refit
+  std::vector<u32> moved_instances;
+
+  // Sum of the surface areas of the nodes when the tree was built and now
+  f32 built_area;
+  f32 current_area;
+
+  bool needs_build;
+};
+
+// Inward facing planes with the normal in xyz and the distance in w
+// The planes are the ones the clipping uses, -w <= x, y, z <= w
+struct Frustum
+{
+  v4 planes[6];
+};
+
+// Every plane of a frustum in a plane mask
+#define ALL_FRUSTUM_PLANES 0x3F
+
+Frustum frustum_from_mat(const mat4 &view_projection);
+
+// Tests a box against the planes in the mask
+// Returns false if it is outside one of them and clears the planes it is completely inside of
+bool box_in_frustum(const Frustum *frustum, v3 min, v3 max, u32 *plane_mask);
+
+// Bounds of the eight corners of a box after a transform
+void transform_bounds(const mat4 &transform, v3 local_min, v3 local_max, v3 *min, v3 *max);
+
+mat4 instance_world_mat(const SceneInstance *instance);
+
+// Adds an instance with the bounds of its model and returns its index
+u32 add_scene_instance(Scene *scene, u32 model, v3 local_min, v3 local_max, v3 position, v3 scale, f32 rotation);
+
+void set_scene_instance_transform(Scene *scene, u32 instance, v3 position, v3 scale, f32 rotation);
+
+void build_scene_bvh(Scene *scene);
+
+// Brings the hierarchy up to date with the moved instances, rebuilding it if needed
+void update_scene_bvh(Scene *scene);
+
+// Appends the instances whose bounds are at least partly inside the frustum
+// of the view projection matrix. The hierarchy must be up to date.
+void cull_scene(const Scene *scene, const mat4 &view_projection, std::vector<u32> *visible_instances);
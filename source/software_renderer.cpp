@@ -1,13 +1,28 @@
 #include "software_renderer.h"
 #include "my_math.h"
 #include "asset_loading.h"
+#include "texture.h"
+#include "job_system.h"
+#include "memory.h"
+#include "mesh_cache.h"
+#include "scene.h"
+#include "picking.h"
 #include "input.h"
 //#include "profiling.h"
 
 #include "logging.h"
 
 #include <assert.h> // assert
+#include <string.h> // memset
+#include <float.h> // FLT_EPSILON
+#include <emmintrin.h> // SSE2
 #include <vector>
+#include <string>
+#include <algorithm> // std::stable_sort
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 struct Color
 {
@@ -42,24 +57,21 @@ struct Color
   }
 };
 
+// Mesh and material that instances in the scene draw with their own transforms
 struct Model
 {
-  v3 position;
-  v3 scale;
-  f32 rotation;
+  // The arrays that are drawn, from a mapped mesh cache
+  MeshArrays mesh;
+  MeshCache *mesh_cache;
 
+  // The alpha is the opacity of the whole model
+  Color color;
 
-  std::vector<v3> vertices;
-  std::vector<u32> vertex_indices;
-  std::vector<v3> normals;
-};
+  // Optional, the model is drawn with its color without one
+  Texture *texture;
 
-struct PixelInfo
-{
-  u32 x;
-  u32 y;
-  Color final_color;
-  v3 triangle_vertices[3];
+  // Triangles for picking, built the first time the model is picked
+  MeshBvh *bvh;
 };
 
 // This struct is for the vertex buffer. It will contain the vertex along with any attributes of that vertex (normal, material, UV, etc)
@@ -67,20 +79,310 @@ struct Vertex
 {
   v4 vertex;
   v3 normal;
+  v3 view_position;
+  v2 texture_coord;
+};
+
+// Number of pixels along each side of a screen tile used for light culling
+#define TILE_SIZE 16
+
+enum LightType
+{
+  LIGHT_TYPE_DIRECTIONAL,
+  LIGHT_TYPE_POINT,
+  LIGHT_TYPE_SPOT
+};
+
+struct Light
+{
+  LightType type;
+
+  // World space. The direction is the way the light is pointing.
+  v3 position;
+  v3 direction;
+
+  v3 color;
+
+  // Distance where the light has faded out completely
+  f32 radius;
+
+  // Cosines of the spot light cone angles. The light fades out between the inner and outer cone.
+  f32 cos_inner_angle;
+  f32 cos_outer_angle;
+
+  // Lights are hashed as memory, so these are u32s that leave no padding
+  u32 casts_shadows;
+  u32 shadow_map; // Index in the shadow maps of the frame the back end is rendering
 };
 
+// Directional and spot lights can have a shadow map, this many in a frame
+#define MAX_SHADOW_MAPS 4
+#define NO_SHADOW_MAP 0xFFFFFFFF
+
+// Pixels along each side of a shadow map, a multiple of the frame tile size
+#define SHADOW_MAP_SIZE 1024
+
+// Points are moved this many shadow map pixels along their normal before the
+// lookup, and compared with a slightly smaller depth, so surfaces facing the
+// light do not shadow themselves
+#define SHADOW_NORMAL_OFFSET 3.0f
+#define SHADOW_DEPTH_BIAS 0.0002f
+
+// The depth of the opaque draws seen from a light, rendered by the back end
+// before the frame. The matrices go from camera view space to the clip space
+// of the light and to shadow map pixels, with the depth in z.
+struct ShadowMap
+{
+  u32 light;
+  mat4 view_to_clip;
+  mat4 view_to_map;
+
+  // World size of a shadow map pixel, which grows with the distance from a spot light
+  v3 view_position;
+  f32 texel_size;
+  f32 texel_size_per_distance;
+
+  // Triangles in shadow map pixels in the shadow buffers of the frame packet
+  u32 first_index;
+  u32 num_indices;
+};
+
+// An opaque instance drawn in a frame, it is drawn again into the shadow maps
+struct ShadowCaster
+{
+  const Model *model;
+  mat4 world;
+  v3 world_min;
+  v3 world_max;
+
+  // The indices of the LOD drawn for the camera
+  u32 first_index;
+  u32 num_indices;
+};
+
+// Number of translucent fragments kept for each pixel in order independent
+// transparency. Fragments past this are merged into the farthest one.
+#define OIT_MAX_FRAGMENTS 8
+
+// Number of pixels along each side of a color and depth buffer tile
+//
+// The color and depth buffers are stored in 8x8 tiles with the pixels of each
+// tile in Morton (Z) order, the same as uncompressed textures. A 2x2 quad is
+// 16 contiguous bytes and a 4x4 block is one cache line, so a tall triangle
+// stays in the same lines and pages from row to row. The buffers are converted
+// to the linear frame buffer in swap_buffers.
+#define FRAME_TILE_SIZE 8
+
 enum RenderMode
 {
   RENDER_MODE_TRIANGLES,
   RENDER_MODE_LINES
 };
 
+// Which pixels of a triangle are shaded, compared with the depth buffer
+enum DepthTest
+{
+  DEPTH_TEST_LESS,    // Closer than the depth buffer, which is then updated
+  DEPTH_TEST_PREPASS  // At most the depth the prepass found, so only the visible pixels are shaded
+};
+
+// How far the depth of the shading pass can be behind the depth the prepass
+// found for the same pixel, in units of the rounding error of the largest term
+// of the depth plane. Both compute it with the same operations, but a compiler
+// that fuses them into FMA instructions (-march=haswell, /fp:contract) rounds
+// the scalar and SSE versions differently, which would drop pixels if they had
+// to be equal. Surfaces closer together than that are z fighting anyway, the
+// last one drawn is shaded.
+#define PREPASS_DEPTH_ULPS 4.0f
+
+// Frames being worked on at once. The front end fills one packet while the
+// back end rasterizes another.
+#define NUM_FRAME_PACKETS 2
+
+// Dynamic resolution: frames up to this much faster than the target keep their
+// resolution, and the scale moves this part of the way to the estimated one
+#define DYNAMIC_RESOLUTION_SLACK 1.15f
+#define DYNAMIC_RESOLUTION_GAIN 0.5f
+
+// Occlusion culling
+//
+// The biggest opaque draws on screen are rasterized into a coarse occlusion
+// buffer before the front end, and the bounding boxes of instances and
+// meshlets are tested against it. Anything found behind it is not transformed
+// or clipped. Occluders cover the buffer with their farthest depth, and boxes
+// are tested with their closest depth.
+//
+// Like masked occlusion culling, a tile of the buffer has a bit for each pixel
+// instead of a depth. The bits are the pixels covered by the triangles merged
+// into the tile so far, with the farthest depth of those triangles. Once they
+// cover the whole tile that depth is the depth of the tile.
+#define OCCLUSION_PIXEL_SIZE 4 // Pixels along each side of an occlusion pixel
+#define OCCLUSION_TILE_WIDTH 32 // Occlusion pixels, the bits of a u32
+#define OCCLUSION_TILE_HEIGHT 4
+#define MAX_OCCLUDERS 8
+
+// Draws that cover less of the occlusion buffer than this are not occluders
+#define OCCLUDER_MIN_AREA (1.0f / 64.0f)
+
+// Boxes are moved this much closer in depth, so rounding can not hide a box
+// behind the triangles inside it
+#define OCCLUSION_DEPTH_BIAS 0.00001f
+
+struct OcclusionTile
+{
+  // Depth that no pixel of the tile is behind
+  f32 depth;
+
+  // The pixels covered since the depth was last set and the farthest depth of
+  // the triangles covering them. A row is a u32 with bit x for the pixel x from the left.
+  // Pixels past the right or top of the buffer count as covered.
+  u32 mask[OCCLUSION_TILE_HEIGHT];
+  f32 mask_depth;
+};
+
+// Pixels from left to right and bottom to top, inclusive. Empty if left > right.
+struct ScreenRect
+{
+  s32 left;
+  s32 bottom;
+  s32 right;
+  s32 top;
+};
+
+// A draw of the last frame, it is drawn the same way in the next frame if the key is the same
+struct DrawRecord
+{
+  u64 key;
+  ScreenRect rect;
+};
+
+// Everything the back end needs to rasterize a frame, so it does not read
+// anything the front end or the application can change meanwhile
+struct FramePacket
+{
+  mat4 view;
+  mat4 projection;
+  RenderMode mode;
+
+  // The opaque triangles are rasterized to the depth buffer before shading
+  bool depth_prepass;
+
+  // Some light casts shadows, so the opaque instances are kept as shadow casters
+  bool shadows;
+  std::vector<ShadowCaster> shadow_casters;
+  std::vector<ShadowMap> shadow_maps;
+  std::vector<Vertex> shadow_vertex_buffer;
+  std::vector<u32> shadow_index_buffer;
+
+  // The lights when the frame was submitted
+  std::vector<Light> lights;
+
+  // Viewport space after the front end
+  std::vector<Vertex> clipped_vertex_buffer;
+  std::vector<u32> clipped_index_buffer;
+
+  // The triangles of each visible instance in the clipped index buffer
+  std::vector<struct DrawCall> draw_calls;
+
+  u32 *color_buffer;
+
+  // Only the pixels in the scissor are cleared and drawn, it is aligned to light tiles
+  ScreenRect scissor;
+  bool clear;
+
+  // Pixels the frame is rendered at, the bottom left of the buffers
+  u32 width;
+  u32 height;
+
+  // Time spent on the frame by the front end and by the back end
+  f32 front_end_ms;
+  f32 back_end_ms;
+};
+
+#define MAX_SWAP_CHAIN_IMAGES 3
+
+// Linear images that swap_buffers writes frames to and the present thread shows
+// An image is free, queued or being presented, and queued images are presented in order
+struct SwapChain
+{
+  u32 num_images; // 0 without a swap chain
+  u32 *images[MAX_SWAP_CHAIN_IMAGES];
+  bool owns_images;
+  bool top_down;
+  bool image_free[MAX_SWAP_CHAIN_IMAGES];
+
+  // When each queued image was queued, for the present latency
+  std::chrono::steady_clock::time_point queue_times[MAX_SWAP_CHAIN_IMAGES];
+
+  // Ring of queued images starting at queue_start
+  u32 queue[MAX_SWAP_CHAIN_IMAGES];
+  u32 queue_start;
+  u32 queue_size;
+
+  PresentMode mode;
+  PresentFunction present;
+  void *present_data;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable image_queued;
+  std::condition_variable image_released;
+  bool presenting;
+  bool quitting;
+
+  SwapChainStats stats;
+};
+
 struct RendererData
 {
-  u32 *frame_buffer;
+  u32 *frame_buffer; // Linear, written by swap_buffers
   u32 screen_width;
   u32 screen_height;
   u32 num_pixels;
+
+  // Tiled color buffers, one for each frame packet
+  u32 *color_buffers[NUM_FRAME_PACKETS];
+
+  // The buffer the back end is rendering to and the last finished one
+  u32 *color_buffer;
+  u32 *presented_color_buffer;
+
+  // Counts the frames put in presented_color_buffer and the ones swap_buffers has shown
+  u32 presented_version;
+  u32 swapped_version;
+
+  // The size the presented frame was rendered at, it is upscaled to the screen if smaller
+  u32 presented_width;
+  u32 presented_height;
+
+  // The scissor and size of the frame the back end is rendering
+  ScreenRect scissor;
+  u32 viewport_width;
+  u32 viewport_height;
+
+  // Frames are rendered at this part of the screen size in each direction
+  f32 resolution_scale;
+
+  // The resolution scale is moved between the minimum and 1 to keep frames at
+  // the target time, when the target is not 0
+  f32 target_frame_ms;
+  f32 min_resolution_scale;
+
+  // For each screen column when upscaling from upscale_width pixels: the offsets
+  // of the two closest rendered columns and the weight of the second one out of 256
+  u32 upscale_width;
+  u32 *upscale_columns;
+  u32 *upscale_next_columns;
+  u16 *upscale_column_weights;
+
+  // The tiled buffers are padded to whole tiles
+  u32 frame_tiles_x;
+  u32 frame_tiles_y;
+  u32 buffer_pixels;
+
+  // The offset of a pixel in the tiled buffers is column_offsets[x] + row_offsets[y]
+  u32 *column_offsets;
+  u32 *row_offsets;
   f32 aspect_ratio;
 
   RenderMode mode;
@@ -92,18 +394,123 @@ struct RendererData
   f32 far_plane;
 
   f32 *depth_buffer;
-  PixelInfo *pixel_info_buffer;
+
+  // Tiled like the depth buffer, allocated when a frame first has that many shadow maps
+  f32 *shadow_depths[MAX_SHADOW_MAPS];
+  u32 *shadow_column_offsets;
+  u32 *shadow_row_offsets;
+
+  // The shadow maps of the frame the back end is rendering
+  const ShadowMap *shadow_maps;
 
   u32 clear_color;
 
-  Model *model;
+  // Settings that each submit starts with, command buffers can change them for their draws
+  BlendMode blend_mode;
+  TransparencyMode transparency_mode;
+
+  // The most a LOD can be off by on screen, in pixels
+  f32 lod_error_pixels;
+
+  bool depth_prepass;
 
+  // The occlusion buffer of the frame in the front end, tiles in rows from the bottom left
+  bool occlusion_culling;
+  u32 occlusion_width;
+  u32 occlusion_height;
+  u32 occlusion_tiles_x;
+  u32 occlusion_tiles_y;
+  OcclusionTile *occlusion_tiles;
 
+  // Occlusion pixels for each unit of normalized device coordinates
+  f32 occlusion_scale_x;
+  f32 occlusion_scale_y;
+
+  // The occluders of the frame and their triangles in viewport space
+  std::vector<struct Occluder> occluders;
+  std::vector<Vertex> occluder_vertices;
+  std::vector<u32> occluder_indices;
+
+  std::vector<Model *> models;
+
+  // The instances of the models that are drawn
+  Scene scene;
+
+  // The instance moved with the keyboard
+  u32 controlled_instance;
+
+  std::vector<Light> lights;
+
+  // The lights transformed to view space for the current frame
+  std::vector<Light> view_lights;
+
+  // Lights that reach every pixel and are not culled per tile
+  std::vector<u32> global_lights;
+
+  // Screen tiles for light culling
+  u32 tiles_x;
+  u32 tiles_y;
+  u32 num_tiles;
+  f32 *tile_min_depth;
+  f32 *tile_max_depth;
+
+  // The lights affecting tile i are tile_light_indices[tile_light_offsets[i]] up to tile_light_offsets[i + 1]
+  std::vector<u32> tile_light_offsets;
+  std::vector<u32> tile_light_indices;
+
+  // Translucent triangles waiting for order independent transparency and the ones touching each tile
+  std::vector<struct TranslucentTriangle> translucent_triangles;
+  std::vector<std::vector<u32> > tile_translucent_triangles;
+
+
+  // The vertices of the model being drawn, decoded once for all of its instances,
+  // and the vertices of one instance after the vertex shader
+  std::vector<Vertex> model_vertices;
   std::vector<Vertex> vertex_buffer;
-  std::vector<u32> index_buffer;
 
-  std::vector<Vertex> clipped_vertex_buffer;
-  std::vector<u32> clipped_index_buffer;
+  // Recorded by draw_instanced and render for the frame drawn by render
+  struct CommandBuffer *immediate_commands;
+
+  FramePacket frame_packets[NUM_FRAME_PACKETS];
+  u32 frame_index;
+
+  // The packet being filled by the front end
+  FramePacket *front_packet;
+
+  // Frames the back end can be behind the front end, 0 or 1
+  u32 frame_latency;
+
+  // Thread running the back end when the latency is not 0
+  // back_end_packet is the packet it is rasterizing, or 0 when it is idle
+  std::thread back_end_thread;
+  std::mutex back_end_mutex;
+  std::condition_variable back_end_wake;
+  std::condition_variable back_end_idle;
+  FramePacket *back_end_packet;
+  bool back_end_quitting;
+
+  SwapChain swap_chain;
+
+  // Incremental rendering redraws only the part of the screen that changed
+  // and skips frames where nothing changed. Each color buffer holds the frame
+  // before last, so a frame redraws what changed in it and in the last frame.
+  bool incremental_rendering;
+  bool clear_requested; // By clear_frame_buffer since the last submit
+
+  // Of the commands and settings of the last rendered frame, and of the
+  // settings in it that change every pixel like the camera and the lights
+  u64 last_frame_hash;
+  u64 last_view_hash;
+
+  // Sorted by key, for the frame being submitted and the last one
+  std::vector<DrawRecord> draw_records;
+  std::vector<DrawRecord> last_draw_records;
+
+  // What the last frame changed from the frame before it
+  ScreenRect last_dirty_rect;
+
+  // The last submit did not render anything
+  bool frame_skipped;
 };
 
 struct EdgeEquation
@@ -112,6 +519,151 @@ struct EdgeEquation
   bool tl;
 };
 
+// Values interpolated across a triangle for the pixel shading
+enum Varying
+{
+  VARYING_NORMAL_X,
+  VARYING_NORMAL_Y,
+  VARYING_NORMAL_Z,
+  VARYING_VIEW_POSITION_X,
+  VARYING_VIEW_POSITION_Y,
+  VARYING_VIEW_POSITION_Z,
+  VARYING_TEXTURE_U,
+  VARYING_TEXTURE_V,
+
+  NUM_VARYINGS
+};
+
+// Screen space plane equation of an attribute: value(x, y) = dx * x + dy * y + base
+struct AttributePlane
+{
+  f32 dx, dy, base;
+};
+
+// Everything the pixel loop needs from a triangle. This is computed once per
+// triangle so each pixel only evaluates planes.
+struct TriangleSetup
+{
+  v3 p0, p1, p2;
+
+  EdgeEquation e0, e1, e2;
+
+  u32 left_bb;
+  u32 bottom_bb;
+  u32 right_bb;
+  u32 top_bb;
+
+  AttributePlane depth;
+
+  // 1/w and the varyings divided by w for perspective correct interpolation
+  AttributePlane inv_w;
+  AttributePlane varyings[NUM_VARYINGS];
+};
+
+enum CommandType
+{
+  COMMAND_SET_BLEND_MODE,
+  COMMAND_SET_TRANSPARENCY_MODE,
+  COMMAND_SET_LOD_ERROR,
+  COMMAND_DRAW_INSTANCED
+};
+
+// Instances of a model with their transforms and colors at first_instance in
+// the instance arrays of the command buffer. Instances from the scene are
+// already culled by the scene hierarchy when they are recorded.
+struct InstancedDraw
+{
+  u32 model;
+  u32 first_instance;
+  u32 num_instances;
+  bool culled;
+};
+
+struct Command
+{
+  CommandType type;
+  union
+  {
+    BlendMode blend_mode;
+    TransparencyMode transparency_mode;
+    f32 lod_error_pixels;
+    InstancedDraw draw;
+  };
+};
+
+// Commands are only added to the end of their own buffer, so each thread can
+// record into its own buffer while other threads record into theirs
+struct CommandBuffer
+{
+  std::vector<Command> commands;
+
+  std::vector<mat4> instance_worlds;
+  std::vector<mat4> instance_normal_worlds;
+  std::vector<Color> instance_colors;
+};
+
+// Settings that commands change for the draws after them
+struct DrawState
+{
+  BlendMode blend_mode;
+  TransparencyMode transparency_mode;
+  f32 lod_error_pixels;
+};
+
+// Orders scene instances by model
+struct InstanceModelLess
+{
+  const SceneInstance *instances;
+
+  bool operator()(u32 a, u32 b) const
+  {
+    return instances[a].model < instances[b].model;
+  }
+};
+
+struct DrawCall
+{
+  const Model *model;
+
+  // Replaces the color of the model for one instance
+  Color color;
+
+  // The settings when the draw was submitted
+  BlendMode blend_mode;
+  TransparencyMode transparency_mode;
+
+  u32 first_index;
+  u32 num_indices;
+
+  // The clipped vertices are after the ones of the draw before
+  u32 first_vertex;
+  u32 num_vertices;
+
+  // Hash of everything the pixels of the draw depend on besides the camera and lights
+  u64 key;
+};
+
+// A translucent triangle saved to be resolved per tile after the opaque triangles
+struct TranslucentTriangle
+{
+  TriangleSetup setup;
+  const DrawCall *draw_call;
+};
+
+struct OitFragment
+{
+  f32 depth;
+  u32 color; // Premultiplied BGRA8
+};
+
+// Fragment lists of one tile sorted front to back
+// This lives on the stack of the thread resolving the tile, so the memory is bounded per tile
+struct OitTile
+{
+  u8 counts[TILE_SIZE * TILE_SIZE];
+  OitFragment fragments[TILE_SIZE * TILE_SIZE][OIT_MAX_FRAGMENTS];
+};
+
 enum ClipPlane
 {
   LEFT_CLIP_PLANE,
@@ -124,6 +676,29 @@ enum ClipPlane
 
 static RendererData renderer_data;
 
+// Hashes 8 bytes at a time, continuing from the hash of the data before
+static u64 hash_memory(u64 hash, const void *memory, u64 size)
+{
+  const u64 multiplier = 0x9E3779B97F4A7C15ull;
+  const u8 *data = (const u8 *)memory;
+  hash = (hash ^ 0xCBF29CE484222325ull ^ size) * multiplier;
+
+  u64 i = 0;
+  for(; i + 8 <= size; i += 8)
+  {
+    u64 word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 32;
+  }
+
+  u64 tail = 0;
+  for(u64 j = 0; i + j < size; j++) tail |= (u64)data[i + j] << (j * 8);
+  hash = (hash ^ tail) * multiplier;
+  hash ^= hash >> 29;
+  return hash;
+}
+
 
 
 
@@ -140,42 +715,80 @@ static EdgeEquation edge_equation(v3 start, v3 end)
   return eqn;
 }
 
-static void print_pixel_info(u32 x, u32 y)
+// Offset of a pixel in the tiled color and depth buffers
+static u32 pixel_offset(u32 x, u32 y)
+{
+  return renderer_data.column_offsets[x] + renderer_data.row_offsets[y];
+}
+
+static void clear_color_buffer(u32 *color_buffer);
+static void fill_frame_tiles(u32 *buffer, __m128i value, ScreenRect rect);
+static ScreenRect screen_rect();
+static void back_end_thread();
+
+static void clear_depth_buffer()
+{
+  f32 *depths = renderer_data.depth_buffer;
+  __m128 far_depth = _mm_set1_ps(1.0f);
+
+  for(u32 i = 0; i < renderer_data.buffer_pixels; i += 4)
+  {
+    _mm_store_ps(&depths[i], far_depth);
+  }
+}
+
+// Logs what is under a point on the screen
+static void print_pixel_info(v2 position)
 {
-  PixelInfo *pixel = &renderer_data.pixel_info_buffer[y * renderer_data.screen_width + x];
+  PickResult pick_result;
+  pick(&position, 1, &pick_result);
 
-  log_file("mouse x: %d", x);
-  log_file("mouse y: %d", y);
-  log_file("R: %f, G: %f, B: %f", pixel->final_color.r, pixel->final_color.g, pixel->final_color.b);
-  log_file("V0: (%f, %f, %f)", pixel->triangle_vertices[0].x, pixel->triangle_vertices[0].y, pixel->triangle_vertices[0].z);
-  log_file("V1: (%f, %f, %f)", pixel->triangle_vertices[1].x, pixel->triangle_vertices[1].y, pixel->triangle_vertices[1].z);
-  log_file("V2: (%f, %f, %f)", pixel->triangle_vertices[2].x, pixel->triangle_vertices[2].y, pixel->triangle_vertices[2].z);
-  log_file("model pos: %f, %f", renderer_data.model->position.x, renderer_data.model->position.y);
-  log_file("model scale: %f, %f", renderer_data.model->scale.x, renderer_data.model->scale.y);
-  log_file("model rot: %f", renderer_data.model->rotation);
+  log_file("mouse x: %f", position.x);
+  log_file("mouse y: %f", position.y);
+  if(pick_result.hit)
+  {
+    const SceneInstance *picked = &renderer_data.scene.instances[pick_result.instance];
+    const MeshArrays *mesh = &renderer_data.models[picked->model]->mesh;
+    log_file("instance: %u, triangle: %u, depth: %f", pick_result.instance, pick_result.triangle, pick_result.depth);
+    log_file("barycentrics: (%f, %f, %f)", pick_result.barycentrics.x, pick_result.barycentrics.y, pick_result.barycentrics.z);
+    for(u32 i = 0; i < 3; i++)
+    {
+      v3 vertex = mesh_position(mesh, mesh->indices[pick_result.triangle * 3 + i]);
+      log_file("V%u: (%f, %f, %f)", i, vertex.x, vertex.y, vertex.z);
+    }
+  }
+  const SceneInstance *instance = &renderer_data.scene.instances[renderer_data.controlled_instance];
+  log_file("model pos: %f, %f", instance->position.x, instance->position.y);
+  log_file("model scale: %f, %f", instance->scale.x, instance->scale.y);
+  log_file("model rot: %f", instance->rotation);
 
   log_file("\n\n");
 
 }
 
-static void update_stuff()
+void update_stuff()
 {
+  const SceneInstance *instance = &renderer_data.scene.instances[renderer_data.controlled_instance];
+  v3 position = instance->position;
+  v3 scale = instance->scale;
+  f32 rotation = instance->rotation;
+
   f32 speed = 0.055f;
   if(key_state('W'))
   {
-    renderer_data.model->position.y += speed;
+    position.y += speed;
   }
   if(key_state('S'))
   {
-    renderer_data.model->position.y -= speed;
+    position.y -= speed;
   }
   if(key_state('A'))
   {
-    renderer_data.model->position.x -= speed;
+    position.x -= speed;
   }
   if(key_state('D'))
   {
-    renderer_data.model->position.x += speed;
+    position.x += speed;
   }
 
 
@@ -183,13 +796,13 @@ static void update_stuff()
 #if 1
   if(key_state('I'))
   {
-    renderer_data.model->scale.x -= speed;
-    renderer_data.model->scale.y -= speed;
+    scale.x -= speed;
+    scale.y -= speed;
   }
   if(key_state('K'))
   {
-    renderer_data.model->scale.x += speed;
-    renderer_data.model->scale.y += speed;
+    scale.x += speed;
+    scale.y += speed;
   }
 #else
   if(key_state('I'))
@@ -206,11 +819,11 @@ static void update_stuff()
 
   if(key_state('J'))
   {
-    renderer_data.model->rotation += speed;
+    rotation += speed;
   }
   if(key_state('L'))
   {
-    renderer_data.model->rotation -= speed;
+    rotation -= speed;
   }
 
   if(key_state('Z'))
@@ -237,10 +850,21 @@ static void update_stuff()
   if(mouse_state(0) && !left_click)
   {
     log_file("Mouse position: %f, %f", pos.x, pos.y);
-    print_pixel_info((u32)pos.x, (u32)pos.y);
+    print_pixel_info(pos);
   }
   left_click = mouse_state(0);
 
+  // Only moved instances are refit in the scene hierarchy
+  if(position.x != instance->position.x || position.y != instance->position.y || position.z != instance->position.z ||
+     scale.x != instance->scale.x || scale.y != instance->scale.y || scale.z != instance->scale.z ||
+     rotation != instance->rotation)
+  {
+    set_instance_transform(renderer_data.controlled_instance, position, scale, rotation);
+  }
+
+  // Hold T to see through the model
+  renderer_data.models[instance->model]->color.a = key_state('T') ? 0.5f : 1.0f;
+
   if(key_state('M'))
   {
     renderer_data.mode = RENDER_MODE_LINES;
@@ -252,56 +876,6 @@ static void update_stuff()
 }
 
 // Computes the per vertex normals for a given mesh
-static void compute_vertex_normals(const std::vector<v3> *in_vertices, const std::vector<u32> *in_indices, std::vector<v3> *out_normals)
-{
-  const std::vector<v3> &vertices = *in_vertices;
-  const std::vector<unsigned> &indices = *in_indices;
-
-  if(vertices.size() == 0) return;
-
-  // Allocate buffers
-  std::vector<v3> &normals = *out_normals;
-  normals.reserve(vertices.size());
-  normals.resize(vertices.size());
-
-  std::vector<unsigned> sums;
-  sums.reserve(vertices.size());
-  sums.resize(vertices.size());
-
-  // Initalize to zero
-  for(unsigned i = 0; i < normals.size(); i++) normals[i] = v3(0.0f, 0.0f, 0.0f);
-  for(unsigned i = 0; i < sums.size(); i++) sums[i] = 0;
-
-  // Find the sum of all normals per vertex
-  for(unsigned i = 0; i < indices.size(); )
-  {
-    unsigned p0_index = indices[i++];
-    unsigned p1_index = indices[i++];
-    unsigned p2_index = indices[i++];
-
-    v3 p0 = vertices[p0_index];
-    v3 p1 = vertices[p1_index];
-    v3 p2 = vertices[p2_index];
-
-    v3 normal = cross(p1 - p0, p2 - p0);
-    normal = unit(normal);
-
-    normals[p0_index] += normal;
-    normals[p1_index] += normal;
-    normals[p2_index] += normal;
-
-    sums[p0_index]++;
-    sums[p1_index]++;
-    sums[p2_index]++;
-  }
-
-  // Divide to find average normal per vertex
-  for(unsigned i = 0; i < normals.size(); i++)
-  {
-    normals[i] /= (f32)sums[i];
-  }
-}
-
 void render_line_bresenham(u32 x1, u32 y1, u32 x2, u32 y2, Color color)
 {
   assert(x1 >= 0);
@@ -326,14 +900,14 @@ void render_line_bresenham(u32 x1, u32 y1, u32 x2, u32 y2, Color color)
     s32 y_step = (y1 < y2) ? 1 : -1;
     while(y1 != y2)
     {
-      renderer_data.frame_buffer[y1 * renderer_data.screen_width + x1] = color.pack();
+      renderer_data.color_buffer[pixel_offset(x1, y1)] = color.pack();
       y1 += y_step;
     }
 
     return;
   }
 
-  renderer_data.frame_buffer[y1 * renderer_data.screen_width + x1] = color.pack();
+  renderer_data.color_buffer[pixel_offset(x1, y1)] = color.pack();
 
   s32 counter = 0;
 
@@ -375,7 +949,7 @@ void render_line_bresenham(u32 x1, u32 y1, u32 x2, u32 y2, Color color)
         current_y += y_step;
       }
 
-      renderer_data.frame_buffer[current_y * renderer_data.screen_width + current_x] = color.pack();
+      renderer_data.color_buffer[pixel_offset(current_x, current_y)] = color.pack();
     }
   }
   else
@@ -413,48 +987,40 @@ void render_line_bresenham(u32 x1, u32 y1, u32 x2, u32 y2, Color color)
         current_x += x_step;
       }
 
-      renderer_data.frame_buffer[current_y * renderer_data.screen_width + current_x] = color.pack();
+      renderer_data.color_buffer[pixel_offset(current_x, current_y)] = color.pack();
     }
   }
 }
 
-// Render a triangle in viewport pixel space between points p0, p1, p2 with the given color (depending on the render mode)
-// p0, p1, p2 will only show if in counter-clockwise order
-// If there are normals and/or texture coords, there must be 3 normals and/or 3 texture coordinates given
-static void render_triangle(u32 *pixels, v3 p0, v3 p1, v3 p2, v3 *normals, v2 *texture_coords)
-#if 1
+// Evaluates an attribute plane at a pixel
+static f32 evaluate_plane(AttributePlane plane, f32 x, f32 y)
 {
-  v3 crossp = cross(p1 - p0, p2 - p0);
-
-  // Backface culling
-  if(crossp.z < 0.0f) 
-  {
-    return;
-  }
-
-  // Normalize normals
-  if(normals)
-  {
-    for(u32 i = 0; i < 3; i++) normals[i] = unit(normals[i]);
-  }
-
-  f32 *depth_buffer = renderer_data.depth_buffer;
-
-  // Get the bounding box of pixels to check the triangle against
-  v2 bottom_left_bound = v2(min(p0.x, p1.x, p2.x), min(p0.y, p1.y, p2.y));
-  v2 top_right_bound = v2(max(p0.x, p1.x, p2.x), max(p0.y, p1.y, p2.y));
-  u32 left_bb = (u32)bottom_left_bound.x;
-  u32 bottom_bb = (u32)bottom_left_bound.y;
-  u32 right_bb = (u32)top_right_bound.x;
-  u32 top_bb = (u32)top_right_bound.y;
+  return plane.dx * x + plane.dy * y + plane.base;
+}
 
-  u32 width = renderer_data.screen_width;
-  u32 height = renderer_data.screen_height;
+// Builds the plane of an attribute from its values at the three triangle points
+//
+// The barycentric coordinates of a pixel are the edge equation evaluations
+// divided by twice the triangle area, so each one is a plane in x and y. An
+// attribute is a weighted sum of these planes, which is a plane itself.
+static AttributePlane attribute_plane(const TriangleSetup *setup, f32 inv_double_area, f32 v0, f32 v1, f32 v2)
+{
+  AttributePlane plane;
+  plane.dx =   (setup->e0.a * v0 + setup->e1.a * v1 + setup->e2.a * v2) * inv_double_area;
+  plane.dy =   (setup->e0.b * v0 + setup->e1.b * v1 + setup->e2.b * v2) * inv_double_area;
+  plane.base = (setup->e0.c * v0 + setup->e1.c * v1 + setup->e2.c * v2) * inv_double_area;
+  return plane;
+}
 
-  assert(left_bb >= 0);
-  assert(bottom_bb >= 0);
-  assert(right_bb < width);
-  assert(top_bb < height);
+// Triangle setup for a triangle in viewport pixel space between points p0, p1, p2
+// The w component of each point must be 1/w of the point in clip space
+// Only the depth plane is set up if varyings is 0
+// Returns false if the triangle is back facing, has no area or is outside the scissor
+static bool setup_triangle(TriangleSetup *setup, v4 p0, v4 p1, v4 p2, const f32 varyings[3][NUM_VARYINGS], const ScreenRect *scissor)
+{
+  setup->p0 = v3(p0.x, p0.y, p0.z);
+  setup->p1 = v3(p1.x, p1.y, p1.z);
+  setup->p2 = v3(p2.x, p2.y, p2.z);
 
   // These edge equations come from the equation:
   //
@@ -468,275 +1034,731 @@ static void render_triangle(u32 *pixels, v3 p0, v3 p1, v3 p2, v3 *normals, v2 *t
   // a and b from the edge equation are the x and y components of n * x
   // c is the n * p component
   //
-  EdgeEquation e0 = edge_equation(p1, p2);
-  EdgeEquation e1 = edge_equation(p2, p0);
-  EdgeEquation e2 = edge_equation(p0, p1);
+  setup->e0 = edge_equation(setup->p1, setup->p2);
+  setup->e1 = edge_equation(setup->p2, setup->p0);
+  setup->e2 = edge_equation(setup->p0, setup->p1);
 
-  // Loop through the bounding box of pixels of the triangle
-  for(u32 y_pixel = bottom_bb; y_pixel <= top_bb; y_pixel++)
+  // The sum of the edge equation evaluations is the same for every point, so
+  // the x and y terms cancel and twice the area is the sum of the c terms
+  f32 double_triangle_area = setup->e0.c + setup->e1.c + setup->e2.c;
+
+  // Backface culling
+  if(double_triangle_area <= 0.0f)
   {
-    for(u32 x_pixel = left_bb; x_pixel <= right_bb; x_pixel++)
-    {
-      u32 index = y_pixel * width + x_pixel;
+    return false;
+  }
 
-      f32 eval0 = e0.a * x_pixel + e0.b * y_pixel + e0.c;
-      f32 eval1 = e1.a * x_pixel + e1.b * y_pixel + e1.c;
-      f32 eval2 = e2.a * x_pixel + e2.b * y_pixel + e2.c;
+  // Get the bounding box of pixels to check the triangle against, inside the scissor
+  // The scissor is inside the buffer, clipped points can be exactly on its right or top edge
+  s32 left_bb = max((s32)min(p0.x, p1.x, p2.x), scissor->left);
+  s32 bottom_bb = max((s32)min(p0.y, p1.y, p2.y), scissor->bottom);
+  s32 right_bb = min((s32)max(p0.x, p1.x, p2.x), scissor->right);
+  s32 top_bb = min((s32)max(p0.y, p1.y, p2.y), scissor->top);
+  if(left_bb > right_bb || bottom_bb > top_bb)
+  {
+    return false;
+  }
+  setup->left_bb = left_bb;
+  setup->bottom_bb = bottom_bb;
+  setup->right_bb = right_bb;
+  setup->top_bb = top_bb;
 
-      // Check if the point is inside the triangle by checking if edge equation evaluations are zero
-      if((eval0 > 0.0f || (eval0 == 0.0f && e0.tl == true)) &&
-         (eval1 > 0.0f || (eval1 == 0.0f && e1.tl == true)) &&
-         (eval2 > 0.0f || (eval2 == 0.0f && e2.tl == true))
-        )
-      {
-        Color color = Color(1.0f, 1.0f, 1.0f);
+  // This is the only divide for the whole triangle
+  f32 inv_double_area = 1.0f / double_triangle_area;
 
-        f32 double_triangle_area = eval0 + eval1 + eval2;
-        f32 a = eval0 / double_triangle_area;
-        f32 b = eval1 / double_triangle_area;
-        f32 c = eval2 / double_triangle_area;
-        
-        // Calculate depth value for this pixel
-        f32 depth = (a * p0.z) + (b * p1.z) + (c * p2.z);
+  // Depth is already divided by w so it is linear in screen space
+  setup->depth = attribute_plane(setup, inv_double_area, p0.z, p1.z, p2.z);
+  if(!varyings) return true;
 
-        // Make sure this pixel has a lesser depth
-        if(depth < depth_buffer[index])
-        {
-          v3 light_pos = v3(0.0f, 0.0f, 1.0f);
-          f32 intensity0 = dot(normals[0], unit(light_pos));
-          f32 intensity1 = dot(normals[1], unit(light_pos));
-          f32 intensity2 = dot(normals[2], unit(light_pos));
+  // Varyings are not linear in screen space but varying / w and 1 / w are
+  setup->inv_w = attribute_plane(setup, inv_double_area, p0.w, p1.w, p2.w);
+  for(u32 i = 0; i < NUM_VARYINGS; i++)
+  {
+    setup->varyings[i] = attribute_plane(setup, inv_double_area,
+                                         varyings[0][i] * p0.w,
+                                         varyings[1][i] * p1.w,
+                                         varyings[2][i] * p2.w);
+  }
 
-          //f32 s = (a * textureCoords[0].x) + (b * textureCoords[1].x) + (c * textureCoords[2].x);
-          //f32 t = (a * textureCoords[0].y) + (b * textureCoords[1].y) + (c * textureCoords[2].y);
+  return true;
+}
 
-          // Clamp the intensity to zero
-          // The intensity may be negative if the light source is facing away from the normal
-          if(intensity0 < 0.0f) intensity0 = 0.0f;
-          if(intensity1 < 0.0f) intensity1 = 0.0f;
-          if(intensity2 < 0.0f) intensity2 = 0.0f;
+// Returns the part of a light that reaches a point in view space past the shadow casters
+//
+// Percentage closer filtering: the depths of a 4x4 block of shadow map pixels
+// around the point are compared with its depth a row at a time. The columns and
+// rows are weighted [1 - f, 1, 1, f] by the fraction of the point's position,
+// the same as averaging 3x3 bilinear lookups, so shadow edges are smooth.
+static f32 shadow_visibility(const Light *light, v3 position, v3 normal)
+{
+  const ShadowMap *shadow_map = &renderer_data.shadow_maps[light->shadow_map];
+  const f32 *depths = renderer_data.shadow_depths[light->shadow_map];
 
-          // Interpolate the intensity of this pixel using barycentric coordinates
-          f32 intensity = (a * intensity0) + (b * intensity1) + (c * intensity2);
-          intensity = clamp(intensity, 0.0f, 1.0f);
+  f32 texel_size = shadow_map->texel_size;
+  if(light->type == LIGHT_TYPE_SPOT)
+  {
+    texel_size += shadow_map->texel_size_per_distance * length(position - shadow_map->view_position);
+  }
+  v3 offset_position = position + normal * (SHADOW_NORMAL_OFFSET * texel_size);
 
-#if 1
-          color.r *= squared(intensity) * 0.8f;
-          color.g *= squared(intensity) * 0.0f;
-          color.b *= squared(intensity) * 1.0f;
-#else
-          color.r *= a;
-          color.g *= b;
-          color.b *= c;
-#endif
+  v4 map_position = shadow_map->view_to_map * v4(offset_position, 1.0f);
+  if(map_position.w <= 0.0f) return 1.0f;
 
-          // Set the pixel depth in the depth buffer
-          depth_buffer[index] = depth;
+  f32 inv_w = 1.0f / map_position.w;
+  f32 x = map_position.x * inv_w;
+  f32 y = map_position.y * inv_w;
+  f32 depth = min(map_position.z * inv_w, 1.0f) - SHADOW_DEPTH_BIAS;
 
-          // Set the final pixel color
-          pixels[index] = color.pack();
+  // Nothing casts a shadow outside the map
+  if(!(x >= 0.0f && x < SHADOW_MAP_SIZE && y >= 0.0f && y < SHADOW_MAP_SIZE)) return 1.0f;
 
+  s32 map_x = (s32)x;
+  s32 map_y = (s32)y;
+  f32 fraction_x = x - map_x;
+  f32 fraction_y = y - map_y;
 
-          renderer_data.pixel_info_buffer[index].x = x_pixel;
-          renderer_data.pixel_info_buffer[index].y = y_pixel;
-          renderer_data.pixel_info_buffer[index].final_color = color;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[0] = p0;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[1] = p1;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[2] = p2;
-        }
-      }
-    }
+  u32 columns[4];
+  for(s32 i = 0; i < 4; i++)
+  {
+    columns[i] = renderer_data.shadow_column_offsets[clamp(map_x - 1 + i, 0, SHADOW_MAP_SIZE - 1)];
+  }
+  f32 row_weights[4] = {1.0f - fraction_y, 1.0f, 1.0f, fraction_y};
+  __m128 column_weights = _mm_setr_ps(1.0f - fraction_x, 1.0f, 1.0f, fraction_x);
+  __m128 point_depth = _mm_set1_ps(depth);
+
+  __m128 lit = _mm_setzero_ps();
+  for(s32 row = 0; row < 4; row++)
+  {
+    const f32 *texels = depths + renderer_data.shadow_row_offsets[clamp(map_y - 1 + row, 0, SHADOW_MAP_SIZE - 1)];
+    __m128 stored = _mm_setr_ps(texels[columns[0]], texels[columns[1]], texels[columns[2]], texels[columns[3]]);
+    __m128 row_lit = _mm_and_ps(_mm_cmple_ps(point_depth, stored), column_weights);
+    lit = _mm_add_ps(lit, _mm_mul_ps(row_lit, _mm_set1_ps(row_weights[row])));
   }
+
+  // The weights add up to 9
+  lit = _mm_add_ps(lit, _mm_movehl_ps(lit, lit));
+  lit = _mm_add_ss(lit, _mm_shuffle_ps(lit, lit, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(lit) * (1.0f / 9.0f);
 }
-#else
+
+// Returns how much of a light reaches a point with the given normal in view space
+static v3 light_contribution(const Light *light, v3 position, v3 normal)
 {
-  v3 crossp = cross(p1 - p0, p2 - p0);
+  if(light->type == LIGHT_TYPE_DIRECTIONAL)
+  {
+    f32 intensity = max(dot(normal, -light->direction), 0.0f);
+    if(intensity > 0.0f && light->shadow_map != NO_SHADOW_MAP)
+    {
+      intensity *= shadow_visibility(light, position, normal);
+    }
+    return light->color * intensity;
+  }
 
-  // Backface culling
-  if(crossp.z < 0.0f) 
+  v3 to_light = light->position - position;
+  f32 distance_squared = length_squared(to_light);
+  if(distance_squared >= squared(light->radius))
   {
-    return;
+    return v3();
   }
 
-  // Normalize normals
-  if(normals)
+  f32 distance = (f32)sqrt(distance_squared);
+  v3 light_direction = to_light / distance;
+
+  // Intensity is cos of the angle between the light source and the normal
+  f32 intensity = dot(normal, light_direction);
+  if(intensity <= 0.0f)
   {
-    for(u32 i = 0; i < 3; i++) normals[i] = unit(normals[i]);
+    return v3();
   }
 
-  f32 *depth_buffer = renderer_data.depth_buffer;
+  // Fade to zero at the edge of the light radius
+  f32 falloff = 1.0f - distance / light->radius;
+  intensity *= squared(falloff);
 
-  // Get the bounding box of pixels to check the triangle against
-  v2 bottom_left_bound = v2(min(p0.x, p1.x, p2.x), min(p0.y, p1.y, p2.y));
-  v2 top_right_bound = v2(max(p0.x, p1.x, p2.x), max(p0.y, p1.y, p2.y));
-  u32 left_bb = (u32)bottom_left_bound.x;
-  u32 bottom_bb = (u32)bottom_left_bound.y;
-  u32 right_bb = (u32)top_right_bound.x;
-  u32 top_bb = (u32)top_right_bound.y;
+  if(light->type == LIGHT_TYPE_SPOT)
+  {
+    f32 cos_angle = dot(-light_direction, light->direction);
+    f32 cone = (cos_angle - light->cos_outer_angle) / (light->cos_inner_angle - light->cos_outer_angle);
+    intensity *= clamp(cone, 0.0f, 1.0f);
 
-  u32 width = renderer_data.screen_width;
-  u32 height = renderer_data.screen_height;
+    if(intensity > 0.0f && light->shadow_map != NO_SHADOW_MAP)
+    {
+      intensity *= shadow_visibility(light, position, normal);
+    }
+  }
 
-  assert(left_bb >= 0);
-  assert(bottom_bb >= 0);
-  assert(right_bb < width);
-  assert(top_bb < height);
+  return light->color * intensity;
+}
 
-  // These edge equations come from the equation:
-  //
-  // p and q are points on the triangle
-  // e is the edge from p to q
-  // point x is on the line e if
-  
-  // n * (x - p) = 0
-  // n * x - n * p = 0
-  //
-  // a and b from the edge equation are the x and y components of n * x
-  // c is the n * p component
-  //
-  EdgeEquation e0 = edge_equation(p1, p2);
-  EdgeEquation e1 = edge_equation(p2, p0);
-  EdgeEquation e2 = edge_equation(p0, p1);
-
-
-  // Pick the starting pixel
-  v3 pixel = {left_bb + 0.5f, bottom_bb + 0.5f, 1.0f};
-
-  // These values represent the evaluations of each edge equation
-  // These are initialized here from the beginning pixel so they can be computed incrementally
-  f32 eval0 = e0.a * pixel.x + e0.b * pixel.y + e0.c;
-  f32 eval1 = e1.a * pixel.x + e1.b * pixel.y + e1.c;
-  f32 eval2 = e2.a * pixel.x + e2.b * pixel.y + e2.c;
-
-  // 2 * triangle area is just the some the edge equations
-  // Each edge equation evaluation value represents twice the area of the triangle made from
-  // the point inside the triangle and the two opposite triangle vertices
-  f32 double_triangle_area = eval0 + eval1 + eval2;
-
-  // Initial calculations of barycentric coordinates for interpolation
-  f32 a =      eval0 / double_triangle_area;
-  f32 a_inc_x = e0.a / double_triangle_area;
-  f32 a_inc_y = e0.b / double_triangle_area;
-  f32 b =      eval1 / double_triangle_area;
-  f32 b_inc_x = e1.a / double_triangle_area;
-  f32 b_inc_y = e1.b / double_triangle_area;
-  f32 c =      eval2 / double_triangle_area;
-  f32 c_inc_x = e2.a / double_triangle_area;
-  f32 c_inc_y = e2.b / double_triangle_area;
+// Computes the color of a pixel from its interpolated varyings
+// Only the global lights and the lights in the pixel's tile are considered
+// The lod picks the mip level of the model texture, if there is one
+static Color shade_pixel(const f32 *varyings, u32 tile_index, const DrawCall *draw_call, f32 lod)
+{
+  v3 normal = unit(v3(varyings[VARYING_NORMAL_X], varyings[VARYING_NORMAL_Y], varyings[VARYING_NORMAL_Z]));
+  v3 position = v3(varyings[VARYING_VIEW_POSITION_X], varyings[VARYING_VIEW_POSITION_Y], varyings[VARYING_VIEW_POSITION_Z]);
 
-  // Loop through the bounding box of pixels of the triangle
-  for(u32 y_pixel = bottom_bb; y_pixel <= top_bb; y_pixel++)
+  // Empty without lights, then only the loops below are skipped
+  const Light *lights = renderer_data.view_lights.data();
+
+  v3 light = v3();
+  for(u32 i = 0; i < renderer_data.global_lights.size(); i++)
   {
-    // Save evaluation values for this row of pixels
-    f32 start_eval0 = eval0;
-    f32 start_eval1 = eval1;
-    f32 start_eval2 = eval2;
-    f32 start_a = a;
-    f32 start_b = b;
-    f32 start_c = c;
+    light += light_contribution(&lights[renderer_data.global_lights[i]], position, normal);
+  }
 
-    for(u32 x_pixel = left_bb; x_pixel <= right_bb; x_pixel++)
-    {
-      u32 index = y_pixel * width + x_pixel;
+  u32 start = renderer_data.tile_light_offsets[tile_index];
+  u32 end = renderer_data.tile_light_offsets[tile_index + 1];
+  for(u32 i = start; i < end; i++)
+  {
+    light += light_contribution(&lights[renderer_data.tile_light_indices[i]], position, normal);
+  }
 
-      assert(x_pixel >= 0 && x_pixel < width);
-      assert(y_pixel >= 0 && y_pixel < height);
-      assert(index >= 0 && index < width * height);
+  light.x = clamp(light.x, 0.0f, 1.0f);
+  light.y = clamp(light.y, 0.0f, 1.0f);
+  light.z = clamp(light.z, 0.0f, 1.0f);
 
-      // Check if the point is inside the triangle by checking if edge equation evaluations are zero
-      if((eval0 > 0.0f || (eval0 == 0.0f && e0.tl == true)) &&
-         (eval1 > 0.0f || (eval1 == 0.0f && e1.tl == true)) &&
-         (eval2 > 0.0f || (eval2 == 0.0f && e2.tl == true))
-        )
-      {
-        Color color = Color(1.0f, 1.0f, 1.0f);
-        
-        // Calculate depth value for this pixel
-        f32 depth = (a * p0.z) + (b * p1.z) + (c * p2.z);
+  Color color = draw_call->color;
+  if(draw_call->model->texture)
+  {
+    v2 uv = v2(varyings[VARYING_TEXTURE_U], varyings[VARYING_TEXTURE_V]);
+    v4 texel = sample_trilinear(draw_call->model->texture, uv, lod);
+    color = Color(texel.x, texel.y, texel.z, texel.w * draw_call->color.a);
+  }
 
-        // Make sure this pixel has a lesser depth
-        if(depth < depth_buffer[index])
-        {
-#if 0
-          f32 intensity0 = 1.0f;
-          f32 intensity1 = 1.0f;
-          f32 intensity2 = 1.0f;
+#if 1
+  color.r *= squared(light.x);
+  color.g *= squared(light.y);
+  color.b *= squared(light.z);
 #else
-          // Intensity is cos of the angle between the light source and the normal
-          v3 light_pos = v3(0.0f, 0.0f, 1.0f);
-          f32 intensity0 = dot(normals[0], unit(light_pos));
-          f32 intensity1 = dot(normals[1], unit(light_pos));
-          f32 intensity2 = dot(normals[2], unit(light_pos));
+  color.r *= light.x;
+  color.g *= light.y;
+  color.b *= light.z;
 #endif
 
-          //f32 s = (a * textureCoords[0].x) + (b * textureCoords[1].x) + (c * textureCoords[2].x);
-          //f32 t = (a * textureCoords[0].y) + (b * textureCoords[1].y) + (c * textureCoords[2].y);
+  return color;
+}
+
+// Shaded pixels waiting to be written to the frame buffer 4 at a time
+struct FragmentQueue
+{
+  BlendMode blend_mode;
+  u32 count;
+  u32 indices[4];
+  f32 r[4];
+  f32 g[4];
+  f32 b[4];
+  f32 a[4];
+};
+
+// Divides each 16 bit lane by 255 with rounding, for values up to 255 * 255
+static __m128i divide_by_255(__m128i x)
+{
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
 
-          // Clamp the intensity to zero
-          // The intensity may be negative if the light source is facing away from the normal
-          if(intensity0 < 0.0f) intensity0 = 0.0f;
-          if(intensity1 < 0.0f) intensity1 = 0.0f;
-          if(intensity2 < 0.0f) intensity2 = 0.0f;
+// Blends two pixels of 16 bit BGRA lanes
+static __m128i blend_pixels(__m128i src, __m128i dst, BlendMode mode)
+{
+  // Alpha of each pixel copied to all four of its lanes
+  __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i inv_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
 
-          // Interpolate the intensity of this pixel using barycentric coordinates
-          f32 intensity = (a * intensity0) + (b * intensity1) + (c * intensity2);
-          intensity = clamp(intensity, 0.0f, 1.0f);
+  // The destination always keeps (1 - source alpha) of itself
+  __m128i result = _mm_mullo_epi16(dst, inv_alpha);
 
-#if 1
-          color.r *= squared(intensity) * 0.8f;
-          color.g *= squared(intensity) * 0.0f;
-          color.b *= squared(intensity) * 1.0f;
-#else
-          color.r *= a;
-          color.g *= b;
-          color.b *= c;
-#endif
+  if(mode == BLEND_MODE_SRC_OVER)
+  {
+    // Colors are scaled by the source alpha but the alpha itself is not, so
+    // the result is premultiplied: alpha = src_a + dst_a * (1 - src_a)
+    __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i src_factor = _mm_or_si128(_mm_andnot_si128(alpha_lanes, alpha), _mm_and_si128(alpha_lanes, _mm_set1_epi16(255)));
+    result = _mm_add_epi16(result, _mm_mullo_epi16(src, src_factor));
+    return divide_by_255(result);
+  }
+
+  // BLEND_MODE_PREMULTIPLIED
+  return _mm_adds_epu16(divide_by_255(result), src);
+}
+
+// Converts, packs and blends the queued pixels into the frame buffer
+static void flush_fragments(u32 *pixels, FragmentQueue *queue)
+{
+  if(queue->count == 0) return;
+
+  // Fill unused lanes with copies of the first pixel. They write the same value to the same pixel.
+  for(u32 i = queue->count; i < 4; i++)
+  {
+    queue->indices[i] = queue->indices[0];
+    queue->r[i] = queue->r[0];
+    queue->g[i] = queue->g[0];
+    queue->b[i] = queue->b[0];
+    queue->a[i] = queue->a[0];
+  }
+
+  // Float to 8 bit fixed point with rounding
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 scale = _mm_set1_ps(255.0f);
+  __m128i r = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(queue->r), zero), one), scale));
+  __m128i g = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(queue->g), zero), one), scale));
+  __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(queue->b), zero), one), scale));
+  __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(queue->a), zero), one), scale));
+
+  // Pack to BGRA8
+  __m128i src = _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(a, 24)));
+
+  // Pixels from the same row of a triangle are usually next to each other in memory
+  u32 *first = pixels + queue->indices[0];
+  bool contiguous = (queue->indices[1] == queue->indices[0] + 1) &&
+                    (queue->indices[2] == queue->indices[0] + 2) &&
+                    (queue->indices[3] == queue->indices[0] + 3);
+
+  BlendMode mode = queue->blend_mode;
+  __m128i result;
+  if(mode == BLEND_MODE_OPAQUE)
+  {
+    result = src;
+  }
+  else
+  {
+    __m128i dst;
+    if(contiguous)
+    {
+      dst = _mm_loadu_si128((__m128i *)first);
+    }
+    else
+    {
+      dst = _mm_set_epi32(pixels[queue->indices[3]], pixels[queue->indices[2]], pixels[queue->indices[1]], pixels[queue->indices[0]]);
+    }
+
+    if(mode == BLEND_MODE_ADDITIVE)
+    {
+      result = _mm_adds_epu8(src, dst);
+    }
+    else
+    {
+      // Two pixels at a time in 16 bit lanes
+      __m128i zero_i = _mm_setzero_si128();
+      __m128i low = blend_pixels(_mm_unpacklo_epi8(src, zero_i), _mm_unpacklo_epi8(dst, zero_i), mode);
+      __m128i high = blend_pixels(_mm_unpackhi_epi8(src, zero_i), _mm_unpackhi_epi8(dst, zero_i), mode);
+      result = _mm_packus_epi16(low, high);
+    }
+  }
+
+  if(contiguous)
+  {
+    _mm_storeu_si128((__m128i *)first, result);
+  }
+  else
+  {
+    u32 packed[4];
+    _mm_storeu_si128((__m128i *)packed, result);
+    for(u32 i = 0; i < 4; i++) pixels[queue->indices[i]] = packed[i];
+  }
+
+  queue->count = 0;
+}
+
+// Adds a shaded pixel to be written to the frame buffer
+static void queue_fragment(u32 *pixels, FragmentQueue *queue, u32 index, Color color)
+{
+  u32 i = queue->count++;
+  queue->indices[i] = index;
+  queue->r[i] = color.r;
+  queue->g[i] = color.g;
+  queue->b[i] = color.b;
+  queue->a[i] = color.a;
+
+  if(queue->count == 4) flush_fragments(pixels, queue);
+}
+
+// Perspective correct texture coordinates of a pixel
+static v2 pixel_texture_coord(const TriangleSetup *setup, f32 x, f32 y)
+{
+  f32 w = 1.0f / evaluate_plane(setup->inv_w, x, y);
+  f32 u = evaluate_plane(setup->varyings[VARYING_TEXTURE_U], x, y) * w;
+  f32 v = evaluate_plane(setup->varyings[VARYING_TEXTURE_V], x, y) * w;
+  return v2(u, v);
+}
+
+// Texture level of detail for a 2x2 quad of pixels from the differences of the
+// texture coordinates across the quad, the same as the derivatives a GPU uses
+static f32 quad_lod(const TriangleSetup *setup, const Texture *texture, u32 quad_x, u32 quad_y)
+{
+  f32 x = (f32)quad_x;
+  f32 y = (f32)quad_y;
+  v2 uv = pixel_texture_coord(setup, x, y);
+  v2 uv_right = pixel_texture_coord(setup, x + 1.0f, y);
+  v2 uv_up = pixel_texture_coord(setup, x, y + 1.0f);
+  return texture_lod(texture, uv_right - uv, uv_up - uv);
+}
+
+// The y part of the depth, 1/w and varying planes, which only changes once per row
+struct PlaneRow
+{
+  f32 depth;
+  f32 inv_w;
+  f32 varyings[NUM_VARYINGS];
+};
+
+// The opaque and translucent passes both rasterize with the functions below,
+// so a pixel gets the same coverage, depth and varyings in either pass and
+// translucent fragments line up with the opaque depth buffer
+
+static void plane_row(const TriangleSetup *setup, f32 y, PlaneRow *row)
+{
+  row->depth = setup->depth.dy * y + setup->depth.base;
+  row->inv_w = setup->inv_w.dy * y + setup->inv_w.base;
+  for(u32 i = 0; i < NUM_VARYINGS; i++)
+  {
+    row->varyings[i] = setup->varyings[i].dy * y + setup->varyings[i].base;
+  }
+}
+
+// Check if the point is inside the triangle by checking if edge equation evaluations are zero
+// Pixels exactly on an edge belong to the triangle only for top-left edges
+static bool pixel_inside(const TriangleSetup *setup, f32 x, f32 y)
+{
+  f32 eval0 = setup->e0.a * x + setup->e0.b * y + setup->e0.c;
+  f32 eval1 = setup->e1.a * x + setup->e1.b * y + setup->e1.c;
+  f32 eval2 = setup->e2.a * x + setup->e2.b * y + setup->e2.c;
+
+  return (eval0 > 0.0f || (eval0 == 0.0f && setup->e0.tl == true)) &&
+         (eval1 > 0.0f || (eval1 == 0.0f && setup->e1.tl == true)) &&
+         (eval2 > 0.0f || (eval2 == 0.0f && setup->e2.tl == true));
+}
+
+static f32 pixel_depth(const TriangleSetup *setup, const PlaneRow *row, f32 x)
+{
+  return setup->depth.dx * x + row->depth;
+}
+
+// Undo the divide by w to get perspective correct varyings
+static void pixel_varyings(const TriangleSetup *setup, const PlaneRow *row, f32 x, f32 *varyings)
+{
+  f32 w = 1.0f / (setup->inv_w.dx * x + row->inv_w);
+  for(u32 i = 0; i < NUM_VARYINGS; i++)
+  {
+    varyings[i] = (setup->varyings[i].dx * x + row->varyings[i]) * w;
+  }
+}
+
+// Render a set up triangle
+static void render_triangle(u32 *pixels, const TriangleSetup *setup, const DrawCall *draw_call, DepthTest depth_test)
+{
+  const Texture *texture = draw_call->model->texture;
+
+  FragmentQueue queue;
+  queue.blend_mode = draw_call->blend_mode;
+  queue.count = 0;
+
+  f32 *depth_buffer = renderer_data.depth_buffer;
+  const u32 *column_offsets = renderer_data.column_offsets;
+
+  // No term of the depth plane is larger than this in the bounding box
+  f32 depth_magnitude = absf(setup->depth.dx) * (f32)setup->right_bb + absf(setup->depth.dy) * (f32)setup->top_bb + absf(setup->depth.base);
+  f32 prepass_bias = depth_magnitude * PREPASS_DEPTH_ULPS * FLT_EPSILON;
+
+  // Loop through the bounding box of pixels of the triangle
+  for(u32 y_pixel = setup->bottom_bb; y_pixel <= setup->top_bb; y_pixel++)
+  {
+    f32 y = (f32)y_pixel;
+    u32 tile_row = (y_pixel / TILE_SIZE) * renderer_data.tiles_x;
+    u32 row_offset = renderer_data.row_offsets[y_pixel];
+
+    // Texture lod is found once for each 2x2 quad of pixels
+    u32 quad_y = y_pixel & ~1;
+    u32 quad_x = (u32)-1;
+    f32 lod = 0.0f;
+
+    PlaneRow row;
+    plane_row(setup, y, &row);
+
+    for(u32 x_pixel = setup->left_bb; x_pixel <= setup->right_bb; x_pixel++)
+    {
+      u32 index = row_offset + column_offsets[x_pixel];
+      f32 x = (f32)x_pixel;
+
+      if(pixel_inside(setup, x, y))
+      {
+        // Calculate depth value for this pixel
+        f32 depth = pixel_depth(setup, &row, x);
+
+        // Make sure this pixel has a lesser depth, or the one from the prepass
+        bool visible = depth_test == DEPTH_TEST_PREPASS ? depth <= depth_buffer[index] + prepass_bias : depth < depth_buffer[index];
+        if(visible)
+        {
+          f32 varyings[NUM_VARYINGS];
+          pixel_varyings(setup, &row, x, varyings);
+
+          if(texture && (x_pixel & ~1) != quad_x)
+          {
+            quad_x = x_pixel & ~1;
+            lod = quad_lod(setup, texture, quad_x, quad_y);
+          }
+
+          Color color = shade_pixel(varyings, tile_row + x_pixel / TILE_SIZE, draw_call, lod);
 
           // Set the pixel depth in the depth buffer
           depth_buffer[index] = depth;
 
           // Set the final pixel color
-          pixels[index] = color.pack();
+          queue_fragment(pixels, &queue, index, color);
+        }
+      }
+    }
+  }
+
+  flush_fragments(pixels, &queue);
+}
+
+// Rasterizes a set up triangle to a depth buffer only, a 2x2 quad at a time
+// The buffer is tiled like the frame buffers, with its own offset tables
+//
+// A quad is 4 contiguous depths in the tiled buffer. The edges and depth are
+// evaluated with the same operations in the same order as render_triangle,
+// so a pixel gets the depth the shading pass computes for it, up to the
+// rounding of fused multiply adds (see PREPASS_DEPTH_ULPS).
+static void render_triangle_depth(f32 *depth_buffer, const u32 *row_offsets, const u32 *column_offsets, const TriangleSetup *setup)
+{
+  // Pixel positions in a quad in buffer order, x first
+  __m128 quad_x = _mm_set_ps(1.0f, 0.0f, 1.0f, 0.0f);
+  __m128 quad_y = _mm_set_ps(1.0f, 1.0f, 0.0f, 0.0f);
+  __m128 zero = _mm_setzero_ps();
+
+  const EdgeEquation *edges[3] = {&setup->e0, &setup->e1, &setup->e2};
+  __m128 edge_a[3];
+  __m128 edge_b[3];
+  __m128 edge_c[3];
+  __m128 edge_tl[3];
+  for(u32 i = 0; i < 3; i++)
+  {
+    edge_a[i] = _mm_set1_ps(edges[i]->a);
+    edge_b[i] = _mm_set1_ps(edges[i]->b);
+    edge_c[i] = _mm_set1_ps(edges[i]->c);
+    edge_tl[i] = _mm_castsi128_ps(_mm_set1_epi32(edges[i]->tl ? -1 : 0));
+  }
+  __m128 depth_dx = _mm_set1_ps(setup->depth.dx);
+  __m128 depth_dy = _mm_set1_ps(setup->depth.dy);
+  __m128 depth_base = _mm_set1_ps(setup->depth.base);
+
+  // Quads can stick out of the bounding box by a pixel
+  __m128 left = _mm_set1_ps((f32)setup->left_bb);
+  __m128 bottom = _mm_set1_ps((f32)setup->bottom_bb);
+  __m128 right = _mm_set1_ps((f32)setup->right_bb);
+  __m128 top = _mm_set1_ps((f32)setup->top_bb);
+
+  for(u32 y_pixel = setup->bottom_bb & ~1; y_pixel <= setup->top_bb; y_pixel += 2)
+  {
+    __m128 y = _mm_add_ps(_mm_set1_ps((f32)y_pixel), quad_y);
+    __m128 rows_inside = _mm_and_ps(_mm_cmpge_ps(y, bottom), _mm_cmple_ps(y, top));
+    f32 *row = depth_buffer + row_offsets[y_pixel];
+
+    __m128 edge_rows[3];
+    for(u32 i = 0; i < 3; i++)
+    {
+      edge_rows[i] = _mm_mul_ps(edge_b[i], y);
+    }
+    __m128 depth_row = _mm_add_ps(_mm_mul_ps(depth_dy, y), depth_base);
+
+    for(u32 x_pixel = setup->left_bb & ~1; x_pixel <= setup->right_bb; x_pixel += 2)
+    {
+      __m128 x = _mm_add_ps(_mm_set1_ps((f32)x_pixel), quad_x);
+      __m128 mask = _mm_and_ps(rows_inside, _mm_and_ps(_mm_cmpge_ps(x, left), _mm_cmple_ps(x, right)));
+
+      // Inside if every edge is positive, or zero on a top left edge
+      for(u32 i = 0; i < 3; i++)
+      {
+        __m128 eval = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge_a[i], x), edge_rows[i]), edge_c[i]);
+        __m128 inside = _mm_or_ps(_mm_cmpgt_ps(eval, zero), _mm_and_ps(_mm_cmpeq_ps(eval, zero), edge_tl[i]));
+        mask = _mm_and_ps(mask, inside);
+      }
+      if(!_mm_movemask_ps(mask)) continue;
+
+      f32 *quad = row + column_offsets[x_pixel];
+      __m128 depth = _mm_add_ps(_mm_mul_ps(depth_dx, x), depth_row);
+      __m128 stored = _mm_load_ps(quad);
+      mask = _mm_and_ps(mask, _mm_cmplt_ps(depth, stored));
+      _mm_store_ps(quad, _mm_or_ps(_mm_and_ps(mask, depth), _mm_andnot_ps(mask, stored)));
+    }
+  }
+}
+
+// Composites a premultiplied BGRA8 color over another one
+static u32 premultiplied_over(u32 front, u32 back)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i src = _mm_unpacklo_epi8(_mm_cvtsi32_si128(front), zero);
+  __m128i dst = _mm_unpacklo_epi8(_mm_cvtsi32_si128(back), zero);
+  return _mm_cvtsi128_si32(_mm_packus_epi16(blend_pixels(src, dst, BLEND_MODE_PREMULTIPLIED), zero));
+}
+
+static u32 pack_premultiplied(Color color)
+{
+  f32 alpha = clamp(color.a, 0.0f, 1.0f);
+  Color premultiplied = Color(clamp(color.r, 0.0f, 1.0f) * alpha,
+                              clamp(color.g, 0.0f, 1.0f) * alpha,
+                              clamp(color.b, 0.0f, 1.0f) * alpha,
+                              alpha);
+  return premultiplied.pack();
+}
+
+// Adds a fragment to the sorted list of a pixel
+// When the list is full the farthest two fragments are merged, which keeps
+// the nearest layers exact and approximates the ones behind them
+static void insert_fragment(OitTile *tile, u32 pixel, f32 depth, u32 color)
+{
+  OitFragment *list = tile->fragments[pixel];
+  u32 count = tile->counts[pixel];
+
+  // Find where the fragment goes in the front to back order
+  u32 position = count;
+  while(position > 0 && list[position - 1].depth > depth) position--;
+
+  if(count == OIT_MAX_FRAGMENTS)
+  {
+    u32 last = OIT_MAX_FRAGMENTS - 1;
+    if(position == OIT_MAX_FRAGMENTS)
+    {
+      // Behind everything so it goes under the farthest fragment
+      list[last].color = premultiplied_over(list[last].color, color);
+      return;
+    }
+
+    // The farthest fragment is pushed off the end and goes under the new farthest one
+    u32 pushed_color = list[last].color;
+    for(u32 i = last; i > position; i--) list[i] = list[i - 1];
+    list[position].depth = depth;
+    list[position].color = color;
+    list[last].color = premultiplied_over(list[last].color, pushed_color);
+    return;
+  }
+
+  for(u32 i = count; i > position; i--) list[i] = list[i - 1];
+  list[position].depth = depth;
+  list[position].color = color;
+  tile->counts[pixel]++;
+}
 
+// Job that rasterizes the translucent triangles touching a tile into the tile's
+// fragment lists and composites them back to front over the opaque pixels
+// The binned triangles are in renderer_data, so the job takes no data
+static void resolve_translucent_tile(void *, u32 tile_index)
+{
+  const std::vector<u32> &triangles = renderer_data.tile_translucent_triangles[tile_index];
+  if(triangles.size() == 0) return;
+
+  u32 *pixels = renderer_data.color_buffer;
+  const f32 *depth_buffer = renderer_data.depth_buffer;
+
+  u32 tile_left = (tile_index % renderer_data.tiles_x) * TILE_SIZE;
+  u32 tile_bottom = (tile_index / renderer_data.tiles_x) * TILE_SIZE;
+  u32 tile_right = min((s32)(tile_left + TILE_SIZE), (s32)renderer_data.viewport_width) - 1;
+  u32 tile_top = min((s32)(tile_bottom + TILE_SIZE), (s32)renderer_data.viewport_height) - 1;
+
+  OitTile tile;
+  memset(tile.counts, 0, sizeof(tile.counts));
+
+  for(u32 i = 0; i < triangles.size(); i++)
+  {
+    const TranslucentTriangle &triangle = renderer_data.translucent_triangles[triangles[i]];
+    const TriangleSetup *setup = &triangle.setup;
+
+    u32 left = max((s32)setup->left_bb, (s32)tile_left);
+    u32 bottom = max((s32)setup->bottom_bb, (s32)tile_bottom);
+    u32 right = min((s32)setup->right_bb, (s32)tile_right);
+    u32 top = min((s32)setup->top_bb, (s32)tile_top);
+
+    for(u32 y_pixel = bottom; y_pixel <= top; y_pixel++)
+    {
+      f32 y = (f32)y_pixel;
+      u32 quad_x = (u32)-1;
+      f32 lod = 0.0f;
+
+      PlaneRow row;
+      plane_row(setup, y, &row);
+
+      for(u32 x_pixel = left; x_pixel <= right; x_pixel++)
+      {
+        f32 x = (f32)x_pixel;
 
-          renderer_data.pixel_info_buffer[index].x = x_pixel;
-          renderer_data.pixel_info_buffer[index].y = y_pixel;
-          renderer_data.pixel_info_buffer[index].final_color = color;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[0] = p0;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[1] = p1;
-          renderer_data.pixel_info_buffer[index].triangle_vertices[2] = p2;
+        if(!pixel_inside(setup, x, y)) continue;
+
+        // Only the opaque pixels are in the depth buffer
+        f32 depth = pixel_depth(setup, &row, x);
+        if(depth >= depth_buffer[pixel_offset(x_pixel, y_pixel)]) continue;
+
+        f32 varyings[NUM_VARYINGS];
+        pixel_varyings(setup, &row, x, varyings);
+
+        if(triangle.draw_call->model->texture && (x_pixel & ~1) != quad_x)
+        {
+          quad_x = x_pixel & ~1;
+          lod = quad_lod(setup, triangle.draw_call->model->texture, quad_x, y_pixel & ~1);
         }
+
+        Color color = shade_pixel(varyings, tile_index, triangle.draw_call, lod);
+
+        u32 pixel = (y_pixel - tile_bottom) * TILE_SIZE + (x_pixel - tile_left);
+        insert_fragment(&tile, pixel, depth, pack_premultiplied(color));
       }
+    }
+  }
 
-      // Evaluate the next pixel's edge equation values incrementally
-      eval0 += e0.a;
-      eval1 += e1.a;
-      eval2 += e2.a;
+  // Composite back to front over the opaque result
+  for(u32 y_pixel = tile_bottom; y_pixel <= tile_top; y_pixel++)
+  {
+    for(u32 x_pixel = tile_left; x_pixel <= tile_right; x_pixel++)
+    {
+      u32 pixel = (y_pixel - tile_bottom) * TILE_SIZE + (x_pixel - tile_left);
+      u32 count = tile.counts[pixel];
+      if(count == 0) continue;
 
-      // Barycentric coordinates incrementally
-      a += a_inc_x;
-      b += b_inc_x;
-      c += c_inc_x;
+      u32 index = pixel_offset(x_pixel, y_pixel);
+      u32 color = pixels[index];
+      for(u32 i = count; i > 0; i--)
+      {
+        color = premultiplied_over(tile.fragments[pixel][i - 1].color, color);
+      }
+      pixels[index] = color;
     }
+  }
+}
+
+// Saves a translucent triangle and adds it to the tiles it touches
+static void bin_translucent_triangle(const TriangleSetup *setup, const DrawCall *draw_call)
+{
+  TranslucentTriangle triangle;
+  triangle.setup = *setup;
+  triangle.draw_call = draw_call;
 
-    // Reset the evaluations of the incremental values in the x direction
-    eval0 = start_eval0;
-    eval1 = start_eval1;
-    eval2 = start_eval2;
-    a = start_a;
-    b = start_b;
-    c = start_c;
+  u32 triangle_index = renderer_data.translucent_triangles.size();
+  renderer_data.translucent_triangles.push_back(triangle);
 
-    // Compute the y values incrementally
-    eval0 += e0.b;
-    eval1 += e1.b;
-    eval2 += e2.b;
-    a += a_inc_y;
-    b += b_inc_y;
-    c += c_inc_y;
+  for(u32 y = setup->bottom_bb / TILE_SIZE; y <= setup->top_bb / TILE_SIZE; y++)
+  {
+    for(u32 x = setup->left_bb / TILE_SIZE; x <= setup->right_bb / TILE_SIZE; x++)
+    {
+      renderer_data.tile_translucent_triangles[y * renderer_data.tiles_x + x].push_back(triangle_index);
+    }
+  }
+}
+
+// Resolves the binned translucent triangles, with the tiles spread across the job threads
+static void resolve_translucent_triangles()
+{
+  if(renderer_data.translucent_triangles.size() == 0) return;
+
+  run_jobs(resolve_translucent_tile, 0, renderer_data.num_tiles);
+
+  renderer_data.translucent_triangles.clear();
+  for(u32 i = 0; i < renderer_data.num_tiles; i++)
+  {
+    renderer_data.tile_translucent_triangles[i].clear();
   }
 }
-#endif
 
 static void clip_polygon(ClipPlane plane, u32 num_in_points, Vertex *in_points, u32 *num_out_points, Vertex *out_points)
 {
@@ -818,10 +1840,14 @@ static void clip_polygon(ClipPlane plane, u32 num_in_points, Vertex *in_points,
     // Interpolate vertex
     v4 clipped_point = first.vertex + dist * (second.vertex - first.vertex);
     v3 clipped_normal = first.normal + dist * (second.normal - first.normal);
+    v3 clipped_view_position = first.view_position + dist * (second.view_position - first.view_position);
+    v2 clipped_texture_coord = first.texture_coord + dist * (second.texture_coord - first.texture_coord);
 
     Vertex clipped_vertex;
     clipped_vertex.vertex = clipped_point;
     clipped_vertex.normal = clipped_normal;
+    clipped_vertex.view_position = clipped_view_position;
+    clipped_vertex.texture_coord = clipped_texture_coord;
 
     out_points[*num_out_points] = clipped_vertex;
     (*num_out_points)++;
@@ -832,185 +1858,639 @@ static void clip_polygon(ClipPlane plane, u32 num_in_points, Vertex *in_points,
 
 
 
-void init_renderer(u32 *frame_buffer, u32 width, u32 height)
+// Finds the depth range of the geometry in each screen tile
+// This is conservative because it uses the bounding box and depth range of each triangle
+static void compute_tile_depth_bounds(const FramePacket *packet)
 {
-  renderer_data.frame_buffer = frame_buffer;
-  renderer_data.screen_width = width;
-  renderer_data.screen_height = height;
-  renderer_data.num_pixels = width * height;
-  renderer_data.aspect_ratio = (f32)width / (f32)height;
-
-
-
-  renderer_data.clear_color = Color(0.0f, 0.0f, 0.0f, 0.0f).pack();
-  clear_frame_buffer();
-
-  u32 size = renderer_data.num_pixels;
-  renderer_data.depth_buffer = new f32[size];
-  for(u32 i = 0; i < size; i++) renderer_data.depth_buffer[i] = 1.0f;
+  for(u32 i = 0; i < renderer_data.num_tiles; i++)
+  {
+    renderer_data.tile_min_depth[i] = 1.0f;
+    renderer_data.tile_max_depth[i] = 0.0f;
+  }
 
-  renderer_data.pixel_info_buffer = new PixelInfo[size];
+  const std::vector<Vertex> &vertices = packet->clipped_vertex_buffer;
+  const std::vector<u32> &indices = packet->clipped_index_buffer;
+  for(u32 i = 0; i < indices.size(); i += 3)
+  {
+    v4 p0 = vertices[indices[i + 0]].vertex;
+    v4 p1 = vertices[indices[i + 1]].vertex;
+    v4 p2 = vertices[indices[i + 2]].vertex;
 
-  renderer_data.model = new Model;
-  renderer_data.model->position = v3(0.0f, 0.0f, 0.0);
-  renderer_data.model->scale = v3(1.0f, 1.0f, 1.0f);
-  renderer_data.model->rotation = 0.0;
+    // Skip back facing triangles since they will never be shaded
+    f32 double_triangle_area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+    if(double_triangle_area <= 0.0f) continue;
 
-  renderer_data.camera_position = v3(0.0f, 0.0f, 5.0f);
-  renderer_data.camera_width = 60.0f;
-  renderer_data.proj_type = true;
-  renderer_data.near_plane = 1.0f;
-  renderer_data.far_plane = 10.0f;
+    u32 left_tile = (u32)min(p0.x, p1.x, p2.x) / TILE_SIZE;
+    u32 bottom_tile = (u32)min(p0.y, p1.y, p2.y) / TILE_SIZE;
+    u32 right_tile = min((s32)max(p0.x, p1.x, p2.x), (s32)renderer_data.viewport_width - 1) / TILE_SIZE;
+    u32 top_tile = min((s32)max(p0.y, p1.y, p2.y), (s32)renderer_data.viewport_height - 1) / TILE_SIZE;
 
-#if 1
-  load_obj("meshes/head.obj", &renderer_data.model->vertices, 0, 0, &renderer_data.model->vertex_indices);
-  normalize_mesh(&renderer_data.model->vertices);
-#else
-  v3 p0 = {-1.0f, -1.0f, 0.0f};
-  v3 p1 = { 1.0f, -1.0f, 0.0f};
-  v3 p2 = { 1.0f,  1.0f, 0.0f};
-  v3 p3 = {-1.0f,  1.0f, 0.0f};
-  //v3 p0 = {-1000.0f, -1000.0f, 0.0f};
-  //v3 p1 = { 1000.0f, -1000.0f, 0.0f};
-  //v3 p2 = { 1000.0f,  1000.0f, 0.0f};
-  //v3 p3 = {-1000.0f,  1000.0f, 0.0f};
-  renderer_data.model->vertices.push_back(p0);
-  renderer_data.model->vertices.push_back(p1);
-  renderer_data.model->vertices.push_back(p2);
-  renderer_data.model->vertices.push_back(p3);
-  renderer_data.model->vertex_indices.push_back(0);
-  renderer_data.model->vertex_indices.push_back(1);
-  renderer_data.model->vertex_indices.push_back(2);
-  renderer_data.model->vertex_indices.push_back(2);
-  renderer_data.model->vertex_indices.push_back(3);
-  renderer_data.model->vertex_indices.push_back(0);
-#endif
-  compute_vertex_normals(&renderer_data.model->vertices, &renderer_data.model->vertex_indices, &renderer_data.model->normals);
+    f32 min_depth = min(p0.z, p1.z, p2.z);
+    f32 max_depth = max(p0.z, p1.z, p2.z);
 
-  renderer_data.model->position = v3();
-  renderer_data.model->scale = v3(6, 6, 1.0f);
-  renderer_data.model->rotation = deg_to_rad(90);
+    for(u32 y = bottom_tile; y <= top_tile; y++)
+    {
+      for(u32 x = left_tile; x <= right_tile; x++)
+      {
+        u32 tile = y * renderer_data.tiles_x + x;
+        renderer_data.tile_min_depth[tile] = min(renderer_data.tile_min_depth[tile], min_depth);
+        renderer_data.tile_max_depth[tile] = max(renderer_data.tile_max_depth[tile], max_depth);
+      }
+    }
+  }
 }
 
-// glDrawArrays
-void render()
+// Maps a view space point to viewport space
+static v3 view_to_viewport(const mat4 &projection, v3 view_position)
 {
-  u32 screen_width = renderer_data.screen_width;
-  u32 screen_height = renderer_data.screen_height;
+  v4 clip = projection * v4(view_position, 1.0f);
+  v3 ndc = v3(clip.x, clip.y, clip.z) / clip.w;
+
+  v3 screen_pos;
+  screen_pos.x = (ndc.x + 1.0f) * (renderer_data.viewport_width / 2.0f);
+  screen_pos.y = (ndc.y + 1.0f) * (renderer_data.viewport_height / 2.0f);
+  screen_pos.z = (ndc.z + 1.0f) / 2.0f;
+  return screen_pos;
+}
 
-  clear_frame_buffer();
-  // Clear depth buffer
-  for(u32 i = 0; i < renderer_data.num_pixels; i++) renderer_data.depth_buffer[i] = 1.0f;
+// Transforms the lights to view space and builds the list of lights for each screen tile
+// A light is added to a tile if its bounding sphere overlaps the tile on screen and the
+// depth range of the geometry in that tile
+static void cull_lights(const FramePacket *packet)
+{
+  const mat4 &view = packet->view;
+  const mat4 &projection = packet->projection;
+  u32 num_lights = packet->lights.size();
+  u32 num_tiles = renderer_data.num_tiles;
 
-  // Clear pixel info buffer
-  for(u32 i = 0; i < renderer_data.num_pixels; i++) renderer_data.pixel_info_buffer[i] = PixelInfo();
+  renderer_data.view_lights.resize(num_lights);
+  renderer_data.global_lights.clear();
 
-  renderer_data.vertex_buffer.clear();
-  renderer_data.index_buffer.clear();
-  renderer_data.clipped_vertex_buffer.clear();
-  renderer_data.clipped_index_buffer.clear();
+  // Screen tile rectangle of each light, or an empty one if the light is not visible
+  struct LightTiles
+  {
+    u32 left, bottom, right, top;
+    f32 min_depth, max_depth;
+    bool visible;
+  };
+  std::vector<LightTiles> light_tiles(num_lights);
 
+  f32 near_z = -renderer_data.near_plane;
+  f32 far_z = -renderer_data.far_plane;
 
+  for(u32 i = 0; i < num_lights; i++)
+  {
+    const Light &light = packet->lights[i];
+    Light &view_light = renderer_data.view_lights[i];
+    LightTiles &tiles = light_tiles[i];
+    tiles.visible = false;
+
+    view_light = light;
+    v4 position = view * v4(light.position, 1.0f);
+    v4 direction = view * v4(light.direction, 0.0f);
+    view_light.position = v3(position.x, position.y, position.z);
+    view_light.direction = unit(v3(direction.x, direction.y, direction.z));
+
+    if(light.type == LIGHT_TYPE_DIRECTIONAL)
+    {
+      renderer_data.global_lights.push_back(i);
+      continue;
+    }
 
+    // The view space depth range of the light clamped to the view frustum
+    v3 center = view_light.position;
+    f32 radius = light.radius;
+    f32 closest_z = min(center.z + radius, near_z);
+    f32 farthest_z = max(center.z - radius, far_z);
+    if(closest_z < farthest_z) continue;
+
+    // Project the corners of the bounding box of the sphere (in front of the near plane)
+    // The projection of a box is bounded by the projection of its corners
+    v2 min_screen = v2(INFINITY, INFINITY);
+    v2 max_screen = v2(-INFINITY, -INFINITY);
+    for(u32 corner = 0; corner < 8; corner++)
+    {
+      v3 p;
+      p.x = (corner & 1) ? center.x + radius : center.x - radius;
+      p.y = (corner & 2) ? center.y + radius : center.y - radius;
+      p.z = (corner & 4) ? closest_z : farthest_z;
+
+      v3 screen_pos = view_to_viewport(projection, p);
+      min_screen.x = min(min_screen.x, screen_pos.x);
+      min_screen.y = min(min_screen.y, screen_pos.y);
+      max_screen.x = max(max_screen.x, screen_pos.x);
+      max_screen.y = max(max_screen.y, screen_pos.y);
+    }
 
-  // Copy model vertices and indices to vertex and index buffer
-  const Model *model = renderer_data.model;
-  for(u32 i = 0; i < model->vertices.size(); i++)
-  {
-    Vertex v;
-    v.vertex = v4(model->vertices[i], 1.0f);
-    v.normal = model->normals[i];
-    renderer_data.vertex_buffer.push_back(v);
+    if(max_screen.x < 0.0f || max_screen.y < 0.0f) continue;
+    if(min_screen.x >= renderer_data.viewport_width || min_screen.y >= renderer_data.viewport_height) continue;
+
+    min_screen.x = clamp(min_screen.x, 0.0f, (f32)(renderer_data.viewport_width - 1));
+    min_screen.y = clamp(min_screen.y, 0.0f, (f32)(renderer_data.viewport_height - 1));
+    max_screen.x = clamp(max_screen.x, 0.0f, (f32)(renderer_data.viewport_width - 1));
+    max_screen.y = clamp(max_screen.y, 0.0f, (f32)(renderer_data.viewport_height - 1));
+
+    tiles.left = (u32)min_screen.x / TILE_SIZE;
+    tiles.bottom = (u32)min_screen.y / TILE_SIZE;
+    tiles.right = (u32)max_screen.x / TILE_SIZE;
+    tiles.top = (u32)max_screen.y / TILE_SIZE;
+    tiles.min_depth = view_to_viewport(projection, v3(0.0f, 0.0f, closest_z)).z;
+    tiles.max_depth = view_to_viewport(projection, v3(0.0f, 0.0f, farthest_z)).z;
+    tiles.visible = true;
   }
-  for(u32 i = 0; i < model->vertex_indices.size(); i++)
+
+  // Count the lights in each tile, then turn the counts into offsets and fill in the indices
+  std::vector<u32> &offsets = renderer_data.tile_light_offsets;
+  std::vector<u32> &indices = renderer_data.tile_light_indices;
+  offsets.assign(num_tiles + 1, 0);
+
+  for(u32 pass = 0; pass < 2; pass++)
   {
-    renderer_data.index_buffer.push_back(model->vertex_indices[i]);
+    for(u32 i = 0; i < num_lights; i++)
+    {
+      const LightTiles &tiles = light_tiles[i];
+      if(!tiles.visible) continue;
+
+      for(u32 y = tiles.bottom; y <= tiles.top; y++)
+      {
+        for(u32 x = tiles.left; x <= tiles.right; x++)
+        {
+          u32 tile = y * renderer_data.tiles_x + x;
+
+          // Skip tiles where all the geometry is in front of or behind the light
+          if(tiles.min_depth > renderer_data.tile_max_depth[tile]) continue;
+          if(tiles.max_depth < renderer_data.tile_min_depth[tile]) continue;
+
+          if(pass == 0)
+          {
+            offsets[tile + 1]++;
+          }
+          else
+          {
+            indices[offsets[tile]++] = i;
+          }
+        }
+      }
+    }
+
+    if(pass == 0)
+    {
+      // Turn the counts into the first index of each tile. These are bumped while filling.
+      for(u32 tile = 0; tile < num_tiles; tile++) offsets[tile + 1] += offsets[tile];
+      indices.resize(offsets[num_tiles]);
+    }
   }
 
-  v3 position = renderer_data.model->position;
-  v3 scale = renderer_data.model->scale;
-  f32 rotation = renderer_data.model->rotation;
+  // Filling bumped each offset to the end of its tile, which is the start of the next one
+  for(u32 tile = num_tiles; tile > 0; tile--) offsets[tile] = offsets[tile - 1];
+  offsets[0] = 0;
+}
 
-  mat4 pos_mat = translation_mat(position);
-  mat4 scaling_mat = scale_mat(scale);
-  mat4 rot_mat = z_axis_rotation_mat(rotation);
-  mat4 world = pos_mat * rot_mat * scaling_mat;
 
-  // u
-  v3 right_axis = v3(1.0f, 0.0f, 0.0f);
-  // v
-  v3 up_axis = v3(0.0f, 1.0f, 0.0f);
-  // w
-  // This is looking away from the target
-  v3 target_axis = v3(0.0f, 0.0f, 1.0f);
-  mat4 view =
+u32 add_directional_light(v3 direction, v3 color)
+{
+  Light light = {};
+  light.shadow_map = NO_SHADOW_MAP;
+  light.type = LIGHT_TYPE_DIRECTIONAL;
+  light.direction = unit(direction);
+  light.color = color;
+  renderer_data.lights.push_back(light);
+  return renderer_data.lights.size() - 1;
+}
+
+u32 add_point_light(v3 position, v3 color, f32 radius)
+{
+  Light light = {};
+  light.shadow_map = NO_SHADOW_MAP;
+  light.type = LIGHT_TYPE_POINT;
+  light.position = position;
+  light.color = color;
+  light.radius = radius;
+  renderer_data.lights.push_back(light);
+  return renderer_data.lights.size() - 1;
+}
+
+u32 add_spot_light(v3 position, v3 direction, v3 color, f32 radius, f32 inner_angle, f32 outer_angle)
+{
+  Light light = {};
+  light.shadow_map = NO_SHADOW_MAP;
+  light.type = LIGHT_TYPE_SPOT;
+  light.position = position;
+  light.direction = unit(direction);
+  light.color = color;
+  light.radius = radius;
+  light.cos_inner_angle = (f32)cos(inner_angle);
+  light.cos_outer_angle = (f32)cos(outer_angle);
+  renderer_data.lights.push_back(light);
+  return renderer_data.lights.size() - 1;
+}
+
+void set_light_position(u32 light, v3 position)
+{
+  assert(light < renderer_data.lights.size());
+  renderer_data.lights[light].position = position;
+}
+
+void set_light_direction(u32 light, v3 direction)
+{
+  assert(light < renderer_data.lights.size());
+  renderer_data.lights[light].direction = unit(direction);
+}
+
+void set_light_shadows(u32 light, bool enabled)
+{
+  assert(light < renderer_data.lights.size());
+  renderer_data.lights[light].casts_shadows = enabled;
+}
+
+void clear_lights()
+{
+  renderer_data.lights.clear();
+}
+
+// Loads a model from name.obj through the mesh cache name.mesh and returns its index
+// The texture is name.dds or name.tga if there is one
+u32 load_model(const char *name)
+{
+  std::string path = name;
+
+  Model *model = new Model;
+  model->color = Color(0.8f, 0.0f, 1.0f);
+
+  model->mesh = MeshArrays();
+  model->bvh = 0;
+
+  // Drawn straight from the cache file, which is rebuilt when the obj file changes
+  model->mesh_cache = load_mesh_cache((path + ".obj").c_str(), (path + ".mesh").c_str(), MESH_VERTEX_FORMAT_QUANTIZED);
+  if(model->mesh_cache)
   {
-    right_axis.x,  right_axis.y,  right_axis.z,  -dot(right_axis, renderer_data.camera_position),
-    up_axis.x,     up_axis.y,     up_axis.z,     -dot(up_axis, renderer_data.camera_position),
-    target_axis.x, target_axis.y, target_axis.z, -dot(target_axis, renderer_data.camera_position),
-    0.0f, 0.0f, 0.0f, 1.0f,
-  };
-  mat4 ortho =
+    model->mesh = model->mesh_cache->arrays;
+  }
+
+  // The model is drawn with a solid color if it has no texture
+  // Prefer a texture that is already compressed. Otherwise compress it when loading.
+  model->texture = 0;
+  if(model->mesh.texture_coords)
   {
-    2.0f / renderer_data.camera_width, 0.0f, 0.0f, 0.0f,
-    0.0f, (2.0f * renderer_data.aspect_ratio) / renderer_data.camera_width, 0.0f, 0.0f,
-    0.0f, 0.0f, -1.0f, 0.0f,
+    model->texture = load_dds((path + ".dds").c_str());
+  }
+  if(!model->texture && model->mesh.texture_coords)
+  {
+    u32 texture_width;
+    u32 texture_height;
+    u32 *texels = load_tga((path + ".tga").c_str(), &texture_width, &texture_height);
+    if(texels)
+    {
+      model->texture = create_texture(texels, texture_width, texture_height, TEXTURE_FORMAT_BC1);
+    }
+    delete [] texels;
+  }
+
+  renderer_data.models.push_back(model);
+  return renderer_data.models.size() - 1;
+}
+
+u32 add_instance(u32 model, v3 position, v3 scale, f32 rotation)
+{
+  const MeshArrays *mesh = &renderer_data.models[model]->mesh;
+  return add_scene_instance(&renderer_data.scene, model, mesh->bounds_min, mesh->bounds_max, position, scale, rotation);
+}
+
+void set_instance_transform(u32 instance, v3 position, v3 scale, f32 rotation)
+{
+  set_scene_instance_transform(&renderer_data.scene, instance, position, scale, rotation);
+}
+
+// Transforms normals like the inverse transpose of the world matrix, without
+// the divide by the determinant since the normals are made unit length when shading
+static mat4 normal_world_mat(const mat4 &world)
+{
+  v3 x = v3(world[0][0], world[1][0], world[2][0]);
+  v3 y = v3(world[0][1], world[1][1], world[2][1]);
+  v3 z = v3(world[0][2], world[1][2], world[2][2]);
+
+  // The columns of the cofactor matrix, flipped for mirroring transforms
+  v3 cofactor_x = cross(y, z);
+  v3 cofactor_y = cross(z, x);
+  v3 cofactor_z = cross(x, y);
+  if(dot(x, cofactor_x) < 0.0f)
+  {
+    cofactor_x = -cofactor_x;
+    cofactor_y = -cofactor_y;
+    cofactor_z = -cofactor_z;
+  }
+
+  mat4 normal_world =
+  {
+    cofactor_x.x, cofactor_y.x, cofactor_z.x, 0.0f,
+    cofactor_x.y, cofactor_y.y, cofactor_z.y, 0.0f,
+    cofactor_x.z, cofactor_y.z, cofactor_z.z, 0.0f,
     0.0f, 0.0f, 0.0f, 1.0f
   };
+  return normal_world;
+}
 
-  // Distance from the near plane (must be positive)
-  f32 n = renderer_data.near_plane;
-  // Distance from the far plane (must be positive)
-  f32 f = renderer_data.far_plane;
-  f32 field_of_view = deg_to_rad(renderer_data.camera_width);
-  f32 r = -(f + n) / (f - n);
-  f32 s = -(2 * n * f) / (f - n);
-  mat4 persp = 
+void draw_instanced(u32 model, u32 num_instances, const mat4 *worlds, const v4 *colors)
+{
+  record_draw_instanced(renderer_data.immediate_commands, model, num_instances, worlds, colors);
+}
+
+// Fills the offset tables of a tiled buffer of tiles_x by tiles_y tiles
+// Tiles are in rows, the Morton order inside a tile interleaves the bits of x and y
+static void tile_offsets(u32 tiles_x, u32 tiles_y, u32 *column_offsets, u32 *row_offsets)
+{
+  u32 tile_pixels = FRAME_TILE_SIZE * FRAME_TILE_SIZE;
+  for(u32 x = 0; x < tiles_x * FRAME_TILE_SIZE; x++)
   {
-    (f32)(1.0f / tan(field_of_view / 2.0f)) / renderer_data.aspect_ratio, 0.0f, 0.0f, 0.0f,
-    0.0f, 1.0f / tan(field_of_view / 2.0f), 0.0f, 0.0f,
-    0.0f, 0.0f, r, s,
-    0.0f, 0.0f, -1.0f, 0.0f
-  };
+    u32 morton = (x & 1) | ((x & 2) << 1) | ((x & 4) << 2);
+    column_offsets[x] = (x / FRAME_TILE_SIZE) * tile_pixels + morton;
+  }
+  for(u32 y = 0; y < tiles_y * FRAME_TILE_SIZE; y++)
+  {
+    u32 morton = ((y & 1) << 1) | ((y & 2) << 2) | ((y & 4) << 3);
+    row_offsets[y] = (y / FRAME_TILE_SIZE) * tiles_x * tile_pixels + morton;
+  }
+}
 
-  mat4 projection;
-  if(renderer_data.proj_type == false)
+void init_renderer(u32 *frame_buffer, u32 width, u32 height)
+{
+  renderer_data.frame_buffer = frame_buffer;
+  renderer_data.screen_width = width;
+  renderer_data.screen_height = height;
+  renderer_data.num_pixels = width * height;
+  renderer_data.aspect_ratio = (f32)width / (f32)height;
+
+  renderer_data.frame_tiles_x = (width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+  renderer_data.frame_tiles_y = (height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+  renderer_data.buffer_pixels = renderer_data.frame_tiles_x * renderer_data.frame_tiles_y * FRAME_TILE_SIZE * FRAME_TILE_SIZE;
+
+  renderer_data.column_offsets = new u32[renderer_data.frame_tiles_x * FRAME_TILE_SIZE];
+  renderer_data.row_offsets = new u32[renderer_data.frame_tiles_y * FRAME_TILE_SIZE];
+  tile_offsets(renderer_data.frame_tiles_x, renderer_data.frame_tiles_y, renderer_data.column_offsets, renderer_data.row_offsets);
+
+  // Shadow maps are tiled the same way
+  u32 shadow_tiles = SHADOW_MAP_SIZE / FRAME_TILE_SIZE;
+  renderer_data.shadow_column_offsets = new u32[SHADOW_MAP_SIZE];
+  renderer_data.shadow_row_offsets = new u32[SHADOW_MAP_SIZE];
+  tile_offsets(shadow_tiles, shadow_tiles, renderer_data.shadow_column_offsets, renderer_data.shadow_row_offsets);
+  for(u32 i = 0; i < MAX_SHADOW_MAPS; i++)
   {
-    projection = ortho;
+    renderer_data.shadow_depths[i] = 0;
+  }
+  renderer_data.shadow_maps = 0;
+
+  for(u32 i = 0; i < NUM_FRAME_PACKETS; i++)
+  {
+    renderer_data.color_buffers[i] = (u32 *)allocate_pages(renderer_data.buffer_pixels * sizeof(u32));
+  }
+  renderer_data.color_buffer = renderer_data.color_buffers[0];
+  renderer_data.presented_color_buffer = renderer_data.color_buffers[NUM_FRAME_PACKETS - 1];
+  renderer_data.presented_width = width;
+  renderer_data.presented_height = height;
+  renderer_data.presented_version = 1;
+  renderer_data.swapped_version = 0;
+  renderer_data.scissor = screen_rect();
+  renderer_data.viewport_width = width;
+  renderer_data.viewport_height = height;
+  for(u32 i = 0; i < NUM_FRAME_PACKETS; i++)
+  {
+    renderer_data.frame_packets[i].width = width;
+    renderer_data.frame_packets[i].height = height;
+  }
+
+  renderer_data.resolution_scale = 1.0f;
+  renderer_data.target_frame_ms = 0.0f;
+  renderer_data.min_resolution_scale = 1.0f;
+
+  // Two columns at a time are upscaled, so there is room for one past the end
+  renderer_data.upscale_width = 0;
+  renderer_data.upscale_columns = new u32[width + 1];
+  renderer_data.upscale_next_columns = new u32[width + 1];
+  renderer_data.upscale_column_weights = new u16[(width + 1) * 4];
+
+  renderer_data.incremental_rendering = true;
+  renderer_data.clear_requested = false;
+  renderer_data.last_frame_hash = 0;
+  renderer_data.last_view_hash = 0;
+  renderer_data.last_dirty_rect = screen_rect();
+  renderer_data.frame_skipped = false;
+
+
+  renderer_data.clear_color = Color(0.0f, 0.0f, 0.0f, 0.0f).pack();
+  renderer_data.blend_mode = BLEND_MODE_OPAQUE;
+  renderer_data.transparency_mode = TRANSPARENCY_MODE_ORDER_INDEPENDENT;
+  renderer_data.lod_error_pixels = 1.0f;
+  renderer_data.depth_prepass = false;
+
+  // Frames are never larger than the screen
+  u32 occlusion_width = (width + OCCLUSION_PIXEL_SIZE - 1) / OCCLUSION_PIXEL_SIZE;
+  u32 occlusion_height = (height + OCCLUSION_PIXEL_SIZE - 1) / OCCLUSION_PIXEL_SIZE;
+  u32 occlusion_tiles_x = (occlusion_width + OCCLUSION_TILE_WIDTH - 1) / OCCLUSION_TILE_WIDTH;
+  u32 occlusion_tiles_y = (occlusion_height + OCCLUSION_TILE_HEIGHT - 1) / OCCLUSION_TILE_HEIGHT;
+  renderer_data.occlusion_culling = false;
+  renderer_data.occlusion_tiles = new OcclusionTile[occlusion_tiles_x * occlusion_tiles_y];
+
+  for(u32 i = 0; i < NUM_FRAME_PACKETS; i++)
+  {
+    clear_color_buffer(renderer_data.color_buffers[i]);
+  }
+
+  u32 size = renderer_data.buffer_pixels;
+  renderer_data.depth_buffer = (f32 *)allocate_pages(size * sizeof(f32));
+  clear_depth_buffer();
+
+  renderer_data.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+  renderer_data.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  renderer_data.num_tiles = renderer_data.tiles_x * renderer_data.tiles_y;
+  renderer_data.tile_min_depth = new f32[renderer_data.num_tiles];
+  renderer_data.tile_max_depth = new f32[renderer_data.num_tiles];
+  renderer_data.tile_translucent_triangles.resize(renderer_data.num_tiles);
+
+  init_job_system(0);
+
+  renderer_data.frame_index = 0;
+  renderer_data.frame_latency = 0;
+  renderer_data.back_end_packet = 0;
+  renderer_data.back_end_quitting = false;
+  renderer_data.back_end_thread = std::thread(back_end_thread);
+
+  renderer_data.immediate_commands = create_command_buffer();
+
+  renderer_data.camera_position = v3(0.0f, 0.0f, 5.0f);
+  renderer_data.camera_width = 60.0f;
+  renderer_data.proj_type = true;
+  renderer_data.near_plane = 1.0f;
+  renderer_data.far_plane = 10.0f;
+
+  f32 head_rotation = deg_to_rad(90);
+  u32 head = load_model("meshes/head");
+  renderer_data.controlled_instance = add_instance(head, v3(), v3(6, 6, 1.0f), head_rotation);
+
+  // Light shining straight into the screen
+  add_directional_light(v3(0.0f, 0.0f, -1.0f), v3(1.0f, 1.0f, 1.0f));
+}
+
+// Decodes 4 octahedral normals at once into x, y and z lanes
+static void decode_octahedral_normals(__m128i encoded, __m128 *x, __m128 *y, __m128 *z)
+{
+  __m128 scale = _mm_set1_ps(2.0f / 65535.0f);
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 sign_bit = _mm_set1_ps(-0.0f);
+
+  __m128i low_mask = _mm_set1_epi32(0xFFFF);
+  __m128 nx = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(encoded, low_mask)), scale), one);
+  __m128 ny = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(encoded, 16)), scale), one);
+  __m128 nz = _mm_sub_ps(_mm_sub_ps(one, _mm_andnot_ps(sign_bit, nx)), _mm_andnot_ps(sign_bit, ny));
+
+  // Unfold the bottom half by moving x and y towards zero by -z
+  __m128 t = _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), nz), _mm_setzero_ps());
+  nx = _mm_sub_ps(nx, _mm_or_ps(t, _mm_and_ps(nx, sign_bit)));
+  ny = _mm_sub_ps(ny, _mm_or_ps(t, _mm_and_ps(ny, sign_bit)));
+
+  __m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+  __m128 inv_length = _mm_div_ps(one, _mm_sqrt_ps(length_squared));
+  *x = _mm_mul_ps(nx, inv_length);
+  *y = _mm_mul_ps(ny, inv_length);
+  *z = _mm_mul_ps(nz, inv_length);
+}
+
+// Reads the vertices of a mesh into vertex buffer vertices, decoding quantized ones 4 at a time
+static void fetch_vertices(const MeshArrays *mesh, Vertex *vertices)
+{
+  u32 num_vertices = mesh->num_vertices;
+
+  if(mesh->vertex_format == MESH_VERTEX_FORMAT_FLOAT)
+  {
+    for(u32 i = 0; i < num_vertices; i++)
+    {
+      vertices[i].vertex = v4(mesh->positions[i], 1.0f);
+      vertices[i].normal = mesh->normals[i];
+    }
   }
   else
   {
-    projection = persp;
+    // The padding u16 of each position decodes to w = 1
+    __m128 scale = _mm_setr_ps(mesh->position_scale.x, mesh->position_scale.y, mesh->position_scale.z, 0.0f);
+    __m128 offset = _mm_setr_ps(mesh->bounds_min.x, mesh->bounds_min.y, mesh->bounds_min.z, 1.0f);
+    __m128i zero = _mm_setzero_si128();
+
+    const __m128i *positions = (const __m128i *)mesh->quantized_positions;
+    const __m128i *normals = (const __m128i *)mesh->octahedral_normals;
+
+    u32 i = 0;
+    for(; i + 4 <= num_vertices; i += 4)
+    {
+      // Two positions in each load
+      __m128i quantized01 = _mm_loadu_si128(positions++);
+      __m128i quantized23 = _mm_loadu_si128(positions++);
+      __m128 p0 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(quantized01, zero)), scale), offset);
+      __m128 p1 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(quantized01, zero)), scale), offset);
+      __m128 p2 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(quantized23, zero)), scale), offset);
+      __m128 p3 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(quantized23, zero)), scale), offset);
+      _mm_storeu_ps(&vertices[i + 0].vertex.x, p0);
+      _mm_storeu_ps(&vertices[i + 1].vertex.x, p1);
+      _mm_storeu_ps(&vertices[i + 2].vertex.x, p2);
+      _mm_storeu_ps(&vertices[i + 3].vertex.x, p3);
+
+      __m128 x, y, z;
+      decode_octahedral_normals(_mm_loadu_si128(normals++), &x, &y, &z);
+
+      f32 nx[4], ny[4], nz[4];
+      _mm_storeu_ps(nx, x);
+      _mm_storeu_ps(ny, y);
+      _mm_storeu_ps(nz, z);
+      for(u32 j = 0; j < 4; j++)
+      {
+        vertices[i + j].normal = v3(nx[j], ny[j], nz[j]);
+      }
+    }
+
+    // The last few vertices
+    for(; i < num_vertices; i++)
+    {
+      vertices[i].vertex = v4(mesh_position(mesh, i), 1.0f);
+      vertices[i].normal = mesh_normal(mesh, i);
+    }
   }
-  // Vertex shader (model space to clip space)
-  //time_block("1: vertex transformation");
-  for(u32 i = 0; i < renderer_data.vertex_buffer.size(); i++)
+
+  for(u32 i = 0; i < num_vertices; i++)
   {
-    v4 result = renderer_data.vertex_buffer[i].vertex;
-    result = world * result;
-    result = view * result;
-    result = projection * result;
-    renderer_data.vertex_buffer[i].vertex = result;
+    vertices[i].view_position = v3();
+    vertices[i].texture_coord = mesh->texture_coords ? mesh->texture_coords[i] : v2();
   }
-  //end_time_block();
-  
-  // Clipping
+}
+
+// Picks the least detailed LOD of a mesh whose error stays under lod_error_pixels on screen
+// The error is projected at the point of the bounding sphere closest to the camera
+// projection_scale is how much the projection scales view space y
+static u32 select_lod(const MeshArrays *mesh, const mat4 &world_view, f32 world_scale, f32 projection_scale, f32 lod_error_pixels)
+{
+  if(mesh->num_lods <= 1) return 0;
+
+  // Pixels for one view space unit at a distance of one, or anywhere in orthographic
+  f32 pixels_per_unit = projection_scale * renderer_data.screen_height * 0.5f;
+  if(renderer_data.proj_type == true)
+  {
+    v3 center = (mesh->bounds_min + mesh->bounds_max) * 0.5f;
+    f32 radius = length(mesh->bounds_max - center) * world_scale;
+    v4 view_center = world_view * v4(center, 1.0f);
+
+    // The camera looks down -z
+    f32 distance = max(-view_center.z - radius, renderer_data.near_plane);
+    pixels_per_unit /= distance;
+  }
+
+  u32 lod = mesh->num_lods - 1;
+  while(lod > 0 && mesh->lods[lod].error * world_scale * pixels_per_unit > lod_error_pixels)
+  {
+    lod--;
+  }
+  return lod;
+}
+
+// Vertex shader (model space to clip space) for vertices that share one transform
+// The matrix columns are multiplied by each coordinate 4 wide, adding in the
+// same order as the scalar matrix vector multiply
+static void transform_vertices(const Vertex *in, Vertex *out, u32 count, const mat4 &world_view, const mat4 &normal_view, const mat4 &projection)
+{
+  mat4_columns world_view_columns = matrix_columns(world_view);
+  mat4_columns normal_view_columns = matrix_columns(normal_view);
+  mat4_columns projection_columns = matrix_columns(projection);
+
+  for(u32 i = 0; i < count; i++)
+  {
+    // Positions have w = 1 and normals w = 0
+    __m128 view_position = transform_point(world_view_columns, in[i].vertex.x, in[i].vertex.y, in[i].vertex.z);
+    __m128 clip_position = transform_v4(projection_columns, view_position);
+    __m128 normal = transform_direction(normal_view_columns, in[i].normal.x, in[i].normal.y, in[i].normal.z);
+
+    _mm_storeu_ps(&out[i].vertex.x, clip_position);
+    store_v3(&out[i].normal, normal);
+    store_v3(&out[i].view_position, view_position);
+    out[i].texture_coord = in[i].texture_coord;
+  }
+}
+
+// Clips the triangles of a vertex buffer in clip space and adds them to the clipped buffers
+static void clip_triangles(const Vertex *vertices, const u32 *indices, u32 num_indices,
+                           std::vector<Vertex> *clipped_vertices, std::vector<u32> *clipped_indices)
+{
 #if 1
   //time_block("2: clipping");
   // For each triangle
-  for(u32 triangle_index = 0; triangle_index < renderer_data.index_buffer.size(); )
+  for(u32 triangle_index = 0; triangle_index < num_indices; )
   {
     // The three original triangle point indices
     u32 point_indices[3];
-    point_indices[0] = renderer_data.index_buffer[triangle_index++];
-    point_indices[1] = renderer_data.index_buffer[triangle_index++];
-    point_indices[2] = renderer_data.index_buffer[triangle_index++];
+    point_indices[0] = indices[triangle_index++];
+    point_indices[1] = indices[triangle_index++];
+    point_indices[2] = indices[triangle_index++];
 
     // The three original triangle points
     Vertex points[3];
-    points[0] = renderer_data.vertex_buffer[point_indices[0]];
-    points[1] = renderer_data.vertex_buffer[point_indices[1]];
-    points[2] = renderer_data.vertex_buffer[point_indices[2]];
+    points[0] = vertices[point_indices[0]];
+    points[1] = vertices[point_indices[1]];
+    points[2] = vertices[point_indices[2]];
 
 #if 0
     u8 point_grid_positions[3];
@@ -1073,151 +2553,2119 @@ void render()
     {
       for(u32 i = 0; i < num_a_points; i++)
       {
-        renderer_data.clipped_vertex_buffer.push_back(a_points[i]);
+        clipped_vertices->push_back(a_points[i]);
       }
-      u32 start_index = renderer_data.clipped_vertex_buffer.size() - num_a_points;
+      u32 start_index = clipped_vertices->size() - num_a_points;
       for(u32 i = 1; i < num_a_points - 1; i++)
       {
-        renderer_data.clipped_index_buffer.push_back(start_index);
-        renderer_data.clipped_index_buffer.push_back(start_index + i);
-        renderer_data.clipped_index_buffer.push_back(start_index + i + 1);
+        clipped_indices->push_back(start_index);
+        clipped_indices->push_back(start_index + i);
+        clipped_indices->push_back(start_index + i + 1);
       }
     }
   }
   //end_time_block();
 #else // Clipping
+  u32 base_vertex = clipped_vertices->size();
   for(u32 i = 0; i < renderer_data.vertex_buffer.size(); i++)
   {
-    renderer_data.clipped_vertex_buffer.push_back(renderer_data.vertex_buffer[i]);
+    clipped_vertices->push_back(renderer_data.vertex_buffer[i]);
   }
-  for(u32 i = 0; i < renderer_data.index_buffer.size(); i++)
+  for(u32 i = 0; i < num_indices; i++)
   {
-    renderer_data.clipped_index_buffer.push_back(renderer_data.index_buffer[i]);
+    clipped_indices->push_back(base_vertex + indices[i]);
   }
 
 #endif // Clipping
+}
 
+// The bits of a tile row from pixel first to pixel last, clamped to the tile
+static u32 occlusion_row_bits(s32 first, s32 last)
+{
+  first = max(first, 0);
+  last = min(last, OCCLUSION_TILE_WIDTH - 1);
+  if(first > last) return 0;
 
-  // Perspective division (clip space to ndc space)
-  //time_block("3: perspective division");
-  for(u32 i = 0; i < renderer_data.clipped_vertex_buffer.size(); i++)
+  return (0xFFFFFFFF << first) & (0xFFFFFFFF >> (OCCLUSION_TILE_WIDTH - 1 - last));
+}
+
+// Starts the covered pixels of a tile again with only the ones outside the buffer
+static void reset_occlusion_mask(OcclusionTile *tile, u32 tile_x, u32 tile_y)
+{
+  s32 inside_width = renderer_data.occlusion_width - tile_x * OCCLUSION_TILE_WIDTH;
+  for(u32 row = 0; row < OCCLUSION_TILE_HEIGHT; row++)
   {
-    renderer_data.clipped_vertex_buffer[i].vertex /= renderer_data.clipped_vertex_buffer[i].vertex.w; 
+    u32 y = tile_y * OCCLUSION_TILE_HEIGHT + row;
+    tile->mask[row] = y < renderer_data.occlusion_height ? ~occlusion_row_bits(0, inside_width - 1) : 0xFFFFFFFF;
   }
-  //end_time_block();
+  tile->mask_depth = 0.0f;
+}
 
-  // Viewport transform (ndc space to viewport space)
-  // Transform the vertex buffer
-  //time_block("4: viewport transform");
-  for(u32 i = 0; i < renderer_data.clipped_vertex_buffer.size(); i++)
+// Sizes the occlusion buffer for a frame of width by height pixels and clears it
+static void clear_occlusion_buffer(u32 width, u32 height)
+{
+  renderer_data.occlusion_width = (width + OCCLUSION_PIXEL_SIZE - 1) / OCCLUSION_PIXEL_SIZE;
+  renderer_data.occlusion_height = (height + OCCLUSION_PIXEL_SIZE - 1) / OCCLUSION_PIXEL_SIZE;
+  renderer_data.occlusion_tiles_x = (renderer_data.occlusion_width + OCCLUSION_TILE_WIDTH - 1) / OCCLUSION_TILE_WIDTH;
+  renderer_data.occlusion_tiles_y = (renderer_data.occlusion_height + OCCLUSION_TILE_HEIGHT - 1) / OCCLUSION_TILE_HEIGHT;
+  renderer_data.occlusion_scale_x = width / (2.0f * OCCLUSION_PIXEL_SIZE);
+  renderer_data.occlusion_scale_y = height / (2.0f * OCCLUSION_PIXEL_SIZE);
+
+  for(u32 tile_y = 0; tile_y < renderer_data.occlusion_tiles_y; tile_y++)
   {
-    // Map the ndc to the screen coordinates
-    v4 ndc = renderer_data.clipped_vertex_buffer[i].vertex;
-
-    if(ndc.x < -1.0f || ndc.x > 1.0f)
-    {
-      log_file("ndc.x = %f, x should be between -1 and 1\n", ndc.x);
-      assert(0);
-    }
-    if(ndc.y < -1.0f || ndc.y > 1.0f)
-    {
-      log_file("ndc.y = %f, y should be between -1 and 1\n", ndc.y);
-      assert(0);
-    }
-    if(ndc.z < -1.0f || ndc.z > 1.0f)
+    for(u32 tile_x = 0; tile_x < renderer_data.occlusion_tiles_x; tile_x++)
     {
-      log_file("ndc.z = %f, z should be between -1 and 1\n", ndc.z);
-      assert(0);
+      OcclusionTile *tile = &renderer_data.occlusion_tiles[tile_y * renderer_data.occlusion_tiles_x + tile_x];
+      tile->depth = 1.0f;
+      reset_occlusion_mask(tile, tile_x, tile_y);
     }
+  }
+}
 
+// Merges the pixels a triangle covers in a tile, depth is the farthest the triangle is in the tile
+static void update_occlusion_tile(OcclusionTile *tile, u32 tile_x, u32 tile_y, const u32 coverage[OCCLUSION_TILE_HEIGHT], f32 depth)
+{
+  // It can not bring anything in the tile closer
+  if(depth >= tile->depth) return;
 
-    ndc += v4(1.0f, 1.0f, 0.0f, 0.0f);
-
-    v4 screen_pos;
-    screen_pos.x = ndc.x * (screen_width / 2.0f);
-    screen_pos.y = ndc.y * (screen_height / 2.0f);
-    screen_pos.z = (ndc.z + 1.0f) / 2.0f;
-    screen_pos.w = ndc.w;
-
-#if 0
-    if(screen_pos.x < 0) screen_pos.x += 0.5f;
-    if(screen_pos.x >= screen_width) screen_pos.x -= 0.5f;
-    if(screen_pos.y < 0) screen_pos.y += 0.5f;
-    if(screen_pos.y >= screen_height) screen_pos.y -= 0.5f;
-#endif
-
-
-    renderer_data.clipped_vertex_buffer[i].vertex = screen_pos;
+  // A triangle much closer than the covered pixels starts them again, instead
+  // of taking on their farther depth
+  if(tile->mask_depth - depth > tile->depth - tile->mask_depth)
+  {
+    reset_occlusion_mask(tile, tile_x, tile_y);
   }
-  //end_time_block();
 
+  tile->mask_depth = max(tile->mask_depth, depth);
+  u32 full = 0xFFFFFFFF;
+  for(u32 row = 0; row < OCCLUSION_TILE_HEIGHT; row++)
+  {
+    tile->mask[row] |= coverage[row];
+    full &= tile->mask[row];
+  }
 
+  if(full == 0xFFFFFFFF)
+  {
+    tile->depth = min(tile->depth, tile->mask_depth);
+    reset_occlusion_mask(tile, tile_x, tile_y);
+  }
+}
 
+// Rasterizes an occluder triangle in viewport space into the occlusion buffer
+//
+// Occlusion pixels are sampled at their centers, and a tile gets the farthest
+// depth of the triangle in it. Each row of pixels is a span between the edges
+// of the triangle, which becomes the bits of the row in each tile.
+static void rasterize_occluder(v4 p0, v4 p1, v4 p2)
+{
+  f32 scale = 1.0f / OCCLUSION_PIXEL_SIZE;
+  TriangleSetup setup;
+  setup.p0 = v3(p0.x * scale, p0.y * scale, p0.z);
+  setup.p1 = v3(p1.x * scale, p1.y * scale, p1.z);
+  setup.p2 = v3(p2.x * scale, p2.y * scale, p2.z);
+  setup.e0 = edge_equation(setup.p1, setup.p2);
+  setup.e1 = edge_equation(setup.p2, setup.p0);
+  setup.e2 = edge_equation(setup.p0, setup.p1);
+
+  // Back facing triangles are behind front facing ones of the same model
+  f32 double_triangle_area = setup.e0.c + setup.e1.c + setup.e2.c;
+  if(double_triangle_area <= 0.0f) return;
+
+  setup.depth = attribute_plane(&setup, 1.0f / double_triangle_area, p0.z, p1.z, p2.z);
+  f32 max_depth = min(max(p0.z, p1.z, p2.z), 1.0f);
+
+  // The pixels with their centers inside the bounds of the triangle
+  s32 width = renderer_data.occlusion_width;
+  s32 height = renderer_data.occlusion_height;
+  s32 left = max((s32)ceilf(min(setup.p0.x, setup.p1.x, setup.p2.x) - 0.5f), 0);
+  s32 bottom = max((s32)ceilf(min(setup.p0.y, setup.p1.y, setup.p2.y) - 0.5f), 0);
+  s32 right = min((s32)floorf(max(setup.p0.x, setup.p1.x, setup.p2.x) - 0.5f), width - 1);
+  s32 top = min((s32)floorf(max(setup.p0.y, setup.p1.y, setup.p2.y) - 0.5f), height - 1);
+  if(left > right || bottom > top) return;
+
+  const EdgeEquation *edges[3] = {&setup.e0, &setup.e1, &setup.e2};
+  for(s32 tile_y = bottom / OCCLUSION_TILE_HEIGHT; tile_y <= top / OCCLUSION_TILE_HEIGHT; tile_y++)
+  {
+    s32 span_left[OCCLUSION_TILE_HEIGHT];
+    s32 span_right[OCCLUSION_TILE_HEIGHT];
+    for(u32 row = 0; row < OCCLUSION_TILE_HEIGHT; row++)
+    {
+      s32 y = tile_y * OCCLUSION_TILE_HEIGHT + row;
+      span_left[row] = left;
+      span_right[row] = (y < bottom || y > top) ? -1 : right;
 
+      // Each edge is zero at one x along the row, the centers on one side of it are inside
+      for(u32 i = 0; i < 3; i++)
+      {
+        const EdgeEquation *edge = edges[i];
+        f32 row_value = edge->b * (y + 0.5f) + edge->c;
+        if(edge->a > 0.0f)
+        {
+          f32 x = clamp(-row_value / edge->a - 0.5f, -1.0f, (f32)width);
+          span_left[row] = max(span_left[row], (s32)ceilf(x));
+        }
+        else if(edge->a < 0.0f)
+        {
+          f32 x = clamp(-row_value / edge->a - 0.5f, -1.0f, (f32)width);
+          span_right[row] = min(span_right[row], (s32)floorf(x));
+        }
+        else if(row_value < 0.0f)
+        {
+          span_right[row] = -1;
+        }
+      }
+    }
 
-  // Rasterize triangles in buffers
-  u32 *pixels = renderer_data.frame_buffer;
+    f32 y_low = (f32)max(tile_y * OCCLUSION_TILE_HEIGHT, bottom);
+    f32 y_high = (f32)min((tile_y + 1) * OCCLUSION_TILE_HEIGHT, top + 1);
+    for(s32 tile_x = left / OCCLUSION_TILE_WIDTH; tile_x <= right / OCCLUSION_TILE_WIDTH; tile_x++)
+    {
+      s32 tile_left = tile_x * OCCLUSION_TILE_WIDTH;
+      u32 coverage[OCCLUSION_TILE_HEIGHT];
+      u32 covered = 0;
+      for(u32 row = 0; row < OCCLUSION_TILE_HEIGHT; row++)
+      {
+        coverage[row] = occlusion_row_bits(span_left[row] - tile_left, span_right[row] - tile_left);
+        covered |= coverage[row];
+      }
+      if(!covered) continue;
 
+      // The farthest depth of the plane over the bounds in the tile is at one of their corners
+      f32 x_low = (f32)max(tile_left, left);
+      f32 x_high = (f32)min(tile_left + OCCLUSION_TILE_WIDTH, right + 1);
+      f32 x = setup.depth.dx > 0.0f ? x_high : x_low;
+      f32 y = setup.depth.dy > 0.0f ? y_high : y_low;
+      f32 depth = min(evaluate_plane(setup.depth, x, y), max_depth);
 
-  const std::vector<Vertex> &vertices = renderer_data.clipped_vertex_buffer;
-  const std::vector<u32> &indices = renderer_data.clipped_index_buffer;
+      OcclusionTile *tile = &renderer_data.occlusion_tiles[tile_y * renderer_data.occlusion_tiles_x + tile_x];
+      update_occlusion_tile(tile, tile_x, tile_y, coverage, depth);
+    }
+  }
+}
 
-  //time_block("5: draw all triangles");
-  for(u32 i = 0; i < indices.size(); )
+// The occlusion pixels a box covers on screen and its closest depth, the
+// transform takes its corners to clip space. Returns false if some of the box
+// is in front of the near plane, so it could cover any part of the screen.
+static bool project_box(const mat4 &box_to_clip, v3 box_min, v3 box_max, ScreenRect *rect, f32 *depth)
+{
+  f32 min_x = INFINITY;
+  f32 min_y = INFINITY;
+  f32 min_z = INFINITY;
+  f32 max_x = -INFINITY;
+  f32 max_y = -INFINITY;
+  v3 corners[8];
+  for(u32 i = 0; i < 8; i++)
   {
-    v3 v[3];
-    v3 n[3];
-
-    u32 index = indices[i++];
-    v3 vertex = v3(vertices[index].vertex.x, vertices[index].vertex.y, vertices[index].vertex.z);
-    v[0] = vertex;
-    n[0] = vertices[index].normal;
+    corners[i] = v3((i & 1) ? box_max.x : box_min.x, (i & 2) ? box_max.y : box_min.y, (i & 4) ? box_max.z : box_min.z);
+  }
+  v4 clip_corners[8];
+  transform_points(box_to_clip, corners, clip_corners, 8);
 
-    index = indices[i++];
-    vertex = v3(vertices[index].vertex.x, vertices[index].vertex.y, vertices[index].vertex.z);
-    v[1] = vertex;
-    n[1] = vertices[index].normal;
+  for(u32 i = 0; i < 8; i++)
+  {
+    v4 clip = clip_corners[i];
+    if(clip.z < -clip.w) return false;
+
+    f32 inv_w = 1.0f / clip.w;
+    min_x = min(min_x, clip.x * inv_w);
+    min_y = min(min_y, clip.y * inv_w);
+    min_z = min(min_z, clip.z * inv_w);
+    max_x = max(max_x, clip.x * inv_w);
+    max_y = max(max_y, clip.y * inv_w);
+  }
 
-    index = indices[i++];
-    vertex = v3(vertices[index].vertex.x, vertices[index].vertex.y, vertices[index].vertex.z);
-    v[2] = vertex;
-    n[2] = vertices[index].normal;
+  // Occluders are sampled at the pixel centers, so they can cover up to half
+  // a pixel past their edges. The rect has one more pixel on each side to
+  // reach a pixel that shows what is past the edge.
+  // Boxes past the sides of the screen are clamped to them.
+  f32 scale_x = renderer_data.occlusion_scale_x;
+  f32 scale_y = renderer_data.occlusion_scale_y;
+  rect->left = max((s32)floorf((clamp(min_x, -1.0f, 1.0f) + 1.0f) * scale_x) - 1, 0);
+  rect->bottom = max((s32)floorf((clamp(min_y, -1.0f, 1.0f) + 1.0f) * scale_y) - 1, 0);
+  rect->right = min((s32)ceilf((clamp(max_x, -1.0f, 1.0f) + 1.0f) * scale_x), (s32)renderer_data.occlusion_width - 1);
+  rect->top = min((s32)ceilf((clamp(max_y, -1.0f, 1.0f) + 1.0f) * scale_y), (s32)renderer_data.occlusion_height - 1);
+  *depth = (min_z + 1.0f) * 0.5f - OCCLUSION_DEPTH_BIAS;
+  return true;
+}
 
+// Whether a box is completely behind the occluders, the transform takes its corners to clip space
+static bool box_occluded(const mat4 &box_to_clip, v3 box_min, v3 box_max)
+{
+  ScreenRect rect;
+  f32 depth;
+  if(!project_box(box_to_clip, box_min, box_max, &rect, &depth)) return false;
+  if(rect.left > rect.right || rect.bottom > rect.top) return false;
 
+  for(s32 tile_y = rect.bottom / OCCLUSION_TILE_HEIGHT; tile_y <= rect.top / OCCLUSION_TILE_HEIGHT; tile_y++)
+  {
+    for(s32 tile_x = rect.left / OCCLUSION_TILE_WIDTH; tile_x <= rect.right / OCCLUSION_TILE_WIDTH; tile_x++)
+    {
+      const OcclusionTile *tile = &renderer_data.occlusion_tiles[tile_y * renderer_data.occlusion_tiles_x + tile_x];
+      if(depth > tile->depth) continue;
 
+      // Otherwise the covered pixels have to be in front of the box and cover all of it in the tile
+      if(depth <= tile->mask_depth) return false;
 
-    if(renderer_data.mode == RENDER_MODE_TRIANGLES)
-    {
-      //time_block("6: rasterize triangle");
-      render_triangle(pixels, v[0], v[1], v[2], n, 0);
-      ////end_time_block();
-    }
-    else
-    {
-      render_line_bresenham((u32)v[0].x, (u32)v[0].y, (u32)v[1].x, (u32)v[1].y, Color(0.0f, 0.0f, 1.0f));
-      render_line_bresenham((u32)v[1].x, (u32)v[1].y, (u32)v[2].x, (u32)v[2].y, Color(0.0f, 0.0f, 1.0f));
-      render_line_bresenham((u32)v[2].x, (u32)v[2].y, (u32)v[0].x, (u32)v[0].y, Color(0.0f, 0.0f, 1.0f));
+      s32 tile_left = tile_x * OCCLUSION_TILE_WIDTH;
+      u32 bits = occlusion_row_bits(rect.left - tile_left, rect.right - tile_left);
+      for(u32 row = 0; row < OCCLUSION_TILE_HEIGHT; row++)
+      {
+        s32 y = tile_y * OCCLUSION_TILE_HEIGHT + row;
+        if(y >= rect.bottom && y <= rect.top && (bits & ~tile->mask[row])) return false;
+      }
     }
-
   }
-  //end_time_block();
-
-  update_stuff();
+  return true;
 }
 
-// glClear
-void clear_frame_buffer()
+// The indices of the LOD an instance is drawn with for its size on screen, read straight from the mesh
+static void instance_lod(const MeshArrays *mesh, const mat4 &world, const mat4 &world_view, const mat4 &projection,
+                         f32 lod_error_pixels, u32 *first_index, u32 *num_indices)
 {
-  u32 *pixels = renderer_data.frame_buffer;
+  *first_index = 0;
+  *num_indices = mesh->num_indices;
+  if(!mesh->num_lods) return;
 
-  for(u32 i = 0; i < renderer_data.num_pixels; i++)
+  f32 world_scale = 0.0f;
+  for(u32 column = 0; column < 3; column++)
   {
-    pixels[i] = renderer_data.clear_color;
+    world_scale = max(world_scale, length(v3(world[0][column], world[1][column], world[2][column])));
   }
+  const MeshLod *lod = &mesh->lods[select_lod(mesh, world_view, world_scale, projection[1][1], lod_error_pixels)];
+  *first_index = lod->first_index;
+  *num_indices = lod->num_indices;
 }
 
-void swap_buffers()
+// Draws that hide what is behind them, they go through the depth prepass and
+// cast shadows. Blended draws are shaded in order with the less test.
+static bool draw_is_opaque(const DrawCall *draw_call)
 {
+  return draw_call->blend_mode == BLEND_MODE_OPAQUE && draw_call->color.a >= 1.0f;
+}
+
+// Draws the instances of one model. The vertices are decoded once, and each
+// instance that is in the frustum is transformed and clipped as a draw call.
+// Instances that were already culled pass no frustum.
+//
+// With occlusion culling, instances behind the occluders are skipped, and of
+// the ones drawn with the full mesh only the meshlets that are not behind them
+// are clipped. Hidden instances still cast shadows.
+static void transform_and_clip_instances(const CommandBuffer *buffer, const InstancedDraw *draw, const mat4 &view, const mat4 &projection,
+                                         const Frustum *frustum, const DrawState *state)
+{
+  const Model *model = renderer_data.models[draw->model];
+  const MeshArrays *mesh = &model->mesh;
+  if(!mesh->num_vertices) return;
+
+  renderer_data.model_vertices.resize(mesh->num_vertices);
+  renderer_data.vertex_buffer.resize(mesh->num_vertices);
+  fetch_vertices(mesh, &renderer_data.model_vertices[0]);
+
+  //time_block("1: vertex transformation");
+  for(u32 i = draw->first_instance; i < draw->first_instance + draw->num_instances; i++)
+  {
+    const mat4 &world = buffer->instance_worlds[i];
+    v3 world_min;
+    v3 world_max;
+    if(frustum || renderer_data.front_packet->shadows)
+    {
+      transform_bounds(world, mesh->bounds_min, mesh->bounds_max, &world_min, &world_max);
+    }
+    if(frustum)
+    {
+      u32 plane_mask = ALL_FRUSTUM_PLANES;
+      if(!box_in_frustum(frustum, world_min, world_max, &plane_mask)) continue;
+    }
+
+    mat4 world_view = view * world;
+    mat4 normal_view = view * buffer->instance_normal_worlds[i];
+
+    u32 first_index;
+    u32 num_indices;
+    instance_lod(mesh, world, world_view, projection, state->lod_error_pixels, &first_index, &num_indices);
+
+    FramePacket *packet = renderer_data.front_packet;
+    DrawCall draw_call;
+    draw_call.model = model;
+    draw_call.color = buffer->instance_colors[i];
+    draw_call.blend_mode = state->blend_mode;
+    draw_call.transparency_mode = state->transparency_mode;
+
+    if(packet->shadows && draw_is_opaque(&draw_call))
+    {
+      ShadowCaster caster;
+      caster.model = model;
+      caster.world = world;
+      caster.world_min = world_min;
+      caster.world_max = world_max;
+      caster.first_index = first_index;
+      caster.num_indices = num_indices;
+      packet->shadow_casters.push_back(caster);
+    }
+
+    mat4 model_to_clip = projection * world_view;
+    bool occlusion_culling = renderer_data.occlusion_culling;
+    if(occlusion_culling && box_occluded(model_to_clip, mesh->bounds_min, mesh->bounds_max)) continue;
+
+    u32 first_clipped_index = packet->clipped_index_buffer.size();
+    u32 first_clipped_vertex = packet->clipped_vertex_buffer.size();
+    transform_vertices(&renderer_data.model_vertices[0], &renderer_data.vertex_buffer[0], mesh->num_vertices, world_view, normal_view, projection);
+    if(occlusion_culling && mesh->meshlets && first_index == 0 && num_indices == mesh->num_indices)
+    {
+      // The meshlets follow each other in the indices, so runs of visible ones are clipped together
+      u32 run_first_index = 0;
+      u32 run_num_indices = 0;
+      for(u32 j = 0; j <= mesh->num_meshlets; j++)
+      {
+        const Meshlet *meshlet = j < mesh->num_meshlets ? &mesh->meshlets[j] : 0;
+        if(meshlet)
+        {
+          v3 extent = v3(meshlet->radius, meshlet->radius, meshlet->radius);
+          if(!box_occluded(model_to_clip, meshlet->center - extent, meshlet->center + extent))
+          {
+            if(!run_num_indices) run_first_index = meshlet->first_index;
+            run_num_indices += meshlet->num_indices;
+            continue;
+          }
+        }
+
+        if(run_num_indices)
+        {
+          clip_triangles(&renderer_data.vertex_buffer[0], mesh->indices + run_first_index, run_num_indices,
+                         &packet->clipped_vertex_buffer, &packet->clipped_index_buffer);
+          run_num_indices = 0;
+        }
+      }
+    }
+    else
+    {
+      clip_triangles(&renderer_data.vertex_buffer[0], mesh->indices + first_index, num_indices, &packet->clipped_vertex_buffer, &packet->clipped_index_buffer);
+    }
+
+    draw_call.first_index = first_clipped_index;
+    draw_call.num_indices = packet->clipped_index_buffer.size() - first_clipped_index;
+    draw_call.first_vertex = first_clipped_vertex;
+    draw_call.num_vertices = packet->clipped_vertex_buffer.size() - first_clipped_vertex;
+
+    // The LOD follows from the world matrix and the LOD error
+    u64 key = hash_memory(draw->model, &world, sizeof(world));
+    key = hash_memory(key, &draw_call.color, sizeof(draw_call.color));
+    key = hash_memory(key, state, sizeof(*state));
+
+    // Blended draws also depend on what was drawn before them
+    if(draw_call.blend_mode != BLEND_MODE_OPAQUE || (draw_call.color.a < 1.0f && draw_call.transparency_mode == TRANSPARENCY_MODE_BLEND))
+    {
+      u32 position = packet->draw_calls.size();
+      key = hash_memory(key, &position, sizeof(position));
+    }
+    draw_call.key = key;
+
+    packet->draw_calls.push_back(draw_call);
+  }
+  //end_time_block();
+}
+
+// The view and projection matrices of the camera
+static void camera_matrices(mat4 *view_out, mat4 *projection_out)
+{
+  // u
+  v3 right_axis = v3(1.0f, 0.0f, 0.0f);
+  // v
+  v3 up_axis = v3(0.0f, 1.0f, 0.0f);
+  // w
+  // This is looking away from the target
+  v3 target_axis = v3(0.0f, 0.0f, 1.0f);
+  mat4 view =
+  {
+    right_axis.x,  right_axis.y,  right_axis.z,  -dot(right_axis, renderer_data.camera_position),
+    up_axis.x,     up_axis.y,     up_axis.z,     -dot(up_axis, renderer_data.camera_position),
+    target_axis.x, target_axis.y, target_axis.z, -dot(target_axis, renderer_data.camera_position),
+    0.0f, 0.0f, 0.0f, 1.0f,
+  };
+  mat4 ortho =
+  {
+    2.0f / renderer_data.camera_width, 0.0f, 0.0f, 0.0f,
+    0.0f, (2.0f * renderer_data.aspect_ratio) / renderer_data.camera_width, 0.0f, 0.0f,
+    0.0f, 0.0f, -1.0f, 0.0f,
+    0.0f, 0.0f, 0.0f, 1.0f
+  };
+
+  // Distance from the near plane (must be positive)
+  f32 n = renderer_data.near_plane;
+  // Distance from the far plane (must be positive)
+  f32 f = renderer_data.far_plane;
+  f32 field_of_view = deg_to_rad(renderer_data.camera_width);
+  f32 r = -(f + n) / (f - n);
+  f32 s = -(2 * n * f) / (f - n);
+  mat4 persp = 
+  {
+    (f32)(1.0f / tan(field_of_view / 2.0f)) / renderer_data.aspect_ratio, 0.0f, 0.0f, 0.0f,
+    0.0f, 1.0f / tan(field_of_view / 2.0f), 0.0f, 0.0f,
+    0.0f, 0.0f, r, s,
+    0.0f, 0.0f, -1.0f, 0.0f
+  };
+
+  mat4 projection;
+  if(renderer_data.proj_type == false)
+  {
+    projection = ortho;
+  }
+  else
+  {
+    projection = persp;
+  }
+
+  *view_out = view;
+  *projection_out = projection;
+}
+
+CommandBuffer *create_command_buffer()
+{
+  return new CommandBuffer;
+}
+
+void destroy_command_buffer(CommandBuffer *buffer)
+{
+  delete buffer;
+}
+
+void reset_command_buffer(CommandBuffer *buffer)
+{
+  buffer->commands.clear();
+  buffer->instance_worlds.clear();
+  buffer->instance_normal_worlds.clear();
+  buffer->instance_colors.clear();
+}
+
+void record_blend_mode(CommandBuffer *buffer, BlendMode mode)
+{
+  Command command;
+  command.type = COMMAND_SET_BLEND_MODE;
+  command.blend_mode = mode;
+  buffer->commands.push_back(command);
+}
+
+void record_transparency_mode(CommandBuffer *buffer, TransparencyMode mode)
+{
+  Command command;
+  command.type = COMMAND_SET_TRANSPARENCY_MODE;
+  command.transparency_mode = mode;
+  buffer->commands.push_back(command);
+}
+
+void record_lod_error(CommandBuffer *buffer, f32 pixels)
+{
+  Command command;
+  command.type = COMMAND_SET_LOD_ERROR;
+  command.lod_error_pixels = pixels;
+  buffer->commands.push_back(command);
+}
+
+// The normal matrices are found here, so that work is spread over the recording threads
+void record_draw_instanced(CommandBuffer *buffer, u32 model, u32 num_instances, const mat4 *worlds, const v4 *colors)
+{
+  if(!num_instances) return;
+
+  Command command;
+  command.type = COMMAND_DRAW_INSTANCED;
+  command.draw.model = model;
+  command.draw.first_instance = buffer->instance_worlds.size();
+  command.draw.num_instances = num_instances;
+  command.draw.culled = false;
+  buffer->commands.push_back(command);
+
+  for(u32 i = 0; i < num_instances; i++)
+  {
+    buffer->instance_worlds.push_back(worlds[i]);
+    buffer->instance_normal_worlds.push_back(normal_world_mat(worlds[i]));
+    if(colors)
+    {
+      buffer->instance_colors.push_back(Color(colors[i].x, colors[i].y, colors[i].z, colors[i].w));
+    }
+    else
+    {
+      buffer->instance_colors.push_back(renderer_data.models[model]->color);
+    }
+  }
+}
+
+// Culls the scene with the camera as it is now and records a draw for each run of
+// visible instances with the same model
+void record_draw_scene(CommandBuffer *buffer)
+{
+  mat4 view;
+  mat4 projection;
+  camera_matrices(&view, &projection);
+
+  std::vector<u32> visible;
+  cull_scene(&renderer_data.scene, projection * view, &visible);
+  if(visible.empty()) return;
+
+  InstanceModelLess less = {&renderer_data.scene.instances[0]};
+  std::stable_sort(visible.begin(), visible.end(), less);
+
+  for(u32 i = 0; i < visible.size(); i++)
+  {
+    const SceneInstance *instance = &renderer_data.scene.instances[visible[i]];
+    if(i == 0 || instance->model != renderer_data.scene.instances[visible[i - 1]].model)
+    {
+      Command command;
+      command.type = COMMAND_DRAW_INSTANCED;
+      command.draw.model = instance->model;
+      command.draw.first_instance = buffer->instance_worlds.size();
+      command.draw.num_instances = 0;
+      command.draw.culled = true;
+      buffer->commands.push_back(command);
+    }
+    buffer->commands.back().draw.num_instances++;
+
+    // Scales that differ along the axes tilt the normals, like with draw_instanced
+    mat4 world = instance_world_mat(instance);
+    buffer->instance_worlds.push_back(world);
+    buffer->instance_normal_worlds.push_back(normal_world_mat(world));
+    buffer->instance_colors.push_back(renderer_data.models[instance->model]->color);
+  }
+}
+
+void update_scene()
+{
+  update_scene_bvh(&renderer_data.scene);
+}
+
+// Points picked by each job of a batch
+#define PICK_RANGE_SIZE 64
+
+struct PickJob
+{
+  const v2 *points;
+  PickResult *results;
+
+  mat4 view;
+  mat4 projection;
+
+  // The depths the camera sees, the same as the distances along its rays
+  f32 near_t;
+  f32 far_t;
+};
+
+// The ray through a point on the screen in world space
+// The direction has a z of -1 in view space, so the distance along it is the depth
+static void camera_ray(const mat4 &view, const mat4 &projection, v2 point, v3 *origin, v3 *direction)
+{
+  f32 ndc_x = point.x / renderer_data.screen_width * 2.0f - 1.0f;
+  f32 ndc_y = point.y / renderer_data.screen_height * 2.0f - 1.0f;
+
+  v3 view_origin;
+  v3 view_direction;
+  if(renderer_data.proj_type == true)
+  {
+    // Every ray starts at the camera, x and y are divided by the distance
+    view_origin = v3();
+    view_direction = v3(ndc_x / projection[0][0], ndc_y / projection[1][1], -1.0f);
+  }
+  else
+  {
+    view_origin = v3(ndc_x / projection[0][0], ndc_y / projection[1][1], 0.0f);
+    view_direction = v3(0.0f, 0.0f, -1.0f);
+  }
+
+  // The view matrix is a rotation and a translation, so the rotation is undone with its transpose
+  v3 rows[3];
+  for(u32 i = 0; i < 3; i++)
+  {
+    rows[i] = v3(view[i][0], view[i][1], view[i][2]);
+  }
+  v3 offset = view_origin - v3(view[0][3], view[1][3], view[2][3]);
+  *origin = rows[0] * offset.x + rows[1] * offset.y + rows[2] * offset.z;
+  *direction = rows[0] * view_direction.x + rows[1] * view_direction.y + rows[2] * view_direction.z;
+}
+
+// Casts the rays of a range of points, through the instance bounds closest
+// first until the next instance starts past the closest triangle hit
+static void pick_range(void *data, u32 begin, u32 end)
+{
+  const PickJob *job = (const PickJob *)data;
+  const Scene *scene = &renderer_data.scene;
+  std::vector<SceneRayHit> instance_hits;
+
+  for(u32 i = begin; i < end; i++)
+  {
+    v3 origin;
+    v3 direction;
+    camera_ray(job->view, job->projection, job->points[i], &origin, &direction);
+
+    PickResult *result = &job->results[i];
+    *result = PickResult();
+    f32 closest_t = job->far_t;
+
+    instance_hits.clear();
+    cast_ray_scene(scene, origin, direction, job->near_t, job->far_t, &instance_hits);
+    for(u32 j = 0; j < instance_hits.size() && instance_hits[j].t < closest_t; j++)
+    {
+      const SceneInstance *instance = &scene->instances[instance_hits[j].instance];
+      if(instance->scale.x == 0.0f || instance->scale.y == 0.0f || instance->scale.z == 0.0f) continue;
+
+      // Into model space with the inverse of the world matrix, the distance along the ray stays the same
+      v3 inv_scale = v3(1.0f / instance->scale.x, 1.0f / instance->scale.y, 1.0f / instance->scale.z);
+      mat4 world_to_model = scale_mat(inv_scale) * z_axis_rotation_mat(-instance->rotation) * translation_mat(-instance->position);
+      v4 model_origin = world_to_model * v4(origin, 1.0f);
+      v4 model_direction = world_to_model * v4(direction, 0.0f);
+      bool mirrored = instance->scale.x * instance->scale.y * instance->scale.z < 0.0f;
+
+      MeshRayHit hit;
+      const MeshBvh *bvh = renderer_data.models[instance->model]->bvh;
+      if(cast_ray_mesh(bvh, v3(model_origin.x, model_origin.y, model_origin.z), v3(model_direction.x, model_direction.y, model_direction.z),
+                       job->near_t, closest_t, mirrored, &hit))
+      {
+        closest_t = hit.t;
+        result->hit = true;
+        result->instance = instance_hits[j].instance;
+        result->triangle = hit.triangle;
+        result->barycentrics = hit.barycentrics;
+        result->depth = hit.t;
+      }
+    }
+  }
+}
+
+// Picking runs on the scene and the meshes, so nothing is done per pixel while rendering
+void pick(const v2 *points, u32 num_points, PickResult *results)
+{
+  update_scene_bvh(&renderer_data.scene);
+
+  // Meshes do not change, so their hierarchies are built once
+  for(u32 i = 0; i < renderer_data.models.size(); i++)
+  {
+    Model *model = renderer_data.models[i];
+    if(!model->bvh)
+    {
+      model->bvh = new MeshBvh;
+      build_mesh_bvh(&model->mesh, model->bvh);
+    }
+  }
+
+  PickJob job;
+  job.points = points;
+  job.results = results;
+  camera_matrices(&job.view, &job.projection);
+  if(renderer_data.proj_type == true)
+  {
+    job.near_t = renderer_data.near_plane;
+    job.far_t = renderer_data.far_plane;
+  }
+  else
+  {
+    // The orthographic projection maps depth d to -projection[2][2] * d + projection[2][3]
+    f32 near_t = (job.projection[2][3] + 1.0f) / job.projection[2][2];
+    f32 far_t = (job.projection[2][3] - 1.0f) / job.projection[2][2];
+    job.near_t = min(near_t, far_t);
+    job.far_t = max(near_t, far_t);
+  }
+
+  run_range_jobs(pick_range, &job, num_points, PICK_RANGE_SIZE);
+}
+
+// Back end of the shadow maps: the depth of the casters from each light with
+// the depth only rasterizer, before the frame is shaded
+static void render_shadow_maps(const FramePacket *packet)
+{
+  renderer_data.shadow_maps = packet->shadow_maps.empty() ? 0 : &packet->shadow_maps[0];
+
+  const std::vector<Vertex> &vertices = packet->shadow_vertex_buffer;
+  const std::vector<u32> &indices = packet->shadow_index_buffer;
+  ScreenRect map_rect = {0, 0, SHADOW_MAP_SIZE - 1, SHADOW_MAP_SIZE - 1};
+
+  for(u32 i = 0; i < packet->shadow_maps.size(); i++)
+  {
+    const ShadowMap *shadow_map = &packet->shadow_maps[i];
+    renderer_data.view_lights[shadow_map->light].shadow_map = i;
+
+    if(!renderer_data.shadow_depths[i])
+    {
+      renderer_data.shadow_depths[i] = (f32 *)allocate_pages(SHADOW_MAP_SIZE * SHADOW_MAP_SIZE * sizeof(f32));
+    }
+    f32 *depths = renderer_data.shadow_depths[i];
+
+    __m128 far_depth = _mm_set1_ps(1.0f);
+    for(u32 j = 0; j < SHADOW_MAP_SIZE * SHADOW_MAP_SIZE; j += 4)
+    {
+      _mm_store_ps(&depths[j], far_depth);
+    }
+
+    for(u32 j = shadow_map->first_index; j < shadow_map->first_index + shadow_map->num_indices; j += 3)
+    {
+      TriangleSetup setup;
+      if(setup_triangle(&setup, vertices[indices[j]].vertex, vertices[indices[j + 1]].vertex, vertices[indices[j + 2]].vertex, 0, &map_rect))
+      {
+        render_triangle_depth(depths, renderer_data.shadow_row_offsets, renderer_data.shadow_column_offsets, &setup);
+      }
+    }
+  }
+}
+
+// Back end: rasterizes a frame packet into its color buffer
+static void rasterize_frame_packet(FramePacket *packet)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  renderer_data.color_buffer = packet->color_buffer;
+  renderer_data.scissor = packet->scissor;
+  renderer_data.viewport_width = packet->width;
+  renderer_data.viewport_height = packet->height;
+
+  // The rest of the buffers still holds the frame before last, which is the same there
+  ScreenRect scissor = packet->scissor;
+  if(packet->clear)
+  {
+    fill_frame_tiles((u32 *)packet->color_buffer, _mm_set1_epi32(renderer_data.clear_color), scissor);
+  }
+  fill_frame_tiles((u32 *)renderer_data.depth_buffer, _mm_castps_si128(_mm_set1_ps(1.0f)), scissor);
+
+  // Rasterize triangles in buffers
+  u32 *pixels = renderer_data.color_buffer;
+
+  const std::vector<Vertex> &vertices = packet->clipped_vertex_buffer;
+  const std::vector<u32> &indices = packet->clipped_index_buffer;
+
+  //time_block("5: light culling");
+  compute_tile_depth_bounds(packet);
+  cull_lights(packet);
+  //end_time_block();
+
+  //time_block("5: shadow maps");
+  render_shadow_maps(packet);
+  //end_time_block();
+
+  // Depth of the opaque triangles first, so the pixels they hide are never shaded
+  bool depth_prepass = packet->depth_prepass && packet->mode == RENDER_MODE_TRIANGLES;
+  if(depth_prepass)
+  {
+    //time_block("6: depth prepass");
+    for(u32 draw = 0; draw < packet->draw_calls.size(); draw++)
+    {
+      const DrawCall *draw_call = &packet->draw_calls[draw];
+      if(!draw_is_opaque(draw_call)) continue;
+
+      for(u32 i = draw_call->first_index; i < draw_call->first_index + draw_call->num_indices; i += 3)
+      {
+        TriangleSetup setup;
+        if(setup_triangle(&setup, vertices[indices[i]].vertex, vertices[indices[i + 1]].vertex, vertices[indices[i + 2]].vertex, 0, &renderer_data.scissor))
+        {
+          render_triangle_depth(renderer_data.depth_buffer, renderer_data.row_offsets, renderer_data.column_offsets, &setup);
+        }
+      }
+    }
+    //end_time_block();
+  }
+
+  //time_block("6: draw all triangles");
+  for(u32 draw = 0; draw < packet->draw_calls.size(); draw++)
+  {
+    const DrawCall *draw_call = &packet->draw_calls[draw];
+    DepthTest depth_test = depth_prepass && draw_is_opaque(draw_call) ? DEPTH_TEST_PREPASS : DEPTH_TEST_LESS;
+
+    for(u32 i = draw_call->first_index; i < draw_call->first_index + draw_call->num_indices; )
+    {
+      v4 v[3];
+      f32 varyings[3][NUM_VARYINGS];
+
+      for(u32 j = 0; j < 3; j++)
+      {
+        const Vertex &vertex = vertices[indices[i++]];
+        v[j] = vertex.vertex;
+
+        varyings[j][VARYING_NORMAL_X] = vertex.normal.x;
+        varyings[j][VARYING_NORMAL_Y] = vertex.normal.y;
+        varyings[j][VARYING_NORMAL_Z] = vertex.normal.z;
+        varyings[j][VARYING_VIEW_POSITION_X] = vertex.view_position.x;
+        varyings[j][VARYING_VIEW_POSITION_Y] = vertex.view_position.y;
+        varyings[j][VARYING_VIEW_POSITION_Z] = vertex.view_position.z;
+        varyings[j][VARYING_TEXTURE_U] = vertex.texture_coord.x;
+        varyings[j][VARYING_TEXTURE_V] = vertex.texture_coord.y;
+      }
+
+      if(packet->mode == RENDER_MODE_TRIANGLES)
+      {
+        //time_block("7: rasterize triangle");
+        TriangleSetup setup;
+        if(setup_triangle(&setup, v[0], v[1], v[2], varyings, &renderer_data.scissor))
+        {
+          bool translucent = draw_call->color.a < 1.0f;
+          if(translucent && draw_call->transparency_mode == TRANSPARENCY_MODE_ORDER_INDEPENDENT)
+          {
+            bin_translucent_triangle(&setup, draw_call);
+          }
+          else
+          {
+            render_triangle(pixels, &setup, draw_call, depth_test);
+          }
+        }
+        ////end_time_block();
+      }
+      else
+      {
+        render_line_bresenham((u32)v[0].x, (u32)v[0].y, (u32)v[1].x, (u32)v[1].y, Color(0.0f, 0.0f, 1.0f));
+        render_line_bresenham((u32)v[1].x, (u32)v[1].y, (u32)v[2].x, (u32)v[2].y, Color(0.0f, 0.0f, 1.0f));
+        render_line_bresenham((u32)v[2].x, (u32)v[2].y, (u32)v[0].x, (u32)v[0].y, Color(0.0f, 0.0f, 1.0f));
+      }
+
+    }
+  }
+  //end_time_block();
+
+  //time_block("8: resolve translucent triangles");
+  resolve_translucent_triangles();
+  //end_time_block();
+
+  std::chrono::duration<f32, std::milli> time = std::chrono::steady_clock::now() - start;
+  packet->back_end_ms = time.count();
+}
+
+static void back_end_thread()
+{
+  for(;;)
+  {
+    FramePacket *packet;
+    {
+      std::unique_lock<std::mutex> lock(renderer_data.back_end_mutex);
+      renderer_data.back_end_wake.wait(lock, []{ return renderer_data.back_end_quitting || renderer_data.back_end_packet; });
+      if(renderer_data.back_end_quitting) return;
+      packet = renderer_data.back_end_packet;
+    }
+
+    rasterize_frame_packet(packet);
+
+    {
+      std::lock_guard<std::mutex> lock(renderer_data.back_end_mutex);
+      renderer_data.back_end_packet = 0;
+    }
+    renderer_data.back_end_idle.notify_all();
+  }
+}
+
+static void wait_for_back_end()
+{
+  std::unique_lock<std::mutex> lock(renderer_data.back_end_mutex);
+  renderer_data.back_end_idle.wait(lock, []{ return renderer_data.back_end_packet == 0; });
+}
+
+static ScreenRect empty_rect()
+{
+  ScreenRect rect = {0, 0, -1, -1};
+  return rect;
+}
+
+static ScreenRect screen_rect()
+{
+  ScreenRect rect = {0, 0, (s32)renderer_data.screen_width - 1, (s32)renderer_data.screen_height - 1};
+  return rect;
+}
+
+static ScreenRect viewport_rect(const FramePacket *packet)
+{
+  ScreenRect rect = {0, 0, (s32)packet->width - 1, (s32)packet->height - 1};
+  return rect;
+}
+
+static bool rect_empty(ScreenRect rect)
+{
+  return rect.left > rect.right || rect.bottom > rect.top;
+}
+
+static ScreenRect rect_union(ScreenRect a, ScreenRect b)
+{
+  if(rect_empty(a)) return b;
+  if(rect_empty(b)) return a;
+
+  ScreenRect rect = {min(a.left, b.left), min(a.bottom, b.bottom), max(a.right, b.right), max(a.top, b.top)};
+  return rect;
+}
+
+// Grows a rectangle to whole light tiles, which are whole frame tiles too
+static ScreenRect tile_aligned_rect(ScreenRect rect, const FramePacket *packet)
+{
+  rect.left -= rect.left % TILE_SIZE;
+  rect.bottom -= rect.bottom % TILE_SIZE;
+  rect.right = min(rect.right - rect.right % TILE_SIZE + TILE_SIZE - 1, (s32)packet->width - 1);
+  rect.top = min(rect.top - rect.top % TILE_SIZE + TILE_SIZE - 1, (s32)packet->height - 1);
+  return rect;
+}
+
+struct DrawRecordLess
+{
+  bool operator()(const DrawRecord &a, const DrawRecord &b) const
+  {
+    return a.key < b.key;
+  }
+};
+
+// Hash of the settings that change every pixel of a frame
+static u64 hash_view_state(const mat4 &view, const mat4 &projection, bool clear, u32 width, u32 height)
+{
+  u64 hash = hash_memory(0, &view, sizeof(view));
+  hash = hash_memory(hash, &projection, sizeof(projection));
+
+  u32 settings[] = {(u32)renderer_data.mode, clear, renderer_data.clear_color, (u32)renderer_data.blend_mode, (u32)renderer_data.transparency_mode, renderer_data.depth_prepass, width, height};
+  hash = hash_memory(hash, settings, sizeof(settings));
+  hash = hash_memory(hash, &renderer_data.lod_error_pixels, sizeof(renderer_data.lod_error_pixels));
+
+  if(renderer_data.lights.size())
+  {
+    hash = hash_memory(hash, &renderer_data.lights[0], renderer_data.lights.size() * sizeof(Light));
+  }
+  return hash;
+}
+
+// Hash of the commands of a submit with the instances they draw
+static u64 hash_commands(u64 hash, CommandBuffer *const *buffers, u32 num_buffers)
+{
+  for(u32 i = 0; i < num_buffers; i++)
+  {
+    const CommandBuffer *buffer = buffers[i];
+    for(u32 j = 0; j < buffer->commands.size(); j++)
+    {
+      const Command *command = &buffer->commands[j];
+      hash = hash_memory(hash, &command->type, sizeof(command->type));
+      switch(command->type)
+      {
+        case COMMAND_SET_BLEND_MODE:
+          hash = hash_memory(hash, &command->blend_mode, sizeof(command->blend_mode));
+          break;
+        case COMMAND_SET_TRANSPARENCY_MODE:
+          hash = hash_memory(hash, &command->transparency_mode, sizeof(command->transparency_mode));
+          break;
+        case COMMAND_SET_LOD_ERROR:
+          hash = hash_memory(hash, &command->lod_error_pixels, sizeof(command->lod_error_pixels));
+          break;
+        case COMMAND_DRAW_INSTANCED:
+        {
+          // The normal matrices follow from the worlds
+          const InstancedDraw *draw = &command->draw;
+          u32 fields[] = {draw->model, draw->num_instances, draw->culled};
+          hash = hash_memory(hash, fields, sizeof(fields));
+          hash = hash_memory(hash, &buffer->instance_worlds[draw->first_instance], draw->num_instances * sizeof(mat4));
+          hash = hash_memory(hash, &buffer->instance_colors[draw->first_instance], draw->num_instances * sizeof(Color));
+        }
+        break;
+      }
+    }
+  }
+  return hash;
+}
+
+// Finds the part of the screen that changed since the last frame. The draws
+// are matched by key, and the ones in only one of the frames are dirty.
+static ScreenRect find_dirty_rect(const FramePacket *packet, bool view_changed)
+{
+  std::vector<DrawRecord> &records = renderer_data.draw_records;
+  std::vector<DrawRecord> &last_records = renderer_data.last_draw_records;
+
+  records.resize(packet->draw_calls.size());
+  for(u32 i = 0; i < packet->draw_calls.size(); i++)
+  {
+    const DrawCall *draw_call = &packet->draw_calls[i];
+
+    // Pixels are covered up to the vertices rounded down, the same as the triangle bounding boxes
+    ScreenRect rect = empty_rect();
+    for(u32 j = draw_call->first_vertex; j < draw_call->first_vertex + draw_call->num_vertices; j++)
+    {
+      v4 vertex = packet->clipped_vertex_buffer[j].vertex;
+      ScreenRect point = {(s32)vertex.x, (s32)vertex.y, (s32)vertex.x, (s32)vertex.y};
+      rect = rect_union(rect, point);
+    }
+    if(!rect_empty(rect))
+    {
+      rect.right = min(rect.right, (s32)packet->width - 1);
+      rect.top = min(rect.top, (s32)packet->height - 1);
+    }
+
+    records[i].key = draw_call->key;
+    records[i].rect = rect;
+  }
+  std::sort(records.begin(), records.end(), DrawRecordLess());
+
+  ScreenRect dirty = empty_rect();
+  if(view_changed)
+  {
+    dirty = viewport_rect(packet);
+  }
+  else
+  {
+    u32 i = 0;
+    u32 j = 0;
+    while(i < records.size() || j < last_records.size())
+    {
+      if(j == last_records.size() || (i < records.size() && records[i].key < last_records[j].key))
+      {
+        dirty = rect_union(dirty, records[i++].rect);
+      }
+      else if(i == records.size() || last_records[j].key < records[i].key)
+      {
+        dirty = rect_union(dirty, last_records[j++].rect);
+      }
+      else
+      {
+        i++;
+        j++;
+      }
+    }
+  }
+
+  last_records.swap(records);
+  return dirty;
+}
+
+// Makes a finished frame the one swap_buffers presents
+static void set_presented_frame(const FramePacket *packet)
+{
+  if(packet->color_buffer == renderer_data.presented_color_buffer) return;
+
+  renderer_data.presented_color_buffer = packet->color_buffer;
+  renderer_data.presented_width = packet->width;
+  renderer_data.presented_height = packet->height;
+  renderer_data.presented_version++;
+}
+
+// Nothing changed since the last frame, so it is presented again
+static void skip_frame()
+{
+  wait_for_back_end();
+  set_presented_frame(&renderer_data.frame_packets[(renderer_data.frame_index - 1) % NUM_FRAME_PACKETS]);
+  renderer_data.frame_skipped = true;
+}
+
+// Moves the resolution scale so frames take the target time. Most of the time
+// goes to filling pixels, which goes with the square of the scale.
+static void update_resolution_scale(f32 frame_ms)
+{
+  if(renderer_data.target_frame_ms <= 0.0f || frame_ms <= 0.0f) return;
+
+  // Frames a little faster than the target are left alone so the resolution does not keep changing
+  f32 ratio = renderer_data.target_frame_ms / frame_ms;
+  if(ratio >= 1.0f && ratio < DYNAMIC_RESOLUTION_SLACK) return;
+
+  f32 scale = renderer_data.resolution_scale * (1.0f + DYNAMIC_RESOLUTION_GAIN * (sqrtf(ratio) - 1.0f));
+  renderer_data.resolution_scale = clamp(scale, renderer_data.min_resolution_scale, 1.0f);
+}
+
+// The size to render a frame at for the resolution scale, in whole frame tiles below the screen size
+static void render_size(u32 *width, u32 *height)
+{
+  *width = renderer_data.screen_width;
+  *height = renderer_data.screen_height;
+  if(renderer_data.resolution_scale >= 1.0f) return;
+
+  u32 scaled_width = (u32)(renderer_data.screen_width * renderer_data.resolution_scale) & ~(FRAME_TILE_SIZE - 1);
+  u32 scaled_height = (u32)(renderer_data.screen_height * renderer_data.resolution_scale) & ~(FRAME_TILE_SIZE - 1);
+  *width = min((s32)max((s32)scaled_width, FRAME_TILE_SIZE), (s32)*width);
+  *height = min((s32)max((s32)scaled_height, FRAME_TILE_SIZE), (s32)*height);
+}
+
+// Clip space to viewport space for the vertices from first_vertex on
+static void clip_to_viewport(std::vector<Vertex> *vertices, u32 first_vertex, u32 width, u32 height)
+{
+  // Perspective division (clip space to ndc space)
+  // 1/w is kept in w for perspective correct interpolation
+  //time_block("3: perspective division");
+  for(u32 i = first_vertex; i < vertices->size(); i++)
+  {
+    v4 &vertex = (*vertices)[i].vertex;
+    f32 inv_w = 1.0f / vertex.w;
+    vertex.x *= inv_w;
+    vertex.y *= inv_w;
+    vertex.z *= inv_w;
+    vertex.w = inv_w;
+  }
+  //end_time_block();
+
+  // Viewport transform (ndc space to viewport space)
+  // Transform the vertex buffer
+  //time_block("4: viewport transform");
+  for(u32 i = first_vertex; i < vertices->size(); i++)
+  {
+    // Map the ndc to the screen coordinates
+    v4 ndc = (*vertices)[i].vertex;
+
+    if(ndc.x < -1.0f || ndc.x > 1.0f)
+    {
+      log_file("ndc.x = %f, x should be between -1 and 1\n", ndc.x);
+      assert(0);
+    }
+    if(ndc.y < -1.0f || ndc.y > 1.0f)
+    {
+      log_file("ndc.y = %f, y should be between -1 and 1\n", ndc.y);
+      assert(0);
+    }
+    if(ndc.z < -1.0f || ndc.z > 1.0f)
+    {
+      log_file("ndc.z = %f, z should be between -1 and 1\n", ndc.z);
+      assert(0);
+    }
+
+
+    ndc += v4(1.0f, 1.0f, 0.0f, 0.0f);
+
+    v4 screen_pos;
+    screen_pos.x = ndc.x * (width / 2.0f);
+    screen_pos.y = ndc.y * (height / 2.0f);
+    screen_pos.z = (ndc.z + 1.0f) / 2.0f;
+    screen_pos.w = ndc.w;
+
+#if 0
+    if(screen_pos.x < 0) screen_pos.x += 0.5f;
+    if(screen_pos.x >= width) screen_pos.x -= 0.5f;
+    if(screen_pos.y < 0) screen_pos.y += 0.5f;
+    if(screen_pos.y >= height) screen_pos.y -= 0.5f;
+#endif
+
+
+    (*vertices)[i].vertex = screen_pos;
+  }
+  //end_time_block();
+}
+
+// Vertex shader for the shadow maps, only the positions are transformed
+static void transform_positions(const Vertex *in, Vertex *out, u32 count, const mat4 &transform)
+{
+  mat4_columns transform_columns = matrix_columns(transform);
+  for(u32 i = 0; i < count; i++)
+  {
+    _mm_storeu_ps(&out[i].vertex.x, transform_point(transform_columns, in[i].vertex.x, in[i].vertex.y, in[i].vertex.z));
+  }
+}
+
+// Fits the shadow map of a light to the shadow casters of a frame
+//
+// The light looks down -z of its own view space like the camera. A spot light
+// gets a perspective projection over its cone out to its radius. A directional
+// light gets an orthographic projection around the bounds of the casters, which
+// are then never clipped and use all of the map.
+static void fit_shadow_map(ShadowMap *shadow_map, const Light &light, const FramePacket *packet)
+{
+  v4 direction = packet->view * v4(light.direction, 0.0f);
+  v3 forward = unit(v3(direction.x, direction.y, direction.z));
+  v3 up = absf(forward.y) < 0.99f ? v3(0.0f, 1.0f, 0.0f) : v3(1.0f, 0.0f, 0.0f);
+  v3 right = unit(cross(forward, up));
+  up = cross(right, forward);
+
+  v3 origin = v3();
+  if(light.type == LIGHT_TYPE_SPOT)
+  {
+    v4 position = packet->view * v4(light.position, 1.0f);
+    origin = v3(position.x, position.y, position.z);
+  }
+  shadow_map->view_position = origin;
+
+  mat4 light_view =
+  {
+    right.x,    right.y,    right.z,    -dot(right, origin),
+    up.x,       up.y,       up.z,       -dot(up, origin),
+    -forward.x, -forward.y, -forward.z, dot(forward, origin),
+    0.0f, 0.0f, 0.0f, 1.0f
+  };
+
+  mat4 projection;
+  if(light.type == LIGHT_TYPE_SPOT)
+  {
+    f32 half_angle = min((f32)acos(light.cos_outer_angle), 85.0f * (PI / 180.0f));
+    f32 f = light.radius;
+    f32 n = f * 0.01f;
+    f32 r = -(f + n) / (f - n);
+    f32 s = -(2 * n * f) / (f - n);
+    f32 scale = 1.0f / (f32)tan(half_angle);
+    mat4 persp =
+    {
+      scale, 0.0f, 0.0f, 0.0f,
+      0.0f, scale, 0.0f, 0.0f,
+      0.0f, 0.0f, r, s,
+      0.0f, 0.0f, -1.0f, 0.0f
+    };
+    projection = persp;
+
+    shadow_map->texel_size = 0.0f;
+    shadow_map->texel_size_per_distance = 2.0f / (scale * SHADOW_MAP_SIZE);
+  }
+  else
+  {
+    mat4 world_to_light = light_view * packet->view;
+    v3 min_bounds = v3(INFINITY, INFINITY, INFINITY);
+    v3 max_bounds = v3(-INFINITY, -INFINITY, -INFINITY);
+    for(u32 i = 0; i < packet->shadow_casters.size(); i++)
+    {
+      const ShadowCaster *caster = &packet->shadow_casters[i];
+      v3 caster_min;
+      v3 caster_max;
+      transform_bounds(world_to_light, caster->world_min, caster->world_max, &caster_min, &caster_max);
+      min_bounds = v3(min(min_bounds.x, caster_min.x), min(min_bounds.y, caster_min.y), min(min_bounds.z, caster_min.z));
+      max_bounds = v3(max(max_bounds.x, caster_max.x), max(max_bounds.y, caster_max.y), max(max_bounds.z, caster_max.z));
+    }
+
+    // A little room so triangles on the bounds are not clipped
+    v3 size = max_bounds - min_bounds;
+    v3 margin = size * 0.01f + v3(0.001f, 0.001f, 0.001f);
+    min_bounds -= margin;
+    max_bounds += margin;
+    size = max_bounds - min_bounds;
+
+    // The closest point, at the largest z, gets depth 0
+    mat4 ortho =
+    {
+      2.0f / size.x, 0.0f, 0.0f, -(max_bounds.x + min_bounds.x) / size.x,
+      0.0f, 2.0f / size.y, 0.0f, -(max_bounds.y + min_bounds.y) / size.y,
+      0.0f, 0.0f, -2.0f / size.z, (max_bounds.z + min_bounds.z) / size.z,
+      0.0f, 0.0f, 0.0f, 1.0f
+    };
+    projection = ortho;
+
+    shadow_map->texel_size = max(size.x, size.y) / SHADOW_MAP_SIZE;
+    shadow_map->texel_size_per_distance = 0.0f;
+  }
+
+  // The same mapping to pixels as clip_to_viewport
+  f32 half_size = SHADOW_MAP_SIZE / 2.0f;
+  mat4 viewport =
+  {
+    half_size, 0.0f, 0.0f, half_size,
+    0.0f, half_size, 0.0f, half_size,
+    0.0f, 0.0f, 0.5f, 0.5f,
+    0.0f, 0.0f, 0.0f, 1.0f
+  };
+  shadow_map->view_to_clip = projection * light_view;
+  shadow_map->view_to_map = viewport * shadow_map->view_to_clip;
+}
+
+// Front end of the shadow maps: each light that casts shadows gets a map, and
+// the casters in its view are transformed and clipped into the shadow buffers
+static void transform_shadow_casters(FramePacket *packet)
+{
+  packet->shadow_maps.clear();
+  packet->shadow_vertex_buffer.clear();
+  packet->shadow_index_buffer.clear();
+  if(packet->shadow_casters.empty()) return;
+
+  for(u32 i = 0; i < packet->lights.size() && packet->shadow_maps.size() < MAX_SHADOW_MAPS; i++)
+  {
+    const Light &light = packet->lights[i];
+    if(!light.casts_shadows || light.type == LIGHT_TYPE_POINT) continue;
+
+    ShadowMap shadow_map;
+    shadow_map.light = i;
+    fit_shadow_map(&shadow_map, light, packet);
+    shadow_map.first_index = packet->shadow_index_buffer.size();
+
+    mat4 world_to_clip = shadow_map.view_to_clip * packet->view;
+    Frustum frustum = frustum_from_mat(world_to_clip);
+
+    // Instanced casters of one model are next to each other, so each model is decoded once in a row
+    const Model *decoded_model = 0;
+    for(u32 j = 0; j < packet->shadow_casters.size(); j++)
+    {
+      const ShadowCaster *caster = &packet->shadow_casters[j];
+      u32 plane_mask = ALL_FRUSTUM_PLANES;
+      if(!box_in_frustum(&frustum, caster->world_min, caster->world_max, &plane_mask)) continue;
+
+      const MeshArrays *mesh = &caster->model->mesh;
+      if(caster->model != decoded_model)
+      {
+        renderer_data.model_vertices.resize(mesh->num_vertices);
+        renderer_data.vertex_buffer.resize(mesh->num_vertices);
+        fetch_vertices(mesh, &renderer_data.model_vertices[0]);
+        decoded_model = caster->model;
+      }
+
+      u32 first_vertex = packet->shadow_vertex_buffer.size();
+      transform_positions(&renderer_data.model_vertices[0], &renderer_data.vertex_buffer[0], mesh->num_vertices, world_to_clip * caster->world);
+      clip_triangles(&renderer_data.vertex_buffer[0], mesh->indices + caster->first_index, caster->num_indices,
+                     &packet->shadow_vertex_buffer, &packet->shadow_index_buffer);
+      clip_to_viewport(&packet->shadow_vertex_buffer, first_vertex, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    }
+
+    shadow_map.num_indices = packet->shadow_index_buffer.size() - shadow_map.first_index;
+    packet->shadow_maps.push_back(shadow_map);
+  }
+}
+
+// An opaque instance that could be an occluder and how many occlusion pixels its bounds cover
+struct Occluder
+{
+  const CommandBuffer *buffer;
+  u32 instance;
+  u32 model;
+  f32 lod_error_pixels;
+  f32 area;
+};
+
+// Orders occluders from the largest on screen
+struct OccluderAreaGreater
+{
+  bool operator()(const Occluder &a, const Occluder &b) const
+  {
+    return a.area > b.area;
+  }
+};
+
+// Adds the instances of a draw that are big enough on screen to be occluders
+static void find_occluders(const CommandBuffer *buffer, const InstancedDraw *draw, const mat4 &view_projection,
+                           const Frustum *frustum, const DrawState *state)
+{
+  const MeshArrays *mesh = &renderer_data.models[draw->model]->mesh;
+  if(!mesh->num_vertices || state->blend_mode != BLEND_MODE_OPAQUE) return;
+
+  f32 buffer_area = (f32)(renderer_data.occlusion_width * renderer_data.occlusion_height);
+  for(u32 i = draw->first_instance; i < draw->first_instance + draw->num_instances; i++)
+  {
+    // The same as draw_is_opaque
+    if(buffer->instance_colors[i].a < 1.0f) continue;
+
+    const mat4 &world = buffer->instance_worlds[i];
+    if(frustum)
+    {
+      v3 world_min;
+      v3 world_max;
+      transform_bounds(world, mesh->bounds_min, mesh->bounds_max, &world_min, &world_max);
+      u32 plane_mask = ALL_FRUSTUM_PLANES;
+      if(!box_in_frustum(frustum, world_min, world_max, &plane_mask)) continue;
+    }
+
+    // Boxes through the near plane can cover the whole screen
+    f32 area = buffer_area;
+    ScreenRect rect;
+    f32 depth;
+    if(project_box(view_projection * world, mesh->bounds_min, mesh->bounds_max, &rect, &depth))
+    {
+      area = (f32)(max(rect.right - rect.left + 1, 0) * max(rect.top - rect.bottom + 1, 0));
+    }
+    if(area < buffer_area * OCCLUDER_MIN_AREA) continue;
+
+    Occluder occluder;
+    occluder.buffer = buffer;
+    occluder.instance = i;
+    occluder.model = draw->model;
+    occluder.lod_error_pixels = state->lod_error_pixels;
+    occluder.area = area;
+    renderer_data.occluders.push_back(occluder);
+  }
+}
+
+// Fills the occlusion buffer of a frame with its largest opaque instances on
+// screen, with the LODs they are drawn with
+static void render_occluders(CommandBuffer *const *buffers, u32 num_buffers, const mat4 &view, const mat4 &projection,
+                             const Frustum *frustum, u32 width, u32 height)
+{
+  clear_occlusion_buffer(width, height);
+
+  std::vector<Occluder> &occluders = renderer_data.occluders;
+  occluders.clear();
+
+  DrawState state;
+  state.blend_mode = renderer_data.blend_mode;
+  state.transparency_mode = renderer_data.transparency_mode;
+  state.lod_error_pixels = renderer_data.lod_error_pixels;
+
+  mat4 view_projection = projection * view;
+  for(u32 i = 0; i < num_buffers; i++)
+  {
+    const CommandBuffer *buffer = buffers[i];
+    for(u32 j = 0; j < buffer->commands.size(); j++)
+    {
+      const Command *command = &buffer->commands[j];
+      switch(command->type)
+      {
+        case COMMAND_SET_BLEND_MODE:
+          state.blend_mode = command->blend_mode;
+          break;
+        case COMMAND_SET_TRANSPARENCY_MODE:
+          state.transparency_mode = command->transparency_mode;
+          break;
+        case COMMAND_SET_LOD_ERROR:
+          state.lod_error_pixels = command->lod_error_pixels;
+          break;
+        case COMMAND_DRAW_INSTANCED:
+          find_occluders(buffer, &command->draw, view_projection, command->draw.culled ? 0 : frustum, &state);
+          break;
+      }
+    }
+  }
+  if(occluders.empty()) return;
+
+  std::sort(occluders.begin(), occluders.end(), OccluderAreaGreater());
+  if(occluders.size() > MAX_OCCLUDERS) occluders.resize(MAX_OCCLUDERS);
+
+  std::vector<Vertex> &vertices = renderer_data.occluder_vertices;
+  std::vector<u32> &indices = renderer_data.occluder_indices;
+  vertices.clear();
+  indices.clear();
+
+  const Model *decoded_model = 0;
+  for(u32 i = 0; i < occluders.size(); i++)
+  {
+    const Occluder *occluder = &occluders[i];
+    const Model *model = renderer_data.models[occluder->model];
+    const MeshArrays *mesh = &model->mesh;
+    if(model != decoded_model)
+    {
+      renderer_data.model_vertices.resize(mesh->num_vertices);
+      renderer_data.vertex_buffer.resize(mesh->num_vertices);
+      fetch_vertices(mesh, &renderer_data.model_vertices[0]);
+      decoded_model = model;
+    }
+
+    const mat4 &world = occluder->buffer->instance_worlds[occluder->instance];
+    mat4 world_view = view * world;
+    u32 first_index;
+    u32 num_indices;
+    instance_lod(mesh, world, world_view, projection, occluder->lod_error_pixels, &first_index, &num_indices);
+
+    transform_positions(&renderer_data.model_vertices[0], &renderer_data.vertex_buffer[0], mesh->num_vertices, projection * world_view);
+    clip_triangles(&renderer_data.vertex_buffer[0], mesh->indices + first_index, num_indices, &vertices, &indices);
+  }
+  clip_to_viewport(&vertices, 0, width, height);
+
+  for(u32 i = 0; i < indices.size(); i += 3)
+  {
+    rasterize_occluder(vertices[indices[i]].vertex, vertices[indices[i + 1]].vertex, vertices[indices[i + 2]].vertex);
+  }
+}
+
+// Runs the commands of the buffers in order and renders them as one frame
+// The buffers are only read, so the same frame can be submitted again
+//
+// The front end runs here and fills a frame packet. With a frame latency of 1
+// the packet is handed to the back end thread, which rasterizes it while the
+// next frame is recorded and put through the front end. swap_buffers then
+// presents the frame before this one.
+void submit_command_buffers(CommandBuffer *const *buffers, u32 num_buffers)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // The back end was done with this packet before the last submit handed it the other one
+  u32 packet_index = renderer_data.frame_index % NUM_FRAME_PACKETS;
+  FramePacket *packet = &renderer_data.frame_packets[packet_index];
+
+  // The packet still has the times of the frame before last. With latency the
+  // front and back end run at the same time, so the slower one sets the frame time.
+  if(renderer_data.frame_index >= NUM_FRAME_PACKETS)
+  {
+    f32 frame_ms = renderer_data.frame_latency ? max(packet->front_end_ms, packet->back_end_ms) : packet->front_end_ms + packet->back_end_ms;
+    update_resolution_scale(frame_ms);
+  }
+
+  u32 width;
+  u32 height;
+  render_size(&width, &height);
+
+  mat4 view;
+  mat4 projection;
+  camera_matrices(&view, &projection);
+
+  bool clear = renderer_data.clear_requested;
+  renderer_data.clear_requested = false;
+
+  // Frames are compared before any vertex work, so an idle frame costs only the hashing
+  bool incremental = renderer_data.incremental_rendering && renderer_data.frame_index > 0;
+  u64 view_hash = hash_view_state(view, projection, clear, width, height);
+  u64 frame_hash = hash_commands(view_hash, buffers, num_buffers);
+  if(incremental && frame_hash == renderer_data.last_frame_hash)
+  {
+    skip_frame();
+    return;
+  }
+  renderer_data.last_frame_hash = frame_hash;
+
+  renderer_data.front_packet = packet;
+
+  packet->clipped_vertex_buffer.clear();
+  packet->clipped_index_buffer.clear();
+  packet->draw_calls.clear();
+  packet->mode = renderer_data.mode;
+  packet->depth_prepass = renderer_data.depth_prepass;
+  packet->lights = renderer_data.lights;
+  packet->shadow_casters.clear();
+  packet->shadows = false;
+  for(u32 i = 0; i < packet->lights.size(); i++)
+  {
+    const Light &light = packet->lights[i];
+    if(light.casts_shadows && light.type != LIGHT_TYPE_POINT) packet->shadows = true;
+  }
+  packet->color_buffer = renderer_data.color_buffers[packet_index];
+  packet->clear = clear;
+  packet->width = width;
+  packet->height = height;
+
+  packet->view = view;
+  packet->projection = projection;
+
+  // Draws from record_draw_instanced are culled per instance
+  Frustum frustum = frustum_from_mat(projection * view);
+
+  if(renderer_data.occlusion_culling)
+  {
+    render_occluders(buffers, num_buffers, view, projection, &frustum, width, height);
+  }
+
+  DrawState state;
+  state.blend_mode = renderer_data.blend_mode;
+  state.transparency_mode = renderer_data.transparency_mode;
+  state.lod_error_pixels = renderer_data.lod_error_pixels;
+
+  for(u32 i = 0; i < num_buffers; i++)
+  {
+    const CommandBuffer *buffer = buffers[i];
+    for(u32 j = 0; j < buffer->commands.size(); j++)
+    {
+      const Command *command = &buffer->commands[j];
+      switch(command->type)
+      {
+        case COMMAND_SET_BLEND_MODE:
+          state.blend_mode = command->blend_mode;
+          break;
+        case COMMAND_SET_TRANSPARENCY_MODE:
+          state.transparency_mode = command->transparency_mode;
+          break;
+        case COMMAND_SET_LOD_ERROR:
+          state.lod_error_pixels = command->lod_error_pixels;
+          break;
+        case COMMAND_DRAW_INSTANCED:
+          transform_and_clip_instances(buffer, &command->draw, view, projection, command->draw.culled ? 0 : &frustum, &state);
+          break;
+      }
+    }
+  }
+
+  clip_to_viewport(&packet->clipped_vertex_buffer, 0, width, height);
+
+  transform_shadow_casters(packet);
+
+  // The color buffer of the packet holds the frame before last, so what changed
+  // in the last frame is drawn again too. Lines are always drawn everywhere.
+  // A draw that moves can change the shadows anywhere, so with shadows every
+  // frame that is not skipped is drawn in full.
+  bool view_changed = view_hash != renderer_data.last_view_hash || !packet->shadow_maps.empty();
+  renderer_data.last_view_hash = view_hash;
+  ScreenRect dirty = find_dirty_rect(packet, view_changed);
+  if(incremental && rect_empty(dirty))
+  {
+    // Only draws outside the screen changed
+    skip_frame();
+    return;
+  }
+
+  packet->scissor = viewport_rect(packet);
+  if(incremental && renderer_data.frame_index >= NUM_FRAME_PACKETS && packet->mode == RENDER_MODE_TRIANGLES)
+  {
+    packet->scissor = tile_aligned_rect(rect_union(dirty, renderer_data.last_dirty_rect), packet);
+  }
+  renderer_data.last_dirty_rect = dirty;
+  renderer_data.frame_skipped = false;
+
+  std::chrono::duration<f32, std::milli> time = std::chrono::steady_clock::now() - start;
+  packet->front_end_ms = time.count();
+
+  // The last frame has to be done before its color buffer is presented
+  wait_for_back_end();
+  if(renderer_data.frame_index > 0)
+  {
+    set_presented_frame(&renderer_data.frame_packets[(renderer_data.frame_index - 1) % NUM_FRAME_PACKETS]);
+  }
+
+  if(renderer_data.frame_latency == 0)
+  {
+    rasterize_frame_packet(packet);
+    set_presented_frame(packet);
+  }
+  else
+  {
+    {
+      std::lock_guard<std::mutex> lock(renderer_data.back_end_mutex);
+      renderer_data.back_end_packet = packet;
+    }
+    renderer_data.back_end_wake.notify_one();
+  }
+
+  renderer_data.frame_index++;
+}
+
+// glDrawArrays
+void render()
+{
+  CommandBuffer *commands = renderer_data.immediate_commands;
+  update_scene();
+  record_draw_scene(commands);
+  submit_command_buffers(&commands, 1);
+  reset_command_buffer(commands);
+}
+
+// Sets every pixel of the frame tiles touching the rectangle
+static void fill_frame_tiles(u32 *buffer, __m128i value, ScreenRect rect)
+{
+  u32 tile_pixels = FRAME_TILE_SIZE * FRAME_TILE_SIZE;
+  for(s32 tile_y = rect.bottom / FRAME_TILE_SIZE; tile_y <= rect.top / FRAME_TILE_SIZE; tile_y++)
+  {
+    for(s32 tile_x = rect.left / FRAME_TILE_SIZE; tile_x <= rect.right / FRAME_TILE_SIZE; tile_x++)
+    {
+      __m128i *pixels = (__m128i *)(buffer + (tile_y * renderer_data.frame_tiles_x + tile_x) * tile_pixels);
+      for(u32 i = 0; i < tile_pixels / 4; i++)
+      {
+        _mm_store_si128(&pixels[i], value);
+      }
+    }
+  }
+}
+
+static void clear_color_buffer(u32 *color_buffer)
+{
+  __m128i *pixels = (__m128i *)color_buffer;
+  __m128i clear_color = _mm_set1_epi32(renderer_data.clear_color);
+
+  for(u32 i = 0; i < renderer_data.buffer_pixels / 4; i++)
+  {
+    _mm_store_si128(&pixels[i], clear_color);
+  }
+}
+
+// glClear
+// The back end clears the color buffer when it draws the next frame, only
+// in the part of the screen that is drawn again
+void clear_frame_buffer()
+{
+  renderer_data.clear_requested = true;
+}
+
+// Bilinear filter of two pixels from the 16 bit channels of two pixels on each
+// side and the weights of the right ones out of 256, four per pixel
+static __m128i lerp_pixels(__m128i left, __m128i right, __m128i weights)
+{
+  __m128i left_weights = _mm_sub_epi16(_mm_set1_epi16(256), weights);
+  __m128i sum = _mm_add_epi16(_mm_mullo_epi16(left, left_weights), _mm_mullo_epi16(right, weights));
+  return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+// Writes the last finished frame to a linear frame buffer like detile_color_buffer,
+// scaled up from the smaller size it was rendered at with a bilinear filter
+static void upscale_color_buffer(u32 *frame_buffer, bool top_down)
+{
+  u32 width = renderer_data.screen_width;
+  u32 height = renderer_data.screen_height;
+  u32 source_width = renderer_data.presented_width;
+  u32 source_height = renderer_data.presented_height;
+  const u32 *pixels = renderer_data.presented_color_buffer;
+
+  // Pixel centers line up with the source pixel centers they fall between
+  if(renderer_data.upscale_width != source_width)
+  {
+    for(u32 x = 0; x < width; x++)
+    {
+      f32 source_x = clamp((x + 0.5f) * source_width / width - 0.5f, 0.0f, (f32)(source_width - 1));
+      u32 column = (u32)source_x;
+      u32 weight = (u32)((source_x - column) * 256.0f + 0.5f);
+      renderer_data.upscale_columns[x] = renderer_data.column_offsets[column];
+      renderer_data.upscale_next_columns[x] = renderer_data.column_offsets[min((s32)column + 1, (s32)source_width - 1)];
+      for(u32 i = 0; i < 4; i++) renderer_data.upscale_column_weights[x * 4 + i] = (u16)weight;
+    }
+    renderer_data.upscale_columns[width] = renderer_data.upscale_columns[width - 1];
+    renderer_data.upscale_next_columns[width] = renderer_data.upscale_next_columns[width - 1];
+    for(u32 i = 0; i < 4; i++) renderer_data.upscale_column_weights[width * 4 + i] = 0;
+    renderer_data.upscale_width = source_width;
+  }
+
+  const u32 *columns = renderer_data.upscale_columns;
+  const u32 *next_columns = renderer_data.upscale_next_columns;
+  __m128i zero = _mm_setzero_si128();
+
+  for(u32 y = 0; y < height; y++)
+  {
+    f32 source_y = clamp((y + 0.5f) * source_height / height - 0.5f, 0.0f, (f32)(source_height - 1));
+    u32 source_row = (u32)source_y;
+    __m128i row_weights = _mm_set1_epi16((s16)((source_y - source_row) * 256.0f + 0.5f));
+    const u32 *bottom = pixels + renderer_data.row_offsets[source_row];
+    const u32 *top = pixels + renderer_data.row_offsets[min((s32)source_row + 1, (s32)source_height - 1)];
+
+    u32 row_index = top_down ? height - 1 - y : y;
+    u32 *row = frame_buffer + row_index * width;
+
+    // Two pixels at a time, the 16 bit channels of both fit in a register
+    for(u32 x = 0; x < width; x += 2)
+    {
+      __m128i bottom_left = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, bottom[columns[x + 1]], bottom[columns[x]]), zero);
+      __m128i bottom_right = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, bottom[next_columns[x + 1]], bottom[next_columns[x]]), zero);
+      __m128i top_left = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, top[columns[x + 1]], top[columns[x]]), zero);
+      __m128i top_right = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, top[next_columns[x + 1]], top[next_columns[x]]), zero);
+
+      __m128i column_weights = _mm_loadu_si128((const __m128i *)&renderer_data.upscale_column_weights[x * 4]);
+      __m128i bottom_pixels = lerp_pixels(bottom_left, bottom_right, column_weights);
+      __m128i top_pixels = lerp_pixels(top_left, top_right, column_weights);
+      __m128i result = _mm_packus_epi16(lerp_pixels(bottom_pixels, top_pixels, row_weights), zero);
+
+      if(x + 2 <= width)
+      {
+        _mm_storel_epi64((__m128i *)&row[x], result);
+      }
+      else
+      {
+        row[x] = _mm_cvtsi128_si32(result);
+      }
+    }
+  }
+}
+
+// Converts the last finished tiled color buffer to a linear frame buffer
+// with the bottom row first, or the top row first if top_down is set
+// Each 4x4 block of a tile is four 2x2 quads in a row, the low and high
+// halves of a pair of quads are two rows of 4 pixels
+static void detile_color_buffer(u32 *frame_buffer, bool top_down)
+{
+  u32 width = renderer_data.screen_width;
+  u32 height = renderer_data.screen_height;
+  if(renderer_data.presented_width != width || renderer_data.presented_height != height)
+  {
+    upscale_color_buffer(frame_buffer, top_down);
+    return;
+  }
+
+  const __m128i *quads = (const __m128i *)renderer_data.presented_color_buffer;
+
+  for(u32 tile_y = 0; tile_y < renderer_data.frame_tiles_y; tile_y++)
+  {
+    for(u32 tile_x = 0; tile_x < renderer_data.frame_tiles_x; tile_x++)
+    {
+      for(u32 block = 0; block < 4; block++)
+      {
+        u32 x = tile_x * FRAME_TILE_SIZE + (block & 1) * 4;
+        u32 y = tile_y * FRAME_TILE_SIZE + (block >> 1) * 4;
+        const __m128i *block_quads = quads + block * 4;
+        if(x >= width || y >= height) continue;
+
+        __m128i rows[4];
+        rows[0] = _mm_unpacklo_epi64(block_quads[0], block_quads[1]);
+        rows[1] = _mm_unpackhi_epi64(block_quads[0], block_quads[1]);
+        rows[2] = _mm_unpacklo_epi64(block_quads[2], block_quads[3]);
+        rows[3] = _mm_unpackhi_epi64(block_quads[2], block_quads[3]);
+
+        for(u32 i = 0; i < 4 && y + i < height; i++)
+        {
+          u32 row_index = top_down ? height - 1 - (y + i) : y + i;
+          u32 *row = frame_buffer + row_index * width + x;
+          if(x + 4 <= width)
+          {
+            _mm_storeu_si128((__m128i *)row, rows[i]);
+          }
+          else
+          {
+            // Partial tile at the right edge of the screen
+            u32 pixels[4];
+            _mm_storeu_si128((__m128i *)pixels, rows[i]);
+            for(u32 j = 0; j < width - x; j++) row[j] = pixels[j];
+          }
+        }
+      }
+
+      quads += FRAME_TILE_SIZE * FRAME_TILE_SIZE / 4;
+    }
+  }
+}
+
+static void present_thread()
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  for(;;)
+  {
+    u32 image;
+    {
+      std::unique_lock<std::mutex> lock(chain->mutex);
+      chain->image_queued.wait(lock, [chain]{ return chain->quitting || chain->queue_size; });
+
+      // The queue is emptied before quitting
+      if(!chain->queue_size) return;
+
+      image = chain->queue[chain->queue_start];
+      chain->queue_start = (chain->queue_start + 1) % MAX_SWAP_CHAIN_IMAGES;
+      chain->queue_size--;
+      chain->presenting = true;
+    }
+
+    if(chain->present) chain->present(chain->images[image], image, chain->present_data);
+
+    // From swap_buffers to the present function returning
+    std::chrono::duration<f32, std::milli> latency = std::chrono::steady_clock::now() - chain->queue_times[image];
+
+    {
+      std::lock_guard<std::mutex> lock(chain->mutex);
+      chain->image_free[image] = true;
+      chain->presenting = false;
+      chain->stats.presented_frames++;
+      chain->stats.last_latency_ms = latency.count();
+      chain->stats.max_latency_ms = max(chain->stats.max_latency_ms, latency.count());
+      chain->stats.total_latency_ms += latency.count();
+    }
+    chain->image_released.notify_all();
+  }
+}
+
+// Returns an image that nothing is reading, waiting for the present thread if all of them are busy
+static u32 acquire_swap_chain_image(SwapChain *chain)
+{
+  std::unique_lock<std::mutex> lock(chain->mutex);
+  for(;;)
+  {
+    for(u32 i = 0; i < chain->num_images; i++)
+    {
+      if(chain->image_free[i])
+      {
+        chain->image_free[i] = false;
+        return i;
+      }
+    }
+
+    // A mailbox takes back the newest queued frame, the new one would replace it anyway
+    if(chain->mode == PRESENT_MODE_MAILBOX && chain->queue_size)
+    {
+      chain->queue_size--;
+      chain->stats.dropped_frames++;
+      return chain->queue[(chain->queue_start + chain->queue_size) % MAX_SWAP_CHAIN_IMAGES];
+    }
+
+    chain->image_released.wait(lock);
+  }
+}
+
+static void queue_swap_chain_image(SwapChain *chain, u32 image)
+{
+  {
+    std::lock_guard<std::mutex> lock(chain->mutex);
+
+    // A mailbox only keeps the newest frame
+    if(chain->mode == PRESENT_MODE_MAILBOX)
+    {
+      while(chain->queue_size)
+      {
+        chain->image_free[chain->queue[chain->queue_start]] = true;
+        chain->queue_start = (chain->queue_start + 1) % MAX_SWAP_CHAIN_IMAGES;
+        chain->queue_size--;
+        chain->stats.dropped_frames++;
+      }
+    }
+
+    chain->queue[(chain->queue_start + chain->queue_size) % MAX_SWAP_CHAIN_IMAGES] = image;
+    chain->queue_size++;
+    chain->queue_times[image] = std::chrono::steady_clock::now();
+  }
+  chain->image_queued.notify_one();
+}
+
+// Presents the frame by writing it to the frame buffer given to init_renderer,
+// or to a swap chain image that the present thread shows while the next frame is rendered
+void swap_buffers()
+{
+  // Nothing finished since the last swap
+  if(renderer_data.swapped_version == renderer_data.presented_version) return;
+  renderer_data.swapped_version = renderer_data.presented_version;
+
+  SwapChain *chain = &renderer_data.swap_chain;
+  if(!chain->num_images)
+  {
+    detile_color_buffer(renderer_data.frame_buffer, false);
+    return;
+  }
+
+  u32 image = acquire_swap_chain_image(chain);
+  detile_color_buffer(chain->images[image], chain->top_down);
+  queue_swap_chain_image(chain, image);
+}
+
+void create_swap_chain(u32 num_images, u32 **images, bool top_down, PresentMode mode, PresentFunction present, void *data)
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  assert(!chain->num_images);
+  assert(num_images >= 2 && num_images <= MAX_SWAP_CHAIN_IMAGES);
+
+  chain->owns_images = !images;
+  chain->top_down = top_down;
+  for(u32 i = 0; i < num_images; i++)
+  {
+    chain->images[i] = images ? images[i] : (u32 *)allocate_pages(renderer_data.num_pixels * sizeof(u32));
+    chain->image_free[i] = true;
+  }
+  chain->num_images = num_images;
+  chain->queue_start = 0;
+  chain->queue_size = 0;
+  chain->mode = mode;
+  chain->present = present;
+  chain->present_data = data;
+  chain->presenting = false;
+  chain->quitting = false;
+  chain->stats = {};
+  chain->thread = std::thread(present_thread);
+}
+
+void destroy_swap_chain()
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  if(!chain->num_images) return;
+
+  {
+    std::lock_guard<std::mutex> lock(chain->mutex);
+    chain->quitting = true;
+  }
+  chain->image_queued.notify_one();
+  chain->thread.join();
+
+  if(chain->owns_images)
+  {
+    for(u32 i = 0; i < chain->num_images; i++)
+    {
+      free_pages(chain->images[i], renderer_data.num_pixels * sizeof(u32));
+    }
+  }
+  chain->num_images = 0;
+}
+
+void set_present_mode(PresentMode mode)
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  std::lock_guard<std::mutex> lock(chain->mutex);
+  chain->mode = mode;
+}
+
+void wait_for_present()
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  std::unique_lock<std::mutex> lock(chain->mutex);
+  chain->image_released.wait(lock, [chain]{ return !chain->queue_size && !chain->presenting; });
+}
+
+SwapChainStats swap_chain_stats()
+{
+  SwapChain *chain = &renderer_data.swap_chain;
+  std::lock_guard<std::mutex> lock(chain->mutex);
+  return chain->stats;
+}
+
+// Writes the current frame to a linear BGRA8 buffer of screen_width * screen_height pixels
+void read_pixels(u32 *pixels)
+{
+  detile_color_buffer(pixels, false);
+}
+
+void set_blend_mode(BlendMode mode)
+{
+  renderer_data.blend_mode = mode;
+}
+
+void set_transparency_mode(TransparencyMode mode)
+{
+  renderer_data.transparency_mode = mode;
+}
+
+void set_lod_error(f32 pixels)
+{
+  renderer_data.lod_error_pixels = pixels;
+}
+
+void set_depth_prepass(bool enabled)
+{
+  renderer_data.depth_prepass = enabled;
+}
+
+void set_occlusion_culling(bool enabled)
+{
+  renderer_data.occlusion_culling = enabled;
+}
+
+void set_resolution_scale(f32 scale)
+{
+  renderer_data.resolution_scale = clamp(scale, 0.0f, 1.0f);
+}
+
+void set_dynamic_resolution(f32 target_frame_ms, f32 min_scale)
+{
+  renderer_data.target_frame_ms = target_frame_ms;
+  renderer_data.min_resolution_scale = clamp(min_scale, 0.0f, 1.0f);
+}
+
+f32 resolution_scale()
+{
+  return renderer_data.resolution_scale;
+}
+
+void set_incremental_rendering(bool enabled)
+{
+  renderer_data.incremental_rendering = enabled;
+}
+
+bool renderer_idle()
+{
+  return renderer_data.frame_skipped && renderer_data.swapped_version == renderer_data.presented_version;
+}
+
+void set_frame_latency(u32 frames)
+{
+  wait_for_back_end();
+  renderer_data.frame_latency = min((s32)frames, NUM_FRAME_PACKETS - 1);
+}
+
+void exit_renderer()
+{
+  wait_for_back_end();
+  {
+    std::lock_guard<std::mutex> lock(renderer_data.back_end_mutex);
+    renderer_data.back_end_quitting = true;
+  }
+  renderer_data.back_end_wake.notify_one();
+  renderer_data.back_end_thread.join();
+
+  destroy_swap_chain();
+
+  exit_job_system();
+
+  // Nothing runs on the threads anymore, so everything init_renderer and
+  // load_model allocated can go
+  for(u32 i = 0; i < renderer_data.models.size(); i++)
+  {
+    Model *model = renderer_data.models[i];
+    if(model->mesh_cache) close_mesh_cache(model->mesh_cache);
+    if(model->texture) destroy_texture(model->texture);
+    delete model->bvh;
+    delete model;
+  }
+  renderer_data.models.clear();
+
+  destroy_command_buffer(renderer_data.immediate_commands);
+  renderer_data.immediate_commands = 0;
+
+  for(u32 i = 0; i < NUM_FRAME_PACKETS; i++)
+  {
+    free_pages(renderer_data.color_buffers[i], renderer_data.buffer_pixels * sizeof(u32));
+    renderer_data.color_buffers[i] = 0;
+  }
+  renderer_data.color_buffer = 0;
+  renderer_data.presented_color_buffer = 0;
+  free_pages(renderer_data.depth_buffer, renderer_data.buffer_pixels * sizeof(f32));
+  renderer_data.depth_buffer = 0;
+  for(u32 i = 0; i < MAX_SHADOW_MAPS; i++)
+  {
+    if(renderer_data.shadow_depths[i]) free_pages(renderer_data.shadow_depths[i], SHADOW_MAP_SIZE * SHADOW_MAP_SIZE * sizeof(f32));
+    renderer_data.shadow_depths[i] = 0;
+  }
+
+  delete [] renderer_data.column_offsets;
+  delete [] renderer_data.row_offsets;
+  delete [] renderer_data.shadow_column_offsets;
+  delete [] renderer_data.shadow_row_offsets;
+  delete [] renderer_data.upscale_columns;
+  delete [] renderer_data.upscale_next_columns;
+  delete [] renderer_data.upscale_column_weights;
+  delete [] renderer_data.occlusion_tiles;
+  delete [] renderer_data.tile_min_depth;
+  delete [] renderer_data.tile_max_depth;
+  renderer_data.column_offsets = 0;
+  renderer_data.row_offsets = 0;
+  renderer_data.shadow_column_offsets = 0;
+  renderer_data.shadow_row_offsets = 0;
+  renderer_data.upscale_columns = 0;
+  renderer_data.upscale_next_columns = 0;
+  renderer_data.upscale_column_weights = 0;
+  renderer_data.occlusion_tiles = 0;
+  renderer_data.tile_min_depth = 0;
+  renderer_data.tile_max_depth = 0;
 }
 
 
@@ -1,11 +1,213 @@
 #include "types.h"
+#include "my_math.h" // v3
+
+// How shaded pixels are combined with the frame buffer
+// The frame buffer holds premultiplied alpha so it can go straight to a layered window
+enum BlendMode
+{
+  BLEND_MODE_OPAQUE,        // Replace the pixel
+  BLEND_MODE_SRC_OVER,      // Straight alpha source over the pixel
+  BLEND_MODE_ADDITIVE,      // Add to the pixel
+  BLEND_MODE_PREMULTIPLIED  // Premultiplied alpha source over the pixel
+};
+
+// How translucent models (color alpha below 1) are drawn
+enum TransparencyMode
+{
+  TRANSPARENCY_MODE_BLEND,             // Blend in draw order with the blend mode
+  TRANSPARENCY_MODE_ORDER_INDEPENDENT  // Sort fragments per pixel after the opaque models
+};
 
 void init_renderer(u32 *frame_buffer, u32 width, u32 height);
 
+// Stops the back end, present and job threads
+void exit_renderer();
+
+// Moves the model and camera with the keyboard and mouse
+void update_stuff();
+
+// Draws the scene and everything from draw_instanced since the last frame
+// This records and submits a command buffer, see below
 void render();
 
+// The color buffer is cleared when the next frame is rendered
 void clear_frame_buffer();
 
+// Presents the last finished frame to the frame buffer given to init_renderer,
+// or queues it on the swap chain if there is one
 void swap_buffers();
 
+// How the swap chain treats frames that come faster than they are presented
+enum PresentMode
+{
+  PRESENT_MODE_FIFO,    // Every frame is presented in order, swap_buffers waits for a free image
+  PRESENT_MODE_MAILBOX  // Only the newest frame is presented, queued frames it replaces are dropped
+};
+
+// Called on the present thread with a linear BGRA8 image the size of the screen
+// The image is not written again until the function returns
+typedef void (*PresentFunction)(const u32 *image, u32 image_index, void *data);
+
+// Renders into a chain of 2 or 3 linear images that a present thread hands
+// to present, so the next frame is rendered while the last one is presented.
+// images can be 0 to have the renderer allocate them, and present can be 0
+// to render without showing anything (headless). The images have the bottom
+// row first like read_pixels, or the top row first if top_down is set.
+void create_swap_chain(u32 num_images, u32 **images, bool top_down, PresentMode mode, PresentFunction present, void *data);
+
+// Presents the queued frames and stops the present thread
+void destroy_swap_chain();
+
+void set_present_mode(PresentMode mode);
+
+// Waits until every queued frame is presented
+void wait_for_present();
+
+// The latency of a frame is the time from swap_buffers until present returns
+struct SwapChainStats
+{
+  u32 presented_frames;
+  u32 dropped_frames;
+
+  f32 last_latency_ms;
+  f32 max_latency_ms;
+  f64 total_latency_ms; // Divided by presented_frames for the average
+};
+
+SwapChainStats swap_chain_stats();
+
+// Writes the last finished frame to a linear BGRA8 buffer with the size of the screen
+void read_pixels(u32 *pixels);
+
+// Only the part of the screen where draws changed since the last frames is
+// drawn again, and frames where nothing changed are skipped. The default is on.
+void set_incremental_rendering(bool enabled);
+
+// Whether the last frame was skipped and swap_buffers has nothing new to
+// present, so the application can wait for input instead of rendering
+bool renderer_idle();
+
+// Frames are rendered at this part of the screen width and height, rounded down
+// to whole 8x8 tiles, and scaled up to the screen with a bilinear filter when
+// presented. The default is 1.
+void set_resolution_scale(f32 scale);
+
+// Moves the resolution scale between min_scale and 1 so the time the renderer
+// spends on a frame stays close to the target. A target of 0 turns it off and
+// leaves the scale where it is. Off by default.
+void set_dynamic_resolution(f32 target_frame_ms, f32 min_scale);
+
+f32 resolution_scale();
+
+// Frames the rasterizing can fall behind the submitted frame, 0 or 1
+// With 1 the next frame goes through the front end (vertices and clipping)
+// while the last one is rasterized, and swap_buffers shows the frame before
+// the one just rendered. The default is 0.
+void set_frame_latency(u32 frames);
+
+// The settings that every frame starts with, command buffers can change them for the draws they record
+void set_blend_mode(BlendMode mode);
+
+void set_transparency_mode(TransparencyMode mode);
+
+// Rasterizes the depth of the opaque draws before shading anything, so each
+// pixel is shaded once instead of for every triangle that covers it. It pays
+// off when models overlap a lot on screen. The default is off.
+void set_depth_prepass(bool enabled);
+
+// Before the vertices of a frame are transformed, its biggest opaque models on
+// screen are rasterized into a coarse occlusion buffer. Instances and meshlets
+// that are completely behind them are not drawn. It pays off when most of the
+// scene is hidden, like inside buildings. The default is off.
+void set_occlusion_culling(bool enabled);
+
+// Models with LODs are drawn with the least detailed LOD that is off by at most this many pixels
+// The default is 1
+void set_lod_error(f32 pixels);
+
+// Loads name.obj through the mesh cache name.mesh, with the texture name.dds or name.tga
+// if there is one, and returns an index to refer to the model later
+u32 load_model(const char *name);
+
+// Instances draw a model with their own transform, translation * rotation around z * scale
+// Only instances in the view are drawn, found with a bounding volume hierarchy
+u32 add_instance(u32 model, v3 position, v3 scale, f32 rotation);
+
+void set_instance_transform(u32 instance, v3 position, v3 scale, f32 rotation);
+
+// What is under a point on the screen
+struct PickResult
+{
+  bool hit;
+  u32 instance;
+  u32 triangle;    // In the indices of the full mesh of the model, from 3 * triangle
+  v3 barycentrics; // The weights of the three vertices of the triangle
+  f32 depth;       // Distance in front of the camera
+};
+
+// Casts rays from the camera as it is now through points on the screen, in
+// pixels from the bottom left, against the triangles of the instances. The
+// closest front facing triangle of each ray is the result. Batches of points
+// are split over the job threads. Picking uses hierarchies of the scene and
+// the meshes and not the frame, so it can run any time and rendering does no
+// work for it.
+void pick(const v2 *points, u32 num_points, PickResult *results);
+
+// Draws a model once for each world matrix in the next render(), with the rgba
+// color of each instance or the model color if colors is 0. The mesh is decoded
+// once for all of them and instances outside the view are skipped.
+void draw_instanced(u32 model, u32 num_instances, const mat4 *worlds, const v4 *colors);
+
+// Lights are in world space and return an index to refer to the light later
+// Point and spot lights fade out completely at the radius
+// Spot light angles are in radians from the center of the cone
+u32 add_directional_light(v3 direction, v3 color);
+
+u32 add_point_light(v3 position, v3 color, f32 radius);
+
+u32 add_spot_light(v3 position, v3 direction, v3 color, f32 radius, f32 inner_angle, f32 outer_angle);
+
+void set_light_position(u32 light, v3 position);
+
+void set_light_direction(u32 light, v3 direction);
+
+// Directional and spot lights can cast shadows, from the opaque models drawn in
+// the frame, with a shadow map each for up to 4 lights. Point lights have none.
+// Off by default.
+void set_light_shadows(u32 light, bool enabled);
+
+void clear_lights();
+
 void poll_events();
+
+// Commands are recorded into command buffers and run when the buffers are
+// submitted. Threads can record into different buffers at the same time.
+// A submitted buffer is not changed, so the same frame can be submitted again.
+struct CommandBuffer;
+
+CommandBuffer *create_command_buffer();
+
+void destroy_command_buffer(CommandBuffer *buffer);
+
+// Removes the commands so the buffer can be recorded again
+void reset_command_buffer(CommandBuffer *buffer);
+
+// Settings for the draws recorded after them, until the end of the submit
+void record_blend_mode(CommandBuffer *buffer, BlendMode mode);
+
+void record_transparency_mode(CommandBuffer *buffer, TransparencyMode mode);
+
+void record_lod_error(CommandBuffer *buffer, f32 pixels);
+
+// The same as draw_instanced. The transforms and colors are copied.
+void record_draw_instanced(CommandBuffer *buffer, u32 model, u32 num_instances, const mat4 *worlds, const v4 *colors);
+
+// Records the scene instances that are in view of the camera as it is when recording
+// The scene has to be updated first and not change while recording
+void record_draw_scene(CommandBuffer *buffer);
+
+// Refits the scene hierarchy to the instances that moved
+void update_scene();
+
+// Renders a frame with the commands of the buffers in order
+void submit_command_buffers(CommandBuffer *const *buffers, u32 num_buffers);
@@ -0,0 +1,585 @@
+#include "texture.h"
+
+#include <assert.h> // assert
+#include <math.h> // floorf, log2f
+#include <string.h> // memcpy
+#include <emmintrin.h> // SSE2
+#include <atomic>
+
+// Spreads the bits of a texel coordinate inside a tile so x and y can be interleaved
+// x takes the even bits and y takes the odd bits
+static const u8 morton_x[TEXTURE_TILE_SIZE] = { 0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15 };
+static const u8 morton_y[TEXTURE_TILE_SIZE] = { 0x00, 0x02, 0x08, 0x0A, 0x20, 0x22, 0x28, 0x2A };
+
+static u32 texel_index(const TextureLevel *level, u32 x, u32 y)
+{
+  u32 tile = (y / TEXTURE_TILE_SIZE) * level->tiles_x + (x / TEXTURE_TILE_SIZE);
+  u32 offset = morton_x[x % TEXTURE_TILE_SIZE] | morton_y[y % TEXTURE_TILE_SIZE];
+  return tile * (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE) + offset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Block compression
+///////////////////////////////////////////////////////////////////////////////
+
+#define BLOCK_SIZE 4
+#define BLOCK_CACHE_SIZE 64
+
+static u32 block_bytes(TextureFormat format)
+{
+  return (format == TEXTURE_FORMAT_BC1) ? 8 : 16;
+}
+
+u32 compressed_level_size(TextureFormat format, u32 width, u32 height)
+{
+  u32 blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  u32 blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  return blocks_x * blocks_y * block_bytes(format);
+}
+
+// Expands a 5:6:5 color to BGRA8
+static u32 unpack_565(u16 color)
+{
+  u32 r = (color >> 11) & 0x1F;
+  u32 g = (color >> 5) & 0x3F;
+  u32 b = color & 0x1F;
+  r = (r << 3) | (r >> 2);
+  g = (g << 2) | (g >> 4);
+  b = (b << 3) | (b >> 2);
+  return b | (g << 8) | (r << 16) | 0xFF000000;
+}
+
+static u16 pack_565(u32 bgra)
+{
+  u32 b = (bgra >> 0) & 0xFF;
+  u32 g = (bgra >> 8) & 0xFF;
+  u32 r = (bgra >> 16) & 0xFF;
+  return (u16)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+// Mixes two BGRA8 colors as (a * weight_a + b * weight_b) / divisor per channel
+static u32 mix_colors(u32 a, u32 b, u32 weight_a, u32 weight_b, u32 divisor)
+{
+  u32 result = 0;
+  for(u32 channel = 0; channel < 32; channel += 8)
+  {
+    u32 value = (((a >> channel) & 0xFF) * weight_a + ((b >> channel) & 0xFF) * weight_b) / divisor;
+    result |= value << channel;
+  }
+  return result;
+}
+
+// Decodes the 8 byte color part of a block. BC3 always uses the four color mode.
+static void decode_color_block(const u8 *block, bool allow_transparent, u32 *texels)
+{
+  u16 color0 = block[0] | (block[1] << 8);
+  u16 color1 = block[2] | (block[3] << 8);
+
+  u32 palette[4];
+  palette[0] = unpack_565(color0);
+  palette[1] = unpack_565(color1);
+  if(color0 > color1 || !allow_transparent)
+  {
+    palette[2] = mix_colors(palette[0], palette[1], 2, 1, 3);
+    palette[3] = mix_colors(palette[0], palette[1], 1, 2, 3);
+  }
+  else
+  {
+    palette[2] = mix_colors(palette[0], palette[1], 1, 1, 2);
+    palette[3] = 0;
+  }
+
+  // One byte of 2 bit indices per row
+  for(u32 i = 0; i < 16; i++)
+  {
+    u32 index = (block[4 + i / 4] >> ((i % 4) * 2)) & 0x3;
+    texels[i] = palette[index];
+  }
+}
+
+// Decodes the 8 byte alpha part of a BC3 block into the alpha of the texels
+static void decode_alpha_block(const u8 *block, u32 *texels)
+{
+  u32 palette[8];
+  palette[0] = block[0];
+  palette[1] = block[1];
+  if(palette[0] > palette[1])
+  {
+    for(u32 i = 1; i < 7; i++) palette[i + 1] = (palette[0] * (7 - i) + palette[1] * i) / 7;
+  }
+  else
+  {
+    for(u32 i = 1; i < 5; i++) palette[i + 1] = (palette[0] * (5 - i) + palette[1] * i) / 5;
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+
+  // 48 bits of 3 bit indices
+  u64 bits = 0;
+  for(u32 i = 0; i < 6; i++) bits |= (u64)block[2 + i] << (i * 8);
+
+  for(u32 i = 0; i < 16; i++)
+  {
+    u32 index = (bits >> (i * 3)) & 0x7;
+    texels[i] = (texels[i] & 0x00FFFFFF) | (palette[index] << 24);
+  }
+}
+
+// Decodes a block into 16 BGRA8 texels in rows starting at the bottom
+static void decode_block(TextureFormat format, const u8 *block, u32 *texels)
+{
+  if(format == TEXTURE_FORMAT_BC1)
+  {
+    decode_color_block(block, true, texels);
+  }
+  else
+  {
+    decode_color_block(block + 8, false, texels);
+    decode_alpha_block(block, texels);
+  }
+}
+
+// Picks the closest palette entry for each texel in the block
+// Channels are compared as BGRA but only the channels in the mask count
+static u32 closest_index(u32 texel, const u32 *palette, u32 palette_size, u32 channel_mask)
+{
+  u32 best_index = 0;
+  u32 best_distance = 0xFFFFFFFF;
+  for(u32 i = 0; i < palette_size; i++)
+  {
+    u32 distance = 0;
+    for(u32 channel = 0; channel < 32; channel += 8)
+    {
+      if(!(channel_mask & (0xFF << channel))) continue;
+      s32 difference = (s32)((texel >> channel) & 0xFF) - (s32)((palette[i] >> channel) & 0xFF);
+      distance += difference * difference;
+    }
+
+    if(distance < best_distance)
+    {
+      best_distance = distance;
+      best_index = i;
+    }
+  }
+
+  return best_index;
+}
+
+// Encodes the color of 16 texels with the endpoints at the corners of their bounding box
+// This is not the best quality encoder but it is fast enough to run at load time
+static void encode_color_block(const u32 *texels, u8 *block)
+{
+  u32 min_color = 0xFFFFFFFF;
+  u32 max_color = 0;
+  for(u32 channel = 0; channel < 24; channel += 8)
+  {
+    u32 low = 255;
+    u32 high = 0;
+    for(u32 i = 0; i < 16; i++)
+    {
+      u32 value = (texels[i] >> channel) & 0xFF;
+      low = min((s32)low, (s32)value);
+      high = max((s32)high, (s32)value);
+    }
+
+    // Pull the endpoints in a little so the interpolated colors land closer to the texels
+    u32 inset = (high - low) / 16;
+    low += inset;
+    high -= inset;
+
+    min_color = (min_color & ~(0xFF << channel)) | (low << channel);
+    max_color = (max_color & ~(0xFF << channel)) | (high << channel);
+  }
+
+  u16 color0 = pack_565(max_color);
+  u16 color1 = pack_565(min_color);
+
+  // The first color must be larger to select the four color mode
+  if(color0 < color1)
+  {
+    u16 temp = color0;
+    color0 = color1;
+    color1 = temp;
+  }
+
+  block[0] = (u8)(color0 & 0xFF);
+  block[1] = (u8)(color0 >> 8);
+  block[2] = (u8)(color1 & 0xFF);
+  block[3] = (u8)(color1 >> 8);
+
+  u32 palette[4];
+  palette[0] = unpack_565(color0);
+  palette[1] = unpack_565(color1);
+  palette[2] = mix_colors(palette[0], palette[1], 2, 1, 3);
+  palette[3] = mix_colors(palette[0], palette[1], 1, 2, 3);
+
+  for(u32 row = 0; row < 4; row++)
+  {
+    u8 indices = 0;
+    if(color0 != color1)
+    {
+      for(u32 column = 0; column < 4; column++)
+      {
+        indices |= closest_index(texels[row * 4 + column], palette, 4, 0x00FFFFFF) << (column * 2);
+      }
+    }
+    block[4 + row] = indices;
+  }
+}
+
+static void encode_alpha_block(const u32 *texels, u8 *block)
+{
+  u32 low = 255;
+  u32 high = 0;
+  for(u32 i = 0; i < 16; i++)
+  {
+    u32 alpha = texels[i] >> 24;
+    low = min((s32)low, (s32)alpha);
+    high = max((s32)high, (s32)alpha);
+  }
+
+  block[0] = (u8)high;
+  block[1] = (u8)low;
+
+  // Use the eight alpha mode, the first endpoint is the larger one
+  u32 palette[8];
+  palette[0] = high << 24;
+  palette[1] = low << 24;
+  for(u32 i = 1; i < 7; i++) palette[i + 1] = ((high * (7 - i) + low * i) / 7) << 24;
+
+  u64 bits = 0;
+  if(high != low)
+  {
+    for(u32 i = 0; i < 16; i++)
+    {
+      bits |= (u64)closest_index(texels[i], palette, 8, 0xFF000000) << (i * 3);
+    }
+  }
+
+  for(u32 i = 0; i < 6; i++) block[2 + i] = (u8)(bits >> (i * 8));
+}
+
+// Compresses row-major texels into the blocks of a level
+static void compress_level(TextureLevel *level, TextureFormat format, const u32 *texels)
+{
+  u32 blocks_y = (level->height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  level->blocks_x = (level->width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  level->blocks = new u8[compressed_level_size(format, level->width, level->height)];
+
+  u32 bytes = block_bytes(format);
+  for(u32 block_y = 0; block_y < blocks_y; block_y++)
+  {
+    for(u32 block_x = 0; block_x < level->blocks_x; block_x++)
+    {
+      // Gather the block, repeating the edge texels of levels smaller than a block
+      u32 block_texels[16];
+      for(u32 y = 0; y < BLOCK_SIZE; y++)
+      {
+        for(u32 x = 0; x < BLOCK_SIZE; x++)
+        {
+          u32 texel_x = min((s32)(block_x * BLOCK_SIZE + x), (s32)level->width - 1);
+          u32 texel_y = min((s32)(block_y * BLOCK_SIZE + y), (s32)level->height - 1);
+          block_texels[y * BLOCK_SIZE + x] = texels[texel_y * level->width + texel_x];
+        }
+      }
+
+      u8 *block = level->blocks + (block_y * level->blocks_x + block_x) * bytes;
+      if(format == TEXTURE_FORMAT_BC1)
+      {
+        encode_color_block(block_texels, block);
+      }
+      else
+      {
+        encode_alpha_block(block_texels, block);
+        encode_color_block(block_texels, block + 8);
+      }
+    }
+  }
+}
+
+// Recently decoded blocks. Each thread has its own so the sampler never locks.
+// Blocks are looked up by their address and the id of their texture. The
+// address alone is unique only while the texture lives, a texture created
+// after it is destroyed can get the same memory.
+struct DecodedBlock
+{
+  u32 texture_id;
+  const u8 *block;
+  u32 texels[16];
+};
+
+static thread_local DecodedBlock block_cache[BLOCK_CACHE_SIZE];
+
+// Ids are never reused. 0 is left out so the empty cache entries match no texture.
+static std::atomic<u32> next_texture_id(1);
+
+static const u32 *decoded_block(const Texture *texture, const u8 *block)
+{
+  // Blocks are at least 8 bytes apart so the low bits do not help the hash
+  u32 slot = ((size_t)block >> 3) % BLOCK_CACHE_SIZE;
+
+  DecodedBlock *entry = &block_cache[slot];
+  if(entry->block != block || entry->texture_id != texture->id)
+  {
+    decode_block(texture->format, block, entry->texels);
+    entry->texture_id = texture->id;
+    entry->block = block;
+  }
+
+  return entry->texels;
+}
+
+static s32 wrap(s32 a, s32 size)
+{
+  s32 result = a % size;
+  return (result < 0) ? result + size : result;
+}
+
+// Averages a 2x2 block of texels from the level above for each texel in the next level
+// Odd sizes repeat the last row or column
+static void downsample(const u32 *in, u32 in_width, u32 in_height, u32 *out, u32 out_width, u32 out_height)
+{
+  for(u32 y = 0; y < out_height; y++)
+  {
+    u32 y0 = min((s32)(y * 2), (s32)in_height - 1);
+    u32 y1 = min((s32)(y * 2 + 1), (s32)in_height - 1);
+
+    for(u32 x = 0; x < out_width; x++)
+    {
+      u32 x0 = min((s32)(x * 2), (s32)in_width - 1);
+      u32 x1 = min((s32)(x * 2 + 1), (s32)in_width - 1);
+
+      u32 t[4];
+      t[0] = in[y0 * in_width + x0];
+      t[1] = in[y0 * in_width + x1];
+      t[2] = in[y1 * in_width + x0];
+      t[3] = in[y1 * in_width + x1];
+
+      u32 result = 0;
+      for(u32 channel = 0; channel < 32; channel += 8)
+      {
+        u32 sum = 2; // Round to nearest
+        for(u32 i = 0; i < 4; i++) sum += (t[i] >> channel) & 0xFF;
+        result |= (sum / 4) << channel;
+      }
+
+      out[y * out_width + x] = result;
+    }
+  }
+}
+
+// Copies row-major texels into the tiled layout of a level
+static void swizzle_level(TextureLevel *level, const u32 *texels)
+{
+  u32 tiles_y = (level->height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+  level->tiles_x = (level->width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+
+  u32 num_texels = level->tiles_x * tiles_y * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+  level->texels = new u32[num_texels];
+  memset(level->texels, 0, num_texels * sizeof(u32));
+
+  for(u32 y = 0; y < level->height; y++)
+  {
+    for(u32 x = 0; x < level->width; x++)
+    {
+      level->texels[texel_index(level, x, y)] = texels[y * level->width + x];
+    }
+  }
+}
+
+Texture *create_texture(const u32 *texels, u32 width, u32 height, TextureFormat format)
+{
+  assert(width > 0 && height > 0);
+
+  Texture *texture = new Texture;
+  texture->id = next_texture_id++;
+  texture->format = format;
+  texture->width = width;
+  texture->height = height;
+  texture->num_levels = 0;
+
+  // Build each level from the row-major texels of the one above it
+  u32 *level_texels = new u32[width * height];
+  memcpy(level_texels, texels, width * height * sizeof(u32));
+
+  u32 level_width = width;
+  u32 level_height = height;
+  while(texture->num_levels < MAX_MIP_LEVELS)
+  {
+    TextureLevel *level = &texture->levels[texture->num_levels++];
+    *level = TextureLevel();
+    level->width = level_width;
+    level->height = level_height;
+    if(format == TEXTURE_FORMAT_BGRA8)
+    {
+      swizzle_level(level, level_texels);
+    }
+    else
+    {
+      compress_level(level, format, level_texels);
+    }
+
+    if(level_width == 1 && level_height == 1) break;
+
+    u32 next_width = max((s32)level_width / 2, 1);
+    u32 next_height = max((s32)level_height / 2, 1);
+    u32 *next_texels = new u32[next_width * next_height];
+    downsample(level_texels, level_width, level_height, next_texels, next_width, next_height);
+
+    delete [] level_texels;
+    level_texels = next_texels;
+    level_width = next_width;
+    level_height = next_height;
+  }
+
+  delete [] level_texels;
+
+  return texture;
+}
+
+Texture *create_compressed_texture(const u8 *blocks, u32 width, u32 height, u32 num_levels, TextureFormat format)
+{
+  assert(format != TEXTURE_FORMAT_BGRA8);
+  assert(width > 0 && height > 0);
+
+  Texture *texture = new Texture;
+  texture->id = next_texture_id++;
+  texture->format = format;
+  texture->width = width;
+  texture->height = height;
+  texture->num_levels = min((s32)num_levels, MAX_MIP_LEVELS);
+
+  u32 level_width = width;
+  u32 level_height = height;
+  for(u32 i = 0; i < texture->num_levels; i++)
+  {
+    TextureLevel *level = &texture->levels[i];
+    *level = TextureLevel();
+    level->width = level_width;
+    level->height = level_height;
+    level->blocks_x = (level_width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    u32 size = compressed_level_size(format, level_width, level_height);
+    level->blocks = new u8[size];
+    memcpy(level->blocks, blocks, size);
+    blocks += size;
+
+    level_width = max((s32)level_width / 2, 1);
+    level_height = max((s32)level_height / 2, 1);
+  }
+
+  return texture;
+}
+
+void destroy_texture(Texture *texture)
+{
+  if(!texture) return;
+
+  for(u32 i = 0; i < texture->num_levels; i++)
+  {
+    delete [] texture->levels[i].texels;
+    delete [] texture->levels[i].blocks;
+  }
+
+  delete texture;
+}
+
+f32 texture_lod(const Texture *texture, v2 duv_dx, v2 duv_dy)
+{
+  // Change in texels per pixel
+  v2 dx = v2(duv_dx.x * texture->width, duv_dx.y * texture->height);
+  v2 dy = v2(duv_dy.x * texture->width, duv_dy.y * texture->height);
+
+  // Use the larger footprint. Squared lengths are used so one log replaces the square root.
+  f32 max_length_squared = max(length_squared(dx), length_squared(dy));
+  if(max_length_squared <= 1.0f) return 0.0f;
+
+  f32 lod = 0.5f * log2f(max_length_squared);
+  return min(lod, (f32)(texture->num_levels - 1));
+}
+
+// Reads one texel of a level of the texture in any format
+static u32 fetch_texel(const Texture *texture, const TextureLevel *level, u32 x, u32 y)
+{
+  if(texture->format == TEXTURE_FORMAT_BGRA8)
+  {
+    return level->texels[texel_index(level, x, y)];
+  }
+
+  u32 block_index = (y / BLOCK_SIZE) * level->blocks_x + (x / BLOCK_SIZE);
+  const u32 *texels = decoded_block(texture, level->blocks + block_index * block_bytes(texture->format));
+  return texels[(y % BLOCK_SIZE) * BLOCK_SIZE + (x % BLOCK_SIZE)];
+}
+
+// Bilinear filter of one level returning (b, g, r, a) between 0 and 255
+static __m128 bilinear(const Texture *texture, const TextureLevel *level, v2 uv)
+{
+  // Texel centers are at half coordinates
+  f32 x = uv.x * level->width - 0.5f;
+  f32 y = uv.y * level->height - 0.5f;
+  f32 floor_x = floorf(x);
+  f32 floor_y = floorf(y);
+  f32 tx = x - floor_x;
+  f32 ty = y - floor_y;
+
+  s32 x0 = wrap((s32)floor_x, level->width);
+  s32 y0 = wrap((s32)floor_y, level->height);
+  s32 x1 = (x0 + 1 == (s32)level->width) ? 0 : x0 + 1;
+  s32 y1 = (y0 + 1 == (s32)level->height) ? 0 : y0 + 1;
+
+  __m128i quad = _mm_set_epi32(fetch_texel(texture, level, x1, y1),
+                               fetch_texel(texture, level, x0, y1),
+                               fetch_texel(texture, level, x1, y0),
+                               fetch_texel(texture, level, x0, y0));
+
+  // Widen the 8 bit channels of each texel to floats
+  __m128i zero = _mm_setzero_si128();
+  __m128i bottom = _mm_unpacklo_epi8(quad, zero);
+  __m128i top = _mm_unpackhi_epi8(quad, zero);
+  __m128 t00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bottom, zero));
+  __m128 t10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bottom, zero));
+  __m128 t01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(top, zero));
+  __m128 t11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(top, zero));
+
+  __m128 w00 = _mm_set1_ps((1.0f - tx) * (1.0f - ty));
+  __m128 w10 = _mm_set1_ps(tx * (1.0f - ty));
+  __m128 w01 = _mm_set1_ps((1.0f - tx) * ty);
+  __m128 w11 = _mm_set1_ps(tx * ty);
+
+  __m128 result = _mm_mul_ps(t00, w00);
+  result = _mm_add_ps(result, _mm_mul_ps(t10, w10));
+  result = _mm_add_ps(result, _mm_mul_ps(t01, w01));
+  result = _mm_add_ps(result, _mm_mul_ps(t11, w11));
+  return result;
+}
+
+static v4 to_color(__m128 bgra)
+{
+  f32 c[4];
+  _mm_storeu_ps(c, _mm_mul_ps(bgra, _mm_set1_ps(1.0f / 255.0f)));
+  return v4(c[2], c[1], c[0], c[3]);
+}
+
+v4 sample_bilinear(const Texture *texture, u32 level, v2 uv)
+{
+  assert(level < texture->num_levels);
+  return to_color(bilinear(texture, &texture->levels[level], uv));
+}
+
+v4 sample_trilinear(const Texture *texture, v2 uv, f32 lod)
+{
+  lod = clamp(lod, 0.0f, (f32)(texture->num_levels - 1));
+  u32 level = (u32)lod;
+  f32 t = lod - (f32)level;
+
+  __m128 result = bilinear(texture, &texture->levels[level], uv);
+
+  // Skip the second level when it would not contribute
+  if(t > 0.0f && level + 1 < texture->num_levels)
+  {
+    __m128 next = bilinear(texture, &texture->levels[level + 1], uv);
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_sub_ps(next, result), _mm_set1_ps(t)));
+  }
+
+  return to_color(result);
+}
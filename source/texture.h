@@ -0,0 +1,76 @@
+#pragma once
+
+#include "types.h"
+#include "my_math.h" // v2, v4
+
+#define MAX_MIP_LEVELS 16
+
+// Number of texels along each side of a texture tile
+#define TEXTURE_TILE_SIZE 8
+
+enum TextureFormat
+{
+  // Uncompressed, 4 bytes per texel
+  TEXTURE_FORMAT_BGRA8,
+
+  // Block compressed 4x4 texels at a time
+  TEXTURE_FORMAT_BC1, // 8 bytes per block, color with no alpha
+  TEXTURE_FORMAT_BC3  // 16 bytes per block, color with interpolated alpha
+};
+
+// One level of a mip chain
+//
+// Uncompressed texels are stored in 8x8 tiles with the texels of each tile in
+// Morton (Z) order, so texels that are close in 2D are close in memory. A 2x2
+// bilinear footprint almost always lands in the same cache line.
+//
+// Compressed levels are stored as rows of 4x4 blocks. The blocks are already
+// small enough that a bilinear footprint touches at most four of them.
+struct TextureLevel
+{
+  u32 width;
+  u32 height;
+
+  // TEXTURE_FORMAT_BGRA8
+  u32 tiles_x;
+  u32 *texels; // BGRA8, same as the frame buffer
+
+  // TEXTURE_FORMAT_BC1 and TEXTURE_FORMAT_BC3
+  u32 blocks_x;
+  u8 *blocks;
+};
+
+struct Texture
+{
+  u32 id; // Unique for every texture created, even after others are destroyed
+  TextureFormat format;
+
+  u32 width;
+  u32 height;
+
+  u32 num_levels;
+  TextureLevel levels[MAX_MIP_LEVELS];
+};
+
+// Creates a texture and its full mip chain from BGRA8 texels in rows starting at the bottom
+// Block compressed formats are encoded here, after the mip chain is built
+Texture *create_texture(const u32 *texels, u32 width, u32 height, TextureFormat format);
+
+// Creates a texture from blocks that are already compressed, such as the contents of a DDS file
+// The levels are packed one after the other starting from the largest, with rows of blocks starting at the bottom
+Texture *create_compressed_texture(const u8 *blocks, u32 width, u32 height, u32 num_levels, TextureFormat format);
+
+// Number of bytes of one level of a block compressed format
+u32 compressed_level_size(TextureFormat format, u32 width, u32 height);
+
+void destroy_texture(Texture *texture);
+
+// Finds the level of detail from the change in texture coordinates between neighboring pixels
+f32 texture_lod(const Texture *texture, v2 duv_dx, v2 duv_dy);
+
+// Samples a mip level with bilinear filtering. Texture coordinates wrap.
+// Returns the color as (r, g, b, a) between 0 and 1
+v4 sample_bilinear(const Texture *texture, u32 level, v2 uv);
+
+// Samples with bilinear filtering on the two mip levels closest to the lod and blends between them
+v4 sample_trilinear(const Texture *texture, v2 uv, f32 lod);